@@ -0,0 +1,64 @@
+#!/usr/bin/env nix-shell
+#!nix-shell -i python3 -p python3
+
+# Measures NAR compression throughput and ratio by copying the closure of a
+# store path into a fresh file:// binary cache with each compression setup.
+# Uses the NARs of whatever is in the local store, so pass something big and
+# representative (e.g. a NixOS system closure) as --path.
+
+import argparse
+import json
+import os
+import subprocess
+import tempfile
+import time
+
+arg_parser = argparse.ArgumentParser()
+arg_parser.add_argument('builds', nargs='+', help="Build directories to compare, containing bin/nix")
+arg_parser.add_argument('--path', type=str, required=True, help="Store path whose closure is compressed")
+arg_parser.add_argument('--setups', type=str,
+    default="compression=xz,compression=xz&parallel-compression=1,compression=zstd,compression=zstd&parallel-compression=1,compression=zstd&parallel-compression=1&compression-long-window=1",
+    help="Comma-separated list of binary cache store settings to compare")
+arg_parser.add_argument('--runs', type=int, default=3, help="Number of runs per build and setup")
+args = arg_parser.parse_args()
+
+flake_args = ["--extra-experimental-features", "nix-command"]
+
+def closure_nar_size(build):
+    infos = json.loads(subprocess.run(
+        [f"{build}/bin/nix", *flake_args, "path-info", "--json", "--recursive", args.path],
+        check=True, capture_output=True, text=True
+    ).stdout)
+    # older versions print a list, newer ones an object keyed by path
+    if isinstance(infos, dict):
+        infos = infos.values()
+    return sum(info["narSize"] for info in infos)
+
+def cache_file_size(cache_dir):
+    return sum(
+        os.path.getsize(f"{cache_dir}/nar/{name}") for name in os.listdir(f"{cache_dir}/nar")
+    )
+
+def run_once(build, setup):
+    with tempfile.TemporaryDirectory() as cache_dir:
+        start = time.monotonic()
+        subprocess.run(
+            [f"{build}/bin/nix", *flake_args, "copy", "--to", f"file://{cache_dir}?{setup}", args.path],
+            check=True
+        )
+        return time.monotonic() - start, cache_file_size(cache_dir)
+
+nar_size = closure_nar_size(args.builds[0])
+nar_mib = nar_size / (1 << 20)
+
+print("Benchmarks summary\n---\n")
+for setup in args.setups.split(","):
+    for build in args.builds:
+        runs = sorted(run_once(build, setup) for _ in range(args.runs))
+        median, compressed = runs[len(runs) // 2]
+        print(f"{build}/bin/nix copy --to 'file://...?{setup}' ({nar_mib:.0f} MiB of NARs)")
+        print("  median:   ", f"{median:.3f}s")
+        print("  range:    ", f"{runs[0][0]:.3f}s..{runs[-1][0]:.3f}s")
+        print("  MiB/sec:  ", f"{nar_mib / median:.0f}")
+        print("  ratio:    ", f"{nar_size / compressed:.2f}")
+        print("\n")
@@ -0,0 +1,69 @@
+#!/usr/bin/env nix-shell
+#!nix-shell -i python3 -p python3
+
+# Measures NAR serialisation throughput of `nix store dump-path` on a large
+# synthetic store path, both into a pipe (as when streaming to a client or
+# compressor) and into a regular file.
+
+import argparse
+import os
+import subprocess
+import tempfile
+import time
+
+arg_parser = argparse.ArgumentParser()
+arg_parser.add_argument('builds', nargs='+', help="Build directories to compare, containing bin/nix")
+arg_parser.add_argument('--size', type=int, default=4096, help="Total size of the dumped path in MiB")
+arg_parser.add_argument('--files', type=int, default=4, help="Number of files the size is spread over")
+arg_parser.add_argument('--runs', type=int, default=5, help="Number of runs per build and sink")
+args = arg_parser.parse_args()
+
+flake_args = ["--extra-experimental-features", "nix-command"]
+
+def make_tree(root, size_mib, files):
+    os.makedirs(root)
+    chunk = os.urandom(1 << 20)
+    per_file = size_mib // files
+    for i in range(files):
+        with open(f"{root}/file-{i}", "wb") as fd:
+            for _ in range(per_file):
+                fd.write(chunk)
+
+def run_once(build, env, store_path, sink):
+    start = time.monotonic()
+    if sink == "pipe":
+        dump = subprocess.Popen([f"{build}/bin/nix", *flake_args, "store", "dump-path", store_path], env=env, stdout=subprocess.PIPE)
+        # drain the pipe with a tool that doesn't touch the data
+        subprocess.run(["dd", "of=/dev/null", "bs=1M", "status=none"], stdin=dump.stdout, check=True)
+        dump.stdout.close()
+        if dump.wait() != 0:
+            raise RuntimeError("nix store dump-path failed")
+    else:
+        with tempfile.NamedTemporaryFile(dir=env["BENCH_TMP"]) as out:
+            subprocess.run([f"{build}/bin/nix", *flake_args, "store", "dump-path", store_path], env=env, stdout=out, check=True)
+    return time.monotonic() - start
+
+with tempfile.TemporaryDirectory() as tmp_dir:
+    env = os.environ.copy()
+    env["NIX_CONF_DIR"] = "/var/empty"
+    env["NIX_REMOTE"] = f"{tmp_dir}/store"
+    env["BENCH_TMP"] = tmp_dir
+
+    make_tree(f"{tmp_dir}/tree", args.size, args.files)
+    store_path = subprocess.run(
+        [f"{args.builds[0]}/bin/nix-store", "--add", f"{tmp_dir}/tree"],
+        env=env, check=True, capture_output=True, text=True
+    ).stdout.strip()
+    total = args.size - args.size % args.files
+
+    print("Benchmarks summary\n---\n")
+    for build in args.builds:
+        for sink in ["pipe", "file"]:
+            run_once(build, env, store_path, sink) # warmup run
+            times = sorted(run_once(build, env, store_path, sink) for _ in range(args.runs))
+            median = times[len(times) // 2]
+            print(f"{build}/bin/nix store dump-path > {sink} ({total} MiB)")
+            print("  median:   ", f"{median:.3f}s")
+            print("  range:    ", f"{times[0]:.3f}s..{times[-1]:.3f}s")
+            print("  MiB/sec:  ", f"{total / median:.0f}")
+            print("\n")
@@ -0,0 +1,67 @@
+#!/usr/bin/env nix-shell
+#!nix-shell -i python3 -p python3
+
+# Measures how fast a local store registers a large synthetic closure, by
+# feeding a generated registration file to `nix-store --load-db` against a
+# fresh chroot store for every run.
+
+import argparse
+import hashlib
+import os
+import random
+import subprocess
+import tempfile
+import time
+
+# Nix's base-32 alphabet (omits e, o, u and t).
+base32_chars = "0123456789abcdfghijklmnpqrsvwxyz"
+
+arg_parser = argparse.ArgumentParser()
+arg_parser.add_argument('builds', nargs='+', help="Build directories to compare, containing bin/nix-store")
+arg_parser.add_argument('--paths', type=int, default=100000, help="Number of store paths in the synthetic closure")
+arg_parser.add_argument('--max-refs', type=int, default=8, help="Maximum number of references per path")
+arg_parser.add_argument('--runs', type=int, default=3, help="Number of runs per build")
+arg_parser.add_argument('--seed', type=int, default=0)
+args = arg_parser.parse_args()
+
+def make_registration(n, max_refs, rng):
+    paths = []
+    for i in range(n):
+        hash_part = "".join(rng.choice(base32_chars) for _ in range(32))
+        paths.append(f"/nix/store/{hash_part}-bench-{i}")
+    lines = []
+    for i, path in enumerate(paths):
+        # Only refer to earlier paths so that the closure is acyclic.
+        refs = sorted(paths[j] for j in rng.sample(range(i), min(i, rng.randint(0, max_refs))))
+        lines.append(path)
+        lines.append(hashlib.sha256(path.encode()).hexdigest())
+        lines.append(str(rng.randint(1, 1 << 20)))
+        lines.append("") # deriver
+        lines.append(str(len(refs)))
+        lines.extend(refs)
+    return "\n".join(lines) + "\n"
+
+def run_once(build, registration_file):
+    with tempfile.TemporaryDirectory() as store_root:
+        env = os.environ.copy()
+        env["NIX_CONF_DIR"] = "/var/empty"
+        env["NIX_REMOTE"] = store_root
+        with open(registration_file) as stdin:
+            start = time.monotonic()
+            subprocess.run([f"{build}/bin/nix-store", "--load-db"], stdin=stdin, env=env, check=True)
+            return time.monotonic() - start
+
+with tempfile.TemporaryDirectory() as tmp_dir:
+    registration_file = f"{tmp_dir}/registration"
+    with open(registration_file, "w") as fd:
+        fd.write(make_registration(args.paths, args.max_refs, random.Random(args.seed)))
+
+    print("Benchmarks summary\n---\n")
+    for build in args.builds:
+        times = sorted(run_once(build, registration_file) for _ in range(args.runs))
+        median = times[len(times) // 2]
+        print(f"{build}/bin/nix-store --load-db ({args.paths} paths)")
+        print("  median:   ", f"{median:.3f}s")
+        print("  range:    ", f"{times[0]:.3f}s..{times[-1]:.3f}s")
+        print("  paths/sec:", f"{args.paths / median:.0f}")
+        print("\n")
@@ -1,8 +1,10 @@
 #include <algorithm>
 #include <chrono>
+#include <map>
 #include <set>
 #include <memory>
 #include <tuple>
+#include <sys/stat.h>
 #if __APPLE__
 #include <sys/time.h>
 #endif
@@ -47,6 +49,78 @@ static AutoCloseFD openSlotLock(const Machine & m, uint64_t slot)
     return openLockFile(fmt("%s/%s-%d", currentLoad, makeLockFilename(m.storeUri), slot), true);
 }
 
+/**
+ * How long a machine that could not be connected to is skipped by all
+ * build hooks of this host.
+ */
+static constexpr auto downRetryDelay = std::chrono::seconds(60);
+
+static std::string downFileFor(const Machine & m)
+{
+    return fmt("%s/%s.down", currentLoad, makeLockFilename(m.storeUri));
+}
+
+static bool isDown(const Machine & m)
+{
+    struct stat st;
+    if (stat(downFileFor(m).c_str(), &st) == -1)
+        return false;
+    return time(nullptr) - st.st_mtime < downRetryDelay.count();
+}
+
+static void markDown(const Machine & m)
+{
+    try {
+        writeFile(downFileFor(m), "");
+    } catch (SysError & e) {
+        debug("cannot mark '%s' as down: %s", m.storeUri, e.msg());
+    }
+}
+
+static void markUp(const Machine & m)
+{
+    unlink(downFileFor(m).c_str());
+}
+
+/**
+ * Store paths (by base name) that are known to be valid on a machine,
+ * and when that was last confirmed, shared by all build hooks through a
+ * file in `current-load` that is only accessed under the upload lock.
+ */
+using KnownPaths = std::map<std::string, time_t>;
+
+static KnownPaths readKnownPaths(const Path & file)
+{
+    KnownPaths knownPaths;
+    try {
+        for (auto & line : tokenizeString<Strings>(readFile(file), "\n")) {
+            auto space = line.find(' ');
+            if (space == std::string::npos) continue;
+            if (auto time = string2Int<time_t>(line.substr(0, space)))
+                knownPaths.insert_or_assign(line.substr(space + 1), *time);
+        }
+    } catch (SysError & e) {
+        if (e.errNo != ENOENT)
+            debug("cannot read '%s': %s", file, e.msg());
+    }
+    return knownPaths;
+}
+
+static void writeKnownPaths(const Path & file, const KnownPaths & knownPaths, time_t expired)
+{
+    std::string contents;
+    for (auto & [path, time] : knownPaths)
+        if (time > expired)
+            contents += fmt("%d %s\n", time, path);
+    try {
+        auto tmp = fmt("%s.tmp-%d", file, getpid());
+        writeFile(tmp, contents);
+        renameFile(tmp, file);
+    } catch (SysError & e) {
+        debug("cannot write '%s': %s", file, e.msg());
+    }
+}
+
 static bool allSupportedLocally(Store & store, const std::set<std::string>& requiredFeatures) {
     for (auto & feature : requiredFeatures)
         if (!store.config().systemFeatures.get().count(feature)) return false;
@@ -150,6 +224,14 @@ static int main_build_remote(AsyncIoRoot & aio, std::string programName, Strings
                         m.mandatoryMet(requiredFeatures))
                     {
                         rightType = true;
+
+                        /* Another build recently failed to connect to
+                           this machine, so treat it as busy. */
+                        if (isDown(m)) {
+                            debug("skipping remote machine '%s' that was recently unreachable", m.storeUri);
+                            continue;
+                        }
+
                         AutoCloseFD free;
                         uint64_t load = 0;
                         for (uint64_t slot = 0; slot < m.maxJobs; ++slot) {
@@ -246,6 +328,7 @@ static int main_build_remote(AsyncIoRoot & aio, std::string programName, Strings
                     sshStore = aio.blockOn(bestMachine->openStore());
                     aio.blockOn(sshStore->connect());
                     storeUri = bestMachine->storeUri;
+                    markUp(*bestMachine);
 
                 } catch (std::exception & e) { // NOLINT(lix-foreign-exceptions)
                     auto msg = chomp(drainFD(5, false));
@@ -253,6 +336,7 @@ static int main_build_remote(AsyncIoRoot & aio, std::string programName, Strings
                         bestMachine->storeUri, e.what(),
                         msg.empty() ? "" : ": " + msg);
                     bestMachine->enabled = false;
+                    markDown(*bestMachine);
                     continue;
                 }
 
@@ -285,14 +369,38 @@ connected:
 
         {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("copying dependencies to '%s'", storeUri));
+
+            /* Skip the inputs that this or another build recently found
+               on or uploaded to the machine. Since builds for the same
+               machine upload one at a time, this also keeps concurrent
+               builds from checking and uploading the same paths. */
+            time_t ttl = settings.buildersKnownPathsTtl;
+            auto knownPathsFile = currentLoad + "/" + makeLockFilename(storeUri) + ".known-paths";
+            auto knownPaths = ttl > 0 ? readKnownPaths(knownPathsFile) : KnownPaths{};
+            auto now = time(nullptr);
+
+            StorePathSet toCopy;
+            for (auto & path : store->parseStorePathSet(inputs)) {
+                auto known = knownPaths.find(std::string(path.to_string()));
+                if (known == knownPaths.end() || now - known->second >= ttl)
+                    toCopy.insert(path);
+            }
+            debug("%d of %d inputs are known to be on '%s'", inputs.size() - toCopy.size(), inputs.size(), storeUri);
+
             aio.blockOn(copyPaths(
                 *store,
                 *sshStore,
-                store->parseStorePathSet(inputs),
+                toCopy,
                 NoRepair,
                 NoCheckSigs,
                 substitute
             ));
+
+            if (ttl > 0) {
+                for (auto & path : toCopy)
+                    knownPaths.insert_or_assign(std::string(path.to_string()), now);
+                writeKnownPaths(knownPathsFile, knownPaths, now - ttl);
+            }
         }
 
         uploadLock.reset();
@@ -1,24 +1,31 @@
 #include "lix/libutil/archive.hh"
 #include "lix/libstore/binary-cache-store.hh"
+#include "lix/libutil/chunking.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/compression.hh"
 #include "lix/libstore/derivations.hh"
 #include "lix/libstore/fs-accessor.hh"
+#include "lix/libstore/globals.hh"
 #include "lix/libstore/nar-info.hh"
+#include "lix/libstore/narinfo-index.hh"
 #include "lix/libutil/json.hh"
 #include "lix/libutil/result.hh"
 #include "lix/libutil/sync.hh"
 #include "lix/libstore/remote-fs-accessor.hh"
 #include "lix/libstore/nar-info-disk-cache.hh" // IWYU pragma: keep
 #include "lix/libstore/nar-accessor.hh"
+#include "lix/libutil/read-ahead.hh"
 #include "lix/libstore/temporary-dir.hh"
 #include "lix/libutil/thread-pool.hh"
 #include "lix/libutil/signals.hh"
 #include "lix/libutil/strings.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <regex>
 #include <fstream>
+#include <random>
 #include <sstream>
 
 namespace nix {
@@ -69,6 +76,46 @@ void BinaryCacheStore::upsertFile(const std::string & path,
     upsertFile(path, std::make_shared<std::stringstream>(std::move(data)), mimeType);
 }
 
+std::unique_ptr<BinaryCacheStore::Upload>
+BinaryCacheStore::beginUpload(const std::string & tempPath, const std::string & mimeType)
+{
+    struct TempFileUpload : Upload
+    {
+        BinaryCacheStore & store;
+        std::string mimeType;
+        AutoCloseFD fd;
+        Path fn;
+        AutoDelete autoDelete;
+        FdSink sink;
+
+        TempFileUpload(BinaryCacheStore & store, const std::string & mimeType, std::pair<AutoCloseFD, Path> temp)
+            : store(store)
+            , mimeType(mimeType)
+            , fd(std::move(temp.first))
+            , fn(std::move(temp.second))
+            , autoDelete(fn)
+            , sink(fd.get())
+        {
+        }
+
+        void operator()(std::string_view data) override
+        {
+            sink(data);
+        }
+
+        std::string commit(const std::string & path) override
+        {
+            sink.flush();
+            store.upsertFile(
+                path, std::make_shared<std::fstream>(fn, std::ios_base::in | std::ios_base::binary), mimeType
+            );
+            return path;
+        }
+    };
+
+    return std::make_unique<TempFileUpload>(*this, mimeType, createTempFile());
+}
+
 std::optional<std::string> BinaryCacheStore::getFileContents(const std::string & path)
 {
     try {
@@ -78,6 +125,136 @@ std::optional<std::string> BinaryCacheStore::getFileContents(const std::string &
     }
 }
 
+kj::Promise<Result<std::optional<std::string>>>
+BinaryCacheStore::getFileContentsAsync(const std::string & path)
+try {
+    return {result::success(getFileContents(path))};
+} catch (...) {
+    return {result::current_exception()};
+}
+
+std::optional<std::string>
+BinaryCacheStore::getFileRange(const std::string & path, uint64_t offset, uint64_t length)
+{
+    auto data = getFileContents(path);
+    if (!data)
+        return std::nullopt;
+    return data->substr(std::min<uint64_t>(offset, data->size()), length);
+}
+
+/**
+ * The amount of NAR in each frame of a seekable NAR.
+ */
+static constexpr size_t seekableNarFrameSize = 1024 * 1024;
+
+/**
+ * Compresses a NAR as a sequence of independent `zstd` frames, so that any
+ * frame can be decompressed by itself, and records where each frame starts
+ * in the NAR and in the compressed file.
+ */
+struct SeekableCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    CompressionOptions options;
+    std::string frame;
+    uint64_t narOffset = 0, fileOffset = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> frames;
+
+    SeekableCompressionSink(Sink & nextSink, CompressionOptions options)
+        : nextSink(nextSink)
+        , options(std::move(options))
+    {
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        while (!data.empty()) {
+            auto n = std::min(data.size(), seekableNarFrameSize - frame.size());
+            frame.append(data.substr(0, n));
+            data.remove_prefix(n);
+            if (frame.size() == seekableNarFrameSize)
+                writeFrame();
+        }
+    }
+
+    void writeFrame()
+    {
+        if (frame.empty())
+            return;
+        auto compressed = compress("zstd", frame, options);
+        nextSink(compressed);
+        frames.emplace_back(narOffset, fileOffset);
+        narOffset += frame.size();
+        fileOffset += compressed.size();
+        frame.clear();
+    }
+
+    void finish() override
+    {
+        flush();
+        writeFrame();
+    }
+};
+
+static std::string compressionExtension(std::string_view method)
+{
+    return method == "xz" ? ".xz"
+        : method == "bzip2" ? ".bz2"
+        : method == "zstd" ? ".zst"
+        : method == "lzip" ? ".lzip"
+        : method == "lz4" ? ".lz4"
+        : method == "br" ? ".br"
+        : "";
+}
+
+/**
+ * @return The path of the chunk with the given (SHA-256, base-32) hash of
+ * its uncompressed contents.
+ */
+static std::string chunkFileFor(std::string_view hash, std::string_view compression)
+{
+    return "chunks/" + std::string(hash) + compressionExtension(compression);
+}
+
+/**
+ * @return The path of the file recording where a NAR with the given hash
+ * and compression was uploaded to, on stores that cannot rename files.
+ */
+static std::string narRefFileFor(const Hash & narHash, std::string_view compression, bool seekable)
+{
+    return "nar/" + narHash.to_string(Base::Base32, false) + "-" + std::string(compression)
+        + (seekable ? "-seekable" : "") + ".ref";
+}
+
+std::optional<BinaryCacheStore::NarRef> BinaryCacheStore::readNarRef(const std::string & path)
+{
+    auto data = getFileContents(path);
+    if (!data)
+        return std::nullopt;
+
+    try {
+        auto json = json::parse(*data, "a NAR reference");
+        if (json.value("version", 0) != 1)
+            return std::nullopt;
+        NarRef ref{
+            .url = json.at("url").get<std::string>(),
+            .fileHash = Hash::parseAnyPrefixed(json.at("fileHash").get<std::string>()),
+            .fileSize = json.at("fileSize").get<uint64_t>(),
+        };
+        if (auto frames = json.find("frames"); frames != json.end())
+            ref.frames = frames->get<std::vector<std::pair<uint64_t, uint64_t>>>();
+        /* The NAR may have been deleted since. */
+        if (!fileExists(ref.url))
+            return std::nullopt;
+        return ref;
+    } catch (Error & e) {
+        warn("ignoring invalid NAR reference '%s' in '%s': %s", path, getUri(), e.msg());
+    } catch (JSON::exception & e) {
+        warn("ignoring invalid NAR reference '%s' in '%s': %s", path, getUri(), e.what());
+    }
+    return std::nullopt;
+}
+
 std::string BinaryCacheStore::narInfoFileFor(const StorePath & storePath)
 {
     return std::string(storePath.hashPart()) + ".narinfo";
@@ -105,34 +282,95 @@ try {
 
 kj::Promise<Result<ref<const ValidPathInfo>>> BinaryCacheStore::addToStoreCommon(
     AsyncInputStream & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
-    std::function<ValidPathInfo(HashResult)> mkInfo)
+    std::function<ValidPathInfo(HashResult)> mkInfo, std::optional<Hash> narHash)
 try {
-    auto [fdTemp, fnTemp] = createTempFile();
+    auto writePlain = !config().writeChunkedNars || config().writePlainNars;
+    auto seekable = writePlain && config().writeSeekableNar && config().compression != "none";
+    if (seekable && config().compression != "zstd")
+        throw Error("'write-seekable-nar' is not supported with compression method '%s'", config().compression.get());
+
+    /* Upload the NAR while it is being compressed. Its final name depends
+       on its hash, so stores that cannot rename files keep a unique name
+       instead. They cannot tell from that name whether the NAR is already
+       present, so they record it in a reference file named after the NAR
+       hash, which is checked before anything is uploaded. If the NAR hash
+       is not known in advance, they buffer the NAR in a temporary file and
+       upload it under its final name as before. */
+    std::unique_ptr<Upload> upload;
+    NullSink noUpload;
+    std::optional<std::string> narRefFile;
+    std::optional<NarRef> existingNar;
+    if (writePlain) {
+        if (!canRenameFiles() && narHash) {
+            narRefFile = narRefFileFor(*narHash, config().compression, seekable);
+            if (!repair)
+                existingNar = readNarRef(*narRefFile);
+            /* The listing of a seekable NAR needs the frames of the file
+               it refers to, which older references do not record. */
+            if (existingNar && seekable && !existingNar->frames)
+                existingNar.reset();
+        }
 
-    AutoDelete autoDelete(fnTemp);
+        if (!existingNar) {
+            std::random_device random;
+            std::string uploadId(32, '0');
+            for (auto & c : uploadId)
+                c = base32Chars[random() % base32Chars.size()];
+            auto tempPath = "nar/" + uploadId + ".nar" + compressionExtension(config().compression.get());
+            upload = canRenameFiles() || narRefFile
+                ? beginUpload(tempPath, "application/x-nix-nar")
+                : BinaryCacheStore::beginUpload(tempPath, "application/x-nix-nar");
+        }
+    }
 
     auto now1 = std::chrono::steady_clock::now();
 
-    /* Read the NAR simultaneously into a CompressionSink+FileSink (to
-       write the compressed NAR to disk), into a HashSink (to get the
-       NAR hash), and into a NarAccessor (to get the NAR listing). */
+    CompressionOptions options{
+        .parallel = config().parallelCompression,
+        .threads = config().compressionThreads,
+        .level = config().compressionLevel,
+        .longWindow = config().compressionLongWindow,
+    };
+
+    /* Store new chunks as they are found if the NAR is to be chunked. */
+    JSON chunks = JSON::array();
+    uint64_t chunksWritten = 0;
+    ChunkingSink chunker([&](std::string_view chunk) {
+        auto hash = hashString(HashType::SHA256, chunk).to_string(Base::Base32, false);
+        auto chunkFile = chunkFileFor(hash, config().compression);
+        if (!fileExists(chunkFile)) {
+            upsertFile(chunkFile, compress(config().compression, chunk, options), "application/octet-stream");
+            chunksWritten++;
+        }
+        chunks.push_back({{"hash", hash}, {"size", chunk.size()}});
+    });
+    NullSink noChunker;
+
+    /* Read the NAR simultaneously into a CompressionSink+Upload (to
+       upload the compressed NAR), into a HashSink (to get the NAR hash),
+       into a NarAccessor (to get the NAR listing) and, if enabled, into
+       the chunker. */
     HashSink fileHashSink { HashType::SHA256 };
     nar_index::Entry narIndex;
     HashSink narHashSink { HashType::SHA256 };
+    std::shared_ptr<SeekableCompressionSink> seekableSink;
     {
-        FdSink fileSink(fdTemp.get());
-        TeeSink teeSinkCompressed { fileSink, fileHashSink };
-        auto compressionSink = makeCompressionSink(
-            config().compression,
-            teeSinkCompressed,
-            config().parallelCompression,
-            config().compressionLevel
-        );
-        TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
+        TeeSink teeSinkCompressed { upload ? static_cast<Sink &>(*upload) : noUpload, fileHashSink };
+        std::shared_ptr<CompressionSink> compressionSink;
+        if (seekable)
+            compressionSink = seekableSink =
+                std::make_shared<SeekableCompressionSink>(teeSinkCompressed, options);
+        else
+            compressionSink = makeCompressionSink(
+                writePlain ? config().compression.get() : "none", teeSinkCompressed, options
+            ).get_ptr();
+        TeeSink teeSinkChunks { *compressionSink, config().writeChunkedNars ? static_cast<Sink &>(chunker) : noChunker };
+        TeeSink teeSinkUncompressed { teeSinkChunks, narHashSink };
         AsyncTeeInputStream teeSource { narSource, teeSinkUncompressed };
         narIndex = TRY_AWAIT(nar_index::create(teeSource));
         compressionSink->finish();
-        fileSink.flush();
+        if (config().writeChunkedNars)
+            chunker.finish();
     }
 
     auto now2 = std::chrono::steady_clock::now();
@@ -144,19 +382,39 @@ try {
     narInfo->fileHash = fileHash;
     narInfo->fileSize = fileSize;
     narInfo->url = "nar/" + narInfo->fileHash->to_string(Base::Base32, false) + ".nar"
-        + (config().compression == "xz" ? ".xz" :
-           config().compression == "bzip2" ? ".bz2" :
-           config().compression == "zstd" ? ".zst" :
-           config().compression == "lzip" ? ".lzip" :
-           config().compression == "lz4" ? ".lz4" :
-           config().compression == "br" ? ".br" :
-           "");
+        + compressionExtension(config().compression.get());
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
-    printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
-        printStorePath(narInfo->path), info.narSize,
-        ((1.0 - (double) fileSize / info.narSize) * 100.0),
-        duration);
+    if (writePlain)
+        printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
+            printStorePath(narInfo->path), info.narSize,
+            ((1.0 - (double) fileSize / info.narSize) * 100.0),
+            duration);
+
+    /* Write the manifest of the chunks. If there is no plain NAR, the
+       narinfo refers to the manifest instead. */
+    if (config().writeChunkedNars) {
+        JSON manifest = {
+            {"version", 1},
+            {"compression", config().compression.get()},
+            {"chunks", chunks},
+        };
+        auto manifestData = manifest.dump();
+        auto manifestHash = hashString(HashType::SHA256, manifestData);
+        narInfo->chunks = "nar/" + manifestHash.to_string(Base::Base32, false) + ".chunks";
+        printMsg(lvlTalkative, "copying path '%1%' (%2% bytes) to binary cache as %3% chunks, %4% of them new",
+            printStorePath(narInfo->path), info.narSize, chunks.size(), chunksWritten);
+
+        if (!writePlain) {
+            narInfo->url = narInfo->chunks;
+            narInfo->compression = "chunked";
+            narInfo->fileHash = manifestHash;
+            narInfo->fileSize = manifestData.size();
+        }
+
+        if (repair || !fileExists(narInfo->chunks))
+            upsertFile(narInfo->chunks, std::move(manifestData), "application/json");
+    }
 
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
@@ -169,13 +427,48 @@ try {
                 printStorePath(info.path), printStorePath(ref));
         }
 
+    /* Atomically make the NAR file available. An existing NAR with the
+       same contents is reused and the upload is aborted. */
+    if (!writePlain) {
+        /* Only chunks were written. */
+    } else if (existingNar) {
+        stats.narWriteAverted++;
+        narInfo->url = existingNar->url;
+        narInfo->fileHash = existingNar->fileHash;
+        narInfo->fileSize = existingNar->fileSize;
+    } else if (narRefFile) {
+        stats.narWrite++;
+        narInfo->url = upload->commit(narInfo->url);
+        JSON ref = {
+            {"version", 1},
+            {"url", narInfo->url},
+            {"fileHash", fileHash.to_string(Base::Base32, true)},
+            {"fileSize", fileSize},
+        };
+        if (seekableSink)
+            ref["frames"] = seekableSink->frames;
+        upsertFile(*narRefFile, ref.dump(), "application/json");
+    } else if (repair || !fileExists(narInfo->url)) {
+        stats.narWrite++;
+        narInfo->url = upload->commit(narInfo->url);
+    } else
+        stats.narWriteAverted++;
+    upload.reset();
+
     /* Optionally write a JSON file containing a listing of the
-       contents of the NAR. */
-    if (config().writeNARListing) {
+       contents of the NAR, and where its frames start if it is
+       seekable. */
+    if (config().writeNARListing || config().writeSeekableNar) {
         JSON j = {
             {"version", 1},
             {"root", listNar(narIndex)},
         };
+        /* A reused NAR may have been compressed with other settings, so
+           its frames are not the ones just computed. */
+        if (existingNar && existingNar->frames)
+            j["frames"] = *existingNar->frames;
+        else if (seekableSink)
+            j["frames"] = seekableSink->frames;
 
         upsertFile(std::string(info.path.hashPart()) + ".ls", j.dump(), "application/json");
     }
@@ -242,15 +535,6 @@ try {
         }
     }
 
-    /* Atomically write the NAR file. */
-    if (repair || !fileExists(narInfo->url)) {
-        stats.narWrite++;
-        upsertFile(narInfo->url,
-            std::make_shared<std::fstream>(fnTemp, std::ios_base::in | std::ios_base::binary),
-            "application/x-nix-nar");
-    } else
-        stats.narWriteAverted++;
-
     stats.narWriteBytes += info.narSize;
     stats.narWriteCompressedBytes += fileSize;
     stats.narWriteCompressionTimeMs += duration;
@@ -286,7 +570,57 @@ try {
         // assert(info.narHash == nar.first);
         // assert(info.narSize == nar.second);
         return info;
-    }}));
+    }}, info.narHash));
+    co_return result::success();
+} catch (...) {
+    co_return result::current_exception();
+}
+
+kj::Promise<Result<void>> BinaryCacheStore::addMultipleToStore(
+    PathsSource & pathsToCopy,
+    Activity & act,
+    RepairFlag repair,
+    CheckSigsFlag checkSigs)
+try {
+    TRY_AWAIT(Store::addMultipleToStore(pathsToCopy, act, repair, checkSigs));
+
+    if (config().writeNarInfoIndex && !pathsToCopy.empty()) {
+        StorePathSet added;
+        for (auto & [info, _] : pathsToCopy)
+            added.insert(info.path);
+        TRY_AWAIT(updateNarInfoIndex(added));
+    }
+
+    co_return result::success();
+} catch (...) {
+    co_return result::current_exception();
+}
+
+kj::Promise<Result<void>> BinaryCacheStore::updateNarInfoIndex(const StorePathSet & added)
+try {
+    std::vector<NarInfoIndex::Entry> entries;
+
+    /* Listing the whole cache after every batch would be far too
+       expensive on remote caches, so add to the existing index instead.
+       Entries of `.narinfo` files deleted since are kept; they only cost
+       clients a failed lookup when substituting. */
+    if (auto data = getFileContents(std::string(NarInfoIndex::fileName))) {
+        try {
+            entries = NarInfoIndex::parseEntries(*data);
+        } catch (Error & e) {
+            warn("replacing invalid narinfo index of '%s': %s", getUri(), e.msg());
+        }
+    }
+    for (auto & path : added)
+        entries.push_back(NarInfoIndex::entryFor(path));
+
+    upsertFile(
+        std::string(NarInfoIndex::fileName),
+        NarInfoIndex::write(std::move(entries)),
+        "application/octet-stream"
+    );
+    *narInfoIndex.lock() = std::nullopt;
+
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();
@@ -335,6 +669,128 @@ try {
     co_return result::current_exception();
 }
 
+/**
+ * Bulk queries are only answered from the index if the entries they need
+ * are at most this large, since they must be fetched in one request.
+ */
+static constexpr uint64_t maxNarInfoIndexRange = 16 * 1024 * 1024;
+
+/**
+ * How much of the index to fetch when looking at it for the first time.
+ * This is enough to get the whole index of a small cache in one go.
+ */
+static constexpr uint64_t narInfoIndexProbeSize = 64 * 1024;
+
+struct BinaryCacheStore::CachedNarInfoIndex
+{
+    NarInfoIndex header;
+    /**
+     * All entries, if they were part of the first request.
+     */
+    std::optional<std::string> entries;
+};
+
+std::shared_ptr<const BinaryCacheStore::CachedNarInfoIndex> BinaryCacheStore::getNarInfoIndex()
+{
+    auto cached(narInfoIndex.lock());
+    if (*cached)
+        return **cached;
+
+    std::shared_ptr<CachedNarInfoIndex> index;
+    try {
+        auto fileName = std::string(NarInfoIndex::fileName);
+        if (auto data = getFileRange(fileName, 0, narInfoIndexProbeSize)) {
+            auto headerSize = NarInfoIndex::headerSize(*data);
+            if (data->size() < headerSize) {
+                auto rest = getFileRange(fileName, data->size(), headerSize - data->size());
+                if (!rest)
+                    throw Error("narinfo index has disappeared");
+                *data += *rest;
+            }
+            index = std::make_shared<CachedNarInfoIndex>(NarInfoIndex::parseHeader(*data));
+            if (data->size() == headerSize + index->header.count * sizeof(NarInfoIndex::Entry))
+                index->entries = data->substr(headerSize);
+        }
+    } catch (SubstituterDisabled &) {
+        throw;
+    } catch (Error & e) {
+        warn("ignoring narinfo index of '%s': %s", getUri(), e.msg());
+        index = nullptr;
+    }
+
+    *cached = index;
+    return index;
+}
+
+std::optional<StorePathSet> BinaryCacheStore::queryValidPathsFromIndex(const StorePathSet & paths)
+{
+    auto index = getNarInfoIndex();
+    if (!index)
+        return std::nullopt;
+    auto & header = index->header;
+
+    std::vector<std::pair<StorePath, NarInfoIndex::Entry>> wanted;
+    size_t firstBucket = SIZE_MAX, lastBucket = 0;
+    for (auto & path : paths) {
+        auto entry = NarInfoIndex::entryFor(path);
+        auto bucket = header.bucketOf(entry);
+        firstBucket = std::min(firstBucket, bucket);
+        lastBucket = std::max(lastBucket, bucket);
+        wanted.emplace_back(path, entry);
+    }
+    if (wanted.empty())
+        return StorePathSet();
+
+    /* Fetch the entries of all buckets we need at once. */
+    auto first = header.bucketStart(firstBucket);
+    auto length = (header.bucketEnd(lastBucket) - first) * sizeof(NarInfoIndex::Entry);
+    std::string entries;
+    if (index->entries) {
+        entries = index->entries->substr(first * sizeof(NarInfoIndex::Entry), length);
+    } else {
+        if (length > maxNarInfoIndexRange)
+            return std::nullopt;
+        auto data = getFileRange(
+            std::string(NarInfoIndex::fileName),
+            header.headerSize() + first * sizeof(NarInfoIndex::Entry),
+            length
+        );
+        if (!data || data->size() != length) {
+            warn("ignoring narinfo index of '%s', which has changed unexpectedly", getUri());
+            *narInfoIndex.lock() = nullptr;
+            return std::nullopt;
+        }
+        entries = std::move(*data);
+    }
+
+    StorePathSet valid;
+    for (auto & [path, entry] : wanted) {
+        auto bucket = header.bucketOf(entry);
+        auto slice = std::string_view(entries).substr(
+            (header.bucketStart(bucket) - first) * sizeof(NarInfoIndex::Entry),
+            (header.bucketEnd(bucket) - header.bucketStart(bucket)) * sizeof(NarInfoIndex::Entry)
+        );
+        if (NarInfoIndex::contains(slice, entry))
+            valid.insert(path);
+    }
+    return valid;
+}
+
+kj::Promise<Result<StorePathSet>>
+BinaryCacheStore::queryValidPathsForSubstitution(const StorePathSet & paths)
+try {
+    /* The index may be out of date, so it is only used to look for
+       substitutes. Copying to the cache must not skip a path because of
+       a stale entry. A single path is cheaper to look up directly. */
+    if (paths.size() > 1) {
+        if (auto valid = queryValidPathsFromIndex(paths))
+            co_return std::move(*valid);
+    }
+    co_return TRY_AWAIT(queryValidPaths(paths));
+} catch (...) {
+    co_return result::current_exception();
+}
+
 kj::Promise<Result<std::optional<StorePath>>>
 BinaryCacheStore::queryPathFromHashPart(const std::string & hashPart)
 try {
@@ -349,6 +805,96 @@ try {
     co_return result::current_exception();
 }
 
+WireFormatGenerator BinaryCacheStore::readChunkedNar(const NarInfo & info)
+{
+    auto manifest = json::parse(getFile(info.url)->drain(), "a chunked NAR manifest");
+    if (manifest.value("version", 0) != 1)
+        throw Error("chunked NAR manifest '%s' has an unsupported version", info.url);
+
+    /* Fetching and checking the chunks lazily keeps only one of them in
+       memory at a time. */
+    return [](BinaryCacheStore & store, JSON manifest, std::string url) -> WireFormatGenerator {
+        auto compression = manifest.at("compression").get<std::string>();
+        uint64_t total = 0;
+        for (auto & chunk : manifest.at("chunks")) {
+            auto hash = chunk.at("hash").get<std::string>();
+            auto data = decompress(compression, store.getFile(chunkFileFor(hash, compression))->drain());
+            if (data.size() != chunk.at("size").get<uint64_t>()
+                || hashString(HashType::SHA256, data).to_string(Base::Base32, false) != hash)
+                throw Error("chunk '%s' of '%s' in binary cache '%s' is corrupt", hash, url, store.getUri());
+            co_yield std::span{data.data(), data.size()};
+            total += data.size();
+        }
+
+        store.stats.narRead++;
+        store.stats.narReadBytes += total;
+    }(*this, std::move(manifest), info.url);
+}
+
+/**
+ * How far decompression may run ahead of the reader of a NAR.
+ */
+static constexpr size_t decompressionReadAhead = 8 * 1024 * 1024;
+
+/**
+ * The number of NARs currently decompressed on a thread of their own, which
+ * `nar-decompression-threads` limits.
+ */
+static std::atomic<unsigned int> nrDecompressionThreads{0};
+
+/**
+ * A source of the decompressed contents of `file`, which is decompressed on
+ * a separate thread if `nar-decompression-threads` allows it. The download
+ * (see `download-buffer-size`), decompression and the reader (usually
+ * restoring the NAR) then all proceed at the same time.
+ */
+static box_ptr<Source> decompressNar(const std::string & compression, box_ptr<Source> file)
+{
+    struct DecompressingSource : Source
+    {
+        box_ptr<Source> file;
+        std::unique_ptr<Source> decompressor;
+        bool ownsThread;
+
+        DecompressingSource(const std::string & compression, box_ptr<Source> file, bool ownsThread)
+            : file(std::move(file))
+            , decompressor(makeDecompressionSource(compression, *this->file))
+            , ownsThread(ownsThread)
+        {
+        }
+
+        ~DecompressingSource()
+        {
+            if (ownsThread)
+                nrDecompressionThreads--;
+        }
+
+        size_t read(char * data, size_t len) override
+        {
+            return decompressor->read(data, len);
+        }
+
+        void cancel() override
+        {
+            file->cancel();
+        }
+    };
+
+    if (compression == "none" || compression == "")
+        return file;
+
+    auto running = nrDecompressionThreads.load();
+    while (running < settings.narDecompressionThreads) {
+        if (nrDecompressionThreads.compare_exchange_weak(running, running + 1))
+            return make_box_ptr<ReadAheadSource>(
+                make_box_ptr<DecompressingSource>(compression, std::move(file), true),
+                decompressionReadAhead
+            );
+    }
+
+    return make_box_ptr<DecompressingSource>(compression, std::move(file), false);
+}
+
 kj::Promise<Result<box_ptr<Source>>> BinaryCacheStore::narFromPath(const StorePath & storePath)
 try {
     auto info_ = TRY_AWAIT(queryPathInfo(storePath)).try_cast<const NarInfo>();
@@ -356,13 +902,16 @@ try {
     auto & info = *info_;
 
     try {
+        if (info->compression == "chunked")
+            co_return make_box_ptr<GeneratorSource>(readChunkedNar(*info));
+
         auto file = getFile(info->url);
         co_return make_box_ptr<GeneratorSource>(
             [](auto info, auto file, auto & stats) -> WireFormatGenerator {
                 constexpr size_t buflen = 65536;
                 auto buf = std::make_unique<char[]>(buflen);
                 size_t total = 0;
-                auto decompressor = makeDecompressionSource(info->compression, *file);
+                auto decompressor = decompressNar(info->compression, std::move(file));
                 try {
                     while (true) {
                         const auto len = decompressor->read(buf.get(), buflen);
@@ -384,6 +933,179 @@ try {
     co_return result::current_exception();
 }
 
+/**
+ * Deltas reference all of their base, which must fit in the largest window
+ * zstd supports together with the new NAR.
+ */
+static constexpr uint64_t maxDeltaBaseSize = 1ULL << 30;
+
+kj::Promise<Result<box_ptr<Source>>>
+BinaryCacheStore::narFromPathUsingDeltas(const StorePath & storePath, Store & baseStore)
+try {
+    auto info_ = TRY_AWAIT(queryPathInfo(storePath)).try_cast<const NarInfo>();
+    assert(info_ && "binary cache queryPathInfo didn't return a NarInfo");
+    auto & info = *info_;
+
+    for (auto & delta : info->deltas) {
+        if (info->compression != "chunked" && info->fileSize && delta.fileSize >= info->fileSize)
+            continue;
+        if (!TRY_AWAIT(baseStore.isValidPath(delta.base)))
+            continue;
+        auto baseInfo = TRY_AWAIT(baseStore.queryPathInfo(delta.base));
+        if (baseInfo->narHash != delta.baseNarHash || baseInfo->narSize > maxDeltaBaseSize)
+            continue;
+
+        std::optional<box_ptr<Source>> patch;
+        try {
+            patch = getFile(delta.url);
+        } catch (NoSuchBinaryCacheFile & e) {
+            debug("ignoring delta for '%s': %s", printStorePath(storePath), e.msg());
+            continue;
+        }
+        auto base = TRY_AWAIT(baseStore.narFromPath(delta.base))->drain();
+
+        debug(
+            "substituting '%s' from a delta of %d bytes against '%s'",
+            printStorePath(storePath),
+            delta.fileSize,
+            baseStore.printStorePath(delta.base)
+        );
+        co_return make_box_ptr<GeneratorSource>(
+            [](std::string base, box_ptr<Source> patch, auto & stats) -> WireFormatGenerator {
+                constexpr size_t buflen = 65536;
+                auto buf = std::make_unique<char[]>(buflen);
+                size_t total = 0;
+                auto decompressor = makePatchDecompressionSource("zstd", *patch, base);
+                try {
+                    while (true) {
+                        const auto len = decompressor->read(buf.get(), buflen);
+                        co_yield std::span{buf.get(), len};
+                        total += len;
+                    }
+                } catch (EndOfFile &) {
+                }
+
+                stats.narRead++;
+                stats.narReadBytes += total;
+            }(std::move(base), std::move(*patch), stats)
+        );
+    }
+
+    co_return TRY_AWAIT(narFromPath(storePath));
+} catch (...) {
+    co_return result::current_exception();
+}
+
+kj::Promise<Result<void>>
+BinaryCacheStore::addDelta(const StorePath & storePath, const StorePath & base)
+try {
+    // downcast: BinaryCacheStore always returns NarInfo from queryPathInfoUncached, making it sound
+    auto narInfo =
+        make_ref<NarInfo>(dynamic_cast<NarInfo const &>(*TRY_AWAIT(queryPathInfo(storePath))));
+    auto baseInfo = TRY_AWAIT(queryPathInfo(base));
+    if (baseInfo->narSize > maxDeltaBaseSize)
+        throw Error(
+            "cannot add a delta against '%s' because its NAR is larger than %d bytes",
+            printStorePath(base),
+            maxDeltaBaseSize
+        );
+
+    auto baseNar = TRY_AWAIT(narFromPath(base))->drain();
+    auto nar = TRY_AWAIT(narFromPath(storePath))->drain();
+
+    auto patch = compress(
+        "zstd",
+        nar,
+        {
+            .parallel = config().parallelCompression,
+            .threads = config().compressionThreads,
+            .level = config().compressionLevel,
+            .patchFrom = baseNar,
+        }
+    );
+
+    NarInfo::Delta delta{
+        .base = base,
+        .baseNarHash = baseInfo->narHash,
+        .url = "delta/" + hashString(HashType::SHA256, patch).to_string(Base::Base32, false)
+            + ".nar.zst",
+        .fileSize = patch.size(),
+    };
+    upsertFile(delta.url, std::move(patch), "application/x-nix-nar");
+
+    std::erase_if(narInfo->deltas, [&](auto & d) { return d.base == base; });
+    narInfo->deltas.push_back(std::move(delta));
+
+    TRY_AWAIT(writeNarInfo(narInfo));
+    co_return result::success();
+} catch (...) {
+    co_return result::current_exception();
+}
+
+kj::Promise<Result<std::shared_ptr<FSAccessor>>>
+BinaryCacheStore::getSeekableNarAccessor(const StorePath & storePath)
+try {
+    auto info_ = TRY_AWAIT(queryPathInfo(storePath)).try_cast<const NarInfo>();
+    assert(info_ && "binary cache queryPathInfo didn't return a NarInfo");
+    auto & info = *info_;
+
+    if (info->compression != "none" && info->compression != "zstd")
+        co_return nullptr;
+
+    auto listing = getFileContents(std::string(storePath.hashPart()) + ".ls");
+    if (!listing)
+        co_return nullptr;
+    auto json = json::parse(*listing, "a NAR listing");
+
+    /* Pairs of the offsets at which the frames start in the NAR and in the
+       compressed file. An uncompressed NAR is a single frame. */
+    std::vector<std::pair<uint64_t, uint64_t>> frames{{0, 0}};
+    uint64_t fileSize = info->narSize;
+    if (info->compression == "zstd") {
+        auto f = json.find("frames");
+        if (f == json.end() || !info->fileSize)
+            co_return nullptr;
+        frames = f->get<decltype(frames)>();
+        if (frames.empty() || frames[0] != std::pair<uint64_t, uint64_t>{0, 0}
+            || !std::ranges::is_sorted(frames))
+            throw Error("NAR listing of '%s' has an invalid frame table", printStorePath(storePath));
+        fileSize = info->fileSize;
+    }
+
+    auto getNarBytes = [this, url{info->url}, compression{info->compression}, frames, fileSize](
+                           uint64_t offset, uint64_t length
+                       ) -> std::string {
+        if (length == 0)
+            return "";
+
+        auto frameOf = [&](uint64_t narOffset) {
+            return std::prev(std::ranges::upper_bound(
+                frames, narOffset, {}, [](auto & frame) { return frame.first; }
+            ));
+        };
+        auto first = frameOf(offset);
+        auto last = frameOf(offset + length - 1);
+        auto fileStart = first->second;
+        auto fileEnd = std::next(last) == frames.end() ? fileSize : std::next(last)->second;
+
+        debug("fetching %d bytes of '%s' for %d bytes of NAR", fileEnd - fileStart, url, length);
+        auto data = getFileRange(url, fileStart, fileEnd - fileStart);
+        if (!data)
+            throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", url, getUri());
+        if (compression != "none")
+            *data = decompress(compression, *data);
+
+        auto skip = offset - first->first;
+        if (data->size() < skip + length)
+            throw Error("NAR '%s' in binary cache '%s' is shorter than its listing claims", url, getUri());
+        return data->substr(skip, length);
+    };
+
+    co_return makeLazyNarAccessor(json.at("root").dump(), std::move(getNarBytes)).get_ptr();
+} catch (...) {
+    co_return result::current_exception();
+}
+
 kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>>
 BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath)
 try {
@@ -391,11 +1113,16 @@ try {
     auto storePathS = printStorePath(storePath);
     auto act = std::make_shared<Activity>(*logger, lvlTalkative, actQueryPathInfo,
         fmt("querying info about '%s' on '%s'", storePathS, uri), Logger::Fields{storePathS, uri});
-    PushActivity pact(act->id);
 
     auto narInfoFile = narInfoFileFor(storePath);
 
-    auto data = getFileContents(narInfoFile);
+    /* Other coroutines may run while the file is fetched, so the
+       activity must not stay pushed. */
+    auto fetch = [&] {
+        PushActivity pact(act->id);
+        return getFileContentsAsync(narInfoFile);
+    }();
+    auto data = TRY_AWAIT(std::move(fetch));
 
     if (!data) co_return result::success(nullptr);
 
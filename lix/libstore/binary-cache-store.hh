@@ -10,6 +10,7 @@
 #include "lix/libutil/pool.hh"
 
 #include <atomic>
+#include <optional>
 
 namespace nix {
 
@@ -25,6 +26,38 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     const Setting<bool> writeNARListing{this, false, "write-nar-listing",
         "Whether to write a JSON file that lists the files in each NAR."};
 
+    const Setting<bool> writeSeekableNar{this, false, "write-seekable-nar",
+        R"(
+          Whether to make NARs seekable, so that clients can read single files
+          from the cache (e.g. with `nix store cat`) by fetching only the parts
+          of the NAR containing them. This implies `write-nar-listing`.
+
+          With `zstd` compression, NARs are compressed as a sequence of
+          independent frames of 1 MiB of NAR each, and the NAR listing
+          records where each frame starts. Any client can still decompress
+          such NARs as a whole. Uncompressed NARs are seekable by themselves.
+          Other compression methods are not supported.
+        )"};
+
+    const Setting<bool> writeChunkedNars{this, false, "write-chunked-nars",
+        R"(
+          Whether to store NARs as chunks, split at boundaries that depend on
+          their contents. Each chunk is compressed with `compression` and
+          stored only once, so similar NARs (e.g. consecutive builds of the
+          same package) share most of their chunks. The narinfo of each path
+          refers to a manifest listing the chunks of its NAR, from which
+          clients reassemble it.
+        )"};
+
+    const Setting<bool> writePlainNars{this, true, "write-plain-nars",
+        R"(
+          Whether to store NARs as single files as well if
+          `write-chunked-nars` is enabled. Clients download the single file if
+          there is one. Disabling this avoids storing NARs twice, but clients
+          that do not support chunked NARs cannot substitute the paths
+          copied to the cache afterwards.
+        )"};
+
     const Setting<bool> writeDebugInfo{this, false, "index-debug-info",
         R"(
           Whether to index DWARF debug info files by build ID. This allows [`dwarffs`](https://github.com/edolstra/dwarffs) to
@@ -40,6 +73,28 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     const Setting<bool> parallelCompression{this, false, "parallel-compression",
         "Enable multi-threaded compression of NARs. This is currently only available for `xz` and `zstd`."};
 
+    const Setting<unsigned int> compressionThreads{this, 0, "compression-threads",
+        "Number of threads to use for `parallel-compression`. `0` uses one thread per CPU core."};
+
+    const Setting<bool> compressionLongWindow{this, false, "compression-long-window",
+        R"(
+          Whether to look for repetitions in a 128 MiB window when compressing
+          NARs with `zstd`, like `zstd --long`. This improves compression of
+          large NARs at the cost of memory, and needs no special support from
+          clients.
+        )"};
+
+    const Setting<bool> writeNarInfoIndex{this, false, "write-narinfo-index",
+        R"(
+          Whether to keep a `narinfo-index` file up to date in the cache, which
+          lets clients check the validity of many paths with a single request.
+          The index is updated after every batch of paths copied to the cache,
+          e.g. by `nix copy`. Paths added to the cache in any other way will
+          not be substituted by clients that use the index until they are
+          copied again. Clients only use the index to look for substitutes;
+          copying to the cache always checks each path's `.narinfo`.
+        )"};
+
     const Setting<int> compressionLevel{this, -1, "compression-level",
         R"(
           The *preset level* to be used when compressing NARs.
@@ -70,6 +125,8 @@ protected:
 
 public:
 
+    inline static std::string operationName = "Binary cache";
+
     BinaryCacheStoreConfig & config() override = 0;
     const BinaryCacheStoreConfig & config() const override = 0;
 
@@ -84,6 +141,41 @@ public:
         std::string && data,
         const std::string & mimeType);
 
+    /**
+     * A file that is uploaded while it is being written, so that it need
+     * not be buffered first. Uploads that are destroyed before they are
+     * committed are aborted.
+     */
+    struct Upload : Sink
+    {
+        /**
+         * Finish the upload and make the file available as `path`, or as
+         * the path the upload was begun with if the store cannot rename
+         * files.
+         *
+         * @return The path of the file.
+         */
+        virtual std::string commit(const std::string & path) = 0;
+    };
+
+    /**
+     * Begin uploading a file whose final path (e.g. one containing its
+     * hash) is only known once it is complete. Stores that cannot rename
+     * files upload it to `tempPath`, which must be unique. The default
+     * implementation buffers the file in a temporary file and upserts it
+     * when the upload is committed.
+     */
+    virtual std::unique_ptr<Upload> beginUpload(const std::string & tempPath, const std::string & mimeType);
+
+    /**
+     * Whether uploads begun by `beginUpload()` can be committed under a
+     * different path.
+     */
+    virtual bool canRenameFiles()
+    {
+        return true;
+    }
+
     /**
      * Dump the contents of the specified file to a sink.
      */
@@ -91,6 +183,24 @@ public:
 
     virtual std::optional<std::string> getFileContents(const std::string & path);
 
+    /**
+     * Like `getFileContents()`, but lets other coroutines run while the
+     * file is being fetched. The default implementation blocks.
+     */
+    virtual kj::Promise<Result<std::optional<std::string>>>
+    getFileContentsAsync(const std::string & path);
+
+    /**
+     * @return Up to `length` bytes of the file at `path` starting at
+     * `offset`, or `std::nullopt` if the file does not exist.
+     */
+    virtual std::optional<std::string>
+    getFileRange(const std::string & path, uint64_t offset, uint64_t length);
+
+protected:
+
+    std::string narInfoFileFor(const StorePath & storePath);
+
 public:
 
     virtual kj::Promise<Result<void>> init() override;
@@ -99,18 +209,79 @@ private:
 
     std::string narMagic;
 
-    std::string narInfoFileFor(const StorePath & storePath);
+    struct CachedNarInfoIndex;
+
+    /**
+     * The header of the cache's `narinfo-index`, or null if it does not
+     * publish one. Unset until first needed.
+     */
+    Sync<std::optional<std::shared_ptr<const CachedNarInfoIndex>>> narInfoIndex;
+
+    std::shared_ptr<const CachedNarInfoIndex> getNarInfoIndex();
+
+    /**
+     * @return The valid subset of `paths` according to the cache's
+     * `narinfo-index`, or `std::nullopt` if the index cannot answer the
+     * query with a single request.
+     */
+    std::optional<StorePathSet> queryValidPathsFromIndex(const StorePathSet & paths);
+
+    kj::Promise<Result<void>> updateNarInfoIndex(const StorePathSet & added);
 
     kj::Promise<Result<void>> writeNarInfo(ref<NarInfo> narInfo);
 
+    /**
+     * @return An accessor for `storePath` that fetches only the parts of
+     * its NAR it needs, or null if the cache does not support this for the
+     * path (see `write-seekable-nar`).
+     */
+    kj::Promise<Result<std::shared_ptr<FSAccessor>>> getSeekableNarAccessor(const StorePath & storePath);
+
+    /**
+     * Reassemble a NAR stored as chunks (see `write-chunked-nars`).
+     */
+    WireFormatGenerator readChunkedNar(const NarInfo & info);
+
+    friend class RemoteFSAccessor;
+
+    /**
+     * Where a NAR was uploaded to on a store that cannot rename files.
+     */
+    struct NarRef
+    {
+        std::string url;
+        Hash fileHash;
+        uint64_t fileSize;
+        /**
+         * Where the frames of a seekable NAR start (see
+         * `SeekableCompressionSink::frames`). A recompressed NAR may have
+         * different frames, so they must come from the referenced file.
+         */
+        std::optional<std::vector<std::pair<uint64_t, uint64_t>>> frames;
+    };
+
+    /**
+     * @return The NAR reference at `path`, if it exists and the NAR it
+     * refers to does too.
+     */
+    std::optional<NarRef> readNarRef(const std::string & path);
+
+    /**
+     * @param narHash The hash of the NAR, if it is known before it has
+     * been read.
+     */
     kj::Promise<Result<ref<const ValidPathInfo>>> addToStoreCommon(
         AsyncInputStream & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
-        std::function<ValidPathInfo(HashResult)> mkInfo);
+        std::function<ValidPathInfo(HashResult)> mkInfo,
+        std::optional<Hash> narHash = std::nullopt);
 
 public:
 
     kj::Promise<Result<bool>> isValidPathUncached(const StorePath & path) override;
 
+    kj::Promise<Result<StorePathSet>>
+    queryValidPathsForSubstitution(const StorePathSet & paths) override;
+
     kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>>
     queryPathInfoUncached(const StorePath & path) override;
 
@@ -120,6 +291,12 @@ public:
     kj::Promise<Result<void>> addToStore(const ValidPathInfo & info, AsyncInputStream & narSource,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    kj::Promise<Result<void>> addMultipleToStore(
+        PathsSource & pathsToCopy,
+        Activity & act,
+        RepairFlag repair,
+        CheckSigsFlag checkSigs) override;
+
     kj::Promise<Result<StorePath>> addToStoreFromDump(
         AsyncInputStream & dump,
         std::string_view name,
@@ -153,6 +330,16 @@ public:
 
     kj::Promise<Result<box_ptr<Source>>> narFromPath(const StorePath & path) override;
 
+    kj::Promise<Result<box_ptr<Source>>>
+    narFromPathUsingDeltas(const StorePath & path, Store & baseStore) override;
+
+    /**
+     * Publish a delta that reconstructs the NAR of `storePath` from the
+     * NAR of `base`, both of which must be in the cache. Clients that have
+     * `base` download the delta instead of the full NAR.
+     */
+    kj::Promise<Result<void>> addDelta(const StorePath & storePath, const StorePath & base);
+
     ref<FSAccessor> getFSAccessor() override;
 
     kj::Promise<Result<void>>
@@ -0,0 +1,120 @@
+#include "lix/libstore/build-durations.hh"
+#include "lix/libstore/names.hh"
+#include "lix/libstore/sqlite.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/sync.hh"
+#include "lix/libutil/users.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists BuildDurations (
+    name       text primary key not null,
+    duration   integer not null,
+    memoryPeak integer,
+    timestamp  integer not null
+);
+
+)sql";
+
+class BuildDurationsImpl : public BuildDurations
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt query, upsert;
+    };
+
+    Sync<State> _state;
+
+    static std::string key(std::string_view drvName)
+    {
+        return DrvName(drvName).name;
+    }
+
+public:
+
+    BuildDurationsImpl(Path dbPath = getCacheDir() + "/nix/build-durations.sqlite")
+    {
+        auto state(_state.lock());
+
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema, always_progresses);
+
+        /* Databases created before memory usage was recorded lack the
+           column. */
+        bool haveMemoryPeak;
+        {
+            auto columns = state->db.create(
+                "select count(*) from pragma_table_info('BuildDurations') where name = 'memoryPeak'");
+            auto use(columns.use());
+            haveMemoryPeak = use.next() && use.getInt(0) > 0;
+        }
+        if (!haveMemoryPeak)
+            state->db.exec("alter table BuildDurations add column memoryPeak integer", always_progresses);
+
+        state->query = state->db.create("select duration, memoryPeak from BuildDurations where name = ?");
+
+        /* Average the new duration with the previous ones, halving the
+           weight of older builds with every new one. */
+        state->upsert = state->db.create(
+            "insert into BuildDurations(name, duration, memoryPeak, timestamp) values (?1, ?2, ?3, ?4) "
+            "on conflict (name) do update set duration = (duration + ?2) / 2, "
+            "memoryPeak = coalesce(?3, memoryPeak), timestamp = ?4");
+    }
+
+    std::optional<Entry> lookup(std::string_view drvName) override
+    {
+        return retrySQLite([&]() -> std::optional<Entry> {
+            auto state(_state.lock());
+            auto query(state->query.use()(key(drvName)));
+            if (!query.next())
+                return std::nullopt;
+            return Entry{
+                .duration = std::chrono::seconds(query.getInt(0)),
+                .memoryPeak = query.isNull(1) ? std::nullopt : std::optional<uint64_t>(query.getInt(1)),
+            };
+        }, always_progresses);
+    }
+
+    void record(
+        std::string_view drvName, std::chrono::seconds duration, std::optional<uint64_t> memoryPeak
+    ) override
+    {
+        retrySQLite([&]() {
+            auto state(_state.lock());
+            state->upsert.use()
+                (key(drvName))
+                (static_cast<int64_t>(duration.count()))
+                (static_cast<int64_t>(memoryPeak.value_or(0)), memoryPeak.has_value())
+                (time(0))
+                .exec();
+        }, always_progresses);
+    }
+};
+
+std::shared_ptr<BuildDurations> getBuildDurations()
+{
+    static std::shared_ptr<BuildDurations> durations = []() -> std::shared_ptr<BuildDurations> {
+        try {
+            return std::make_shared<BuildDurationsImpl>();
+        } catch (Error & e) {
+            debug("cannot open the build durations database: %s", e.what());
+            return nullptr;
+        }
+    }();
+    return durations;
+}
+
+ref<BuildDurations> getTestBuildDurations(Path dbPath)
+{
+    return make_ref<BuildDurationsImpl>(dbPath);
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+///@file
+
+#include "lix/libutil/ref.hh"
+#include "lix/libutil/types.hh"
+
+#include <chrono>
+#include <optional>
+#include <string_view>
+
+namespace nix {
+
+/**
+ * Durations and resource usage of previous local builds, keyed by the name
+ * of the derivation without its version so that new versions of a package
+ * inherit the durations of old ones. The build scheduler uses them to start
+ * long builds early, and to not start builds that would run out of memory.
+ */
+class BuildDurations
+{
+public:
+    virtual ~BuildDurations() {}
+
+    struct Entry
+    {
+        /**
+         * The average duration of the builds.
+         */
+        std::chrono::seconds duration;
+
+        /**
+         * The highest memory usage, in bytes, of the most recent build
+         * for which it was measured.
+         */
+        std::optional<uint64_t> memoryPeak;
+    };
+
+    /**
+     * @return The record of previous builds of derivations with the same
+     * name as `drvName` (ignoring versions), if there were any.
+     */
+    virtual std::optional<Entry> lookup(std::string_view drvName) = 0;
+
+    /**
+     * Record a build of a derivation named `drvName`. Recent builds are
+     * weighted more than old ones. A build whose memory usage was not
+     * measured keeps the previously recorded one.
+     */
+    virtual void record(
+        std::string_view drvName, std::chrono::seconds duration, std::optional<uint64_t> memoryPeak
+    ) = 0;
+};
+
+/**
+ * @return The durations recorded in the cache directory of the current
+ * user, or `nullptr` if they are not available.
+ */
+std::shared_ptr<BuildDurations> getBuildDurations();
+
+ref<BuildDurations> getTestBuildDurations(Path dbPath);
+
+}
@@ -0,0 +1,238 @@
+#include "lix/libstore/build-events.hh"
+#include "lix/libstore/globals.hh"
+#include "lix/libutil/file-descriptor.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/json.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/strings.hh"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace nix {
+
+using namespace std::chrono;
+
+static const std::map<BuildPhase, std::string_view> phaseNames = {
+    {BuildPhase::Substituting, "substituting"},
+    {BuildPhase::WaitingForInputs, "waiting-for-inputs"},
+    {BuildPhase::WaitingForSlot, "waiting-for-slot"},
+    {BuildPhase::SandboxSetup, "sandbox-setup"},
+    {BuildPhase::Building, "building"},
+    {BuildPhase::BuildingRemotely, "building-remotely"},
+    {BuildPhase::RegisteringOutputs, "registering-outputs"},
+    {BuildPhase::PostBuildHook, "post-build-hook"},
+    {BuildPhase::Done, "done"},
+};
+
+std::string_view showBuildPhase(BuildPhase phase)
+{
+    return phaseNames.at(phase);
+}
+
+std::optional<BuildPhase> parseBuildPhase(std::string_view s)
+{
+    for (auto & [phase, name] : phaseNames)
+        if (name == s)
+            return phase;
+    return std::nullopt;
+}
+
+JSON BuildEvent::toJSON() const
+{
+    JSON json{
+        {"time", duration_cast<microseconds>(time.time_since_epoch()).count()},
+        {"path", path},
+        {"phase", std::string(showBuildPhase(phase))},
+    };
+    if (!inputs.empty())
+        json["inputs"] = inputs;
+    return json;
+}
+
+BuildEvent BuildEvent::fromJSON(const JSON & json)
+{
+    auto phaseName = valueAt(json, "phase").get<std::string>();
+    auto phase = parseBuildPhase(phaseName);
+    if (!phase)
+        throw Error("unknown build phase '%s'", phaseName);
+
+    BuildEvent event{
+        .time = system_clock::time_point(microseconds(valueAt(json, "time").get<int64_t>())),
+        .path = valueAt(json, "path").get<std::string>(),
+        .phase = *phase,
+    };
+    if (auto inputs = get(json, "inputs"))
+        event.inputs = inputs->get<std::vector<std::string>>();
+    return event;
+}
+
+void recordBuildEvent(std::string_view path, BuildPhase phase, std::vector<std::string> inputs)
+{
+    auto & file = settings.buildEventLog.get();
+    if (!file)
+        return;
+
+    BuildEvent event{
+        .time = system_clock::now(),
+        .path = std::string(path),
+        .phase = phase,
+        .inputs = std::move(inputs),
+    };
+
+    /* Concurrent writers (e.g. the per-connection processes of the
+       daemon) do not interleave their lines because each line is
+       appended with a single write. */
+    try {
+        AutoCloseFD fd{open(file->c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)};
+        if (!fd)
+            throw SysError("opening build event log '%s'", *file);
+        writeFull(fd.get(), event.toJSON().dump() + "\n");
+    } catch (Error & e) {
+        debug("cannot record build event: %s", e.msg());
+    }
+}
+
+/**
+ * Concurrent writers take the time of an event before appending it, so
+ * lines may be slightly out of order. Reading stops at the first event
+ * that is older than this before the requested time.
+ */
+static constexpr auto outOfOrderSlack = seconds(10);
+
+std::vector<BuildEvent> readBuildEvents(const Path & file, system_clock::time_point since)
+{
+    AutoCloseFD fd{open(file.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (!fd)
+        throw SysError("opening build event log '%s'", file);
+    auto pos = lseek(fd.get(), 0, SEEK_END);
+    if (pos == -1)
+        throw SysError("seeking in build event log '%s'", file);
+
+    /* The log grows forever unless it is rotated, but only its end is
+       interesting. Read it backwards in blocks, from the newest event to
+       the first one that is too old. `buffer` holds what has been read
+       but not parsed yet, which starts at `pos` in the file. */
+    constexpr off_t blockSize = 64 * 1024;
+    std::vector<BuildEvent> events;
+    std::string buffer;
+    bool done = false;
+    while (!done) {
+        auto size = std::min(blockSize, pos);
+        pos -= size;
+        std::string block(size, 0);
+        if (lseek(fd.get(), pos, SEEK_SET) == -1)
+            throw SysError("seeking in build event log '%s'", file);
+        readFull(fd.get(), block.data(), size);
+        buffer.insert(0, block);
+
+        /* Parse the complete lines from the end. The first line in the
+           buffer is only known to be complete at the start of the file. */
+        auto end = buffer.size();
+        while (end > 0) {
+            auto newline = buffer.rfind('\n', end - 1);
+            if (newline == std::string::npos && pos > 0)
+                break;
+            auto start = newline == std::string::npos ? 0 : newline + 1;
+            auto line = std::string_view(buffer).substr(start, end - start);
+            end = newline == std::string::npos ? 0 : newline;
+            if (line.empty())
+                continue;
+            try {
+                auto event = BuildEvent::fromJSON(json::parse(line, "a build event"));
+                if (event.time < since - outOfOrderSlack) {
+                    done = true;
+                    break;
+                }
+                if (event.time >= since)
+                    events.push_back(std::move(event));
+            } catch (Error & e) {
+                debug("ignoring invalid line in build event log '%s': %s", file, e.msg());
+            }
+        }
+        buffer.resize(end);
+
+        if (pos == 0)
+            break;
+    }
+
+    std::reverse(events.begin(), events.end());
+    return events;
+}
+
+BuildReport BuildReport::compute(const std::vector<BuildEvent> & events, const std::set<std::string> & roots)
+{
+    struct Node
+    {
+        Step step;
+        std::set<std::string> inputs;
+    };
+
+    std::map<std::string, Node> nodes;
+    std::map<std::string, const BuildEvent *> last;
+
+    auto sorted = events;
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto & a, auto & b) { return a.time < b.time; });
+
+    for (auto & event : sorted) {
+        auto [it, inserted] = nodes.try_emplace(event.path);
+        auto & node = it->second;
+        if (inserted) {
+            node.step.path = event.path;
+            node.step.start = event.time;
+        }
+        node.step.end = event.time;
+        node.inputs.insert(event.inputs.begin(), event.inputs.end());
+
+        auto & previous = last[event.path];
+        if (previous && previous->phase != BuildPhase::Done)
+            node.step.phases[previous->phase] += duration_cast<microseconds>(event.time - previous->time);
+        previous = &event;
+    }
+
+    /* Only report on the roots and what they (transitively) waited for,
+       not on unrelated builds that happened at the same time. */
+    std::set<std::string> reachable;
+    std::vector<std::string> todo(roots.begin(), roots.end());
+    while (!todo.empty()) {
+        auto path = std::move(todo.back());
+        todo.pop_back();
+        auto node = nodes.find(path);
+        if (node == nodes.end() || !reachable.insert(path).second)
+            continue;
+        todo.insert(todo.end(), node->second.inputs.begin(), node->second.inputs.end());
+    }
+
+    BuildReport report;
+    for (auto & path : reachable)
+        for (auto & [phase, time] : nodes.at(path).step.phases)
+            report.phaseTotals[phase] += time;
+
+    /* Follow the inputs that finished last, which are the ones that held
+       up each step. */
+    const Node * current = nullptr;
+    for (auto & root : roots)
+        if (auto node = nodes.find(root); node != nodes.end())
+            if (!current || node->second.step.end > current->step.end)
+                current = &node->second;
+
+    while (current) {
+        report.criticalPath.push_back(current->step);
+        const Node * next = nullptr;
+        for (auto & input : current->inputs)
+            if (auto node = nodes.find(input); node != nodes.end() && reachable.count(input))
+                if (!next || node->second.step.end > next->step.end)
+                    next = &node->second;
+        /* Guard against cycles from repeated builds of the same path. */
+        if (next && std::any_of(report.criticalPath.begin(), report.criticalPath.end(),
+                [&](auto & step) { return step.path == next->step.path; }))
+            break;
+        current = next;
+    }
+    std::reverse(report.criticalPath.begin(), report.criticalPath.end());
+
+    return report;
+}
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+///@file
+
+#include "lix/libutil/json-fwd.hh"
+#include "lix/libutil/types.hh"
+
+#include <chrono>
+#include <map>
+#include <optional>
+#include <set>
+#include <string_view>
+#include <vector>
+
+namespace nix {
+
+/**
+ * The phases of builds and substitutions recorded in the `build-event-log`.
+ * Each phase lasts until the next event for the same path.
+ */
+enum class BuildPhase {
+    /**
+     * Waiting for the substitution of the outputs of a derivation, or
+     * substituting a path.
+     */
+    Substituting,
+    WaitingForInputs,
+    /**
+     * Waiting for a build slot, output locks or a remote builder.
+     */
+    WaitingForSlot,
+    SandboxSetup,
+    Building,
+    BuildingRemotely,
+    RegisteringOutputs,
+    PostBuildHook,
+    Done,
+};
+
+std::string_view showBuildPhase(BuildPhase phase);
+
+std::optional<BuildPhase> parseBuildPhase(std::string_view s);
+
+struct BuildEvent
+{
+    std::chrono::system_clock::time_point time;
+
+    /**
+     * The store path of the derivation being built, or of the path being
+     * substituted.
+     */
+    std::string path;
+
+    BuildPhase phase;
+
+    /**
+     * The paths of the builds and substitutions this phase waits for.
+     */
+    std::vector<std::string> inputs;
+
+    JSON toJSON() const;
+    static BuildEvent fromJSON(const JSON & json);
+};
+
+/**
+ * Append an event for `path` entering `phase` to the `build-event-log`, if
+ * it is set. Errors are logged and otherwise ignored.
+ */
+void recordBuildEvent(std::string_view path, BuildPhase phase, std::vector<std::string> inputs = {});
+
+/**
+ * @return The events in `file` that happened at or after `since`. The file
+ * is read from its end, and reading stops at the first event that is older
+ * than `since` by more than concurrent writers can reorder events.
+ */
+std::vector<BuildEvent>
+readBuildEvents(const Path & file, std::chrono::system_clock::time_point since);
+
+/**
+ * A summary of where the time of a set of builds and substitutions went.
+ */
+struct BuildReport
+{
+    struct Step
+    {
+        std::string path;
+        std::chrono::system_clock::time_point start, end;
+        std::map<BuildPhase, std::chrono::microseconds> phases;
+    };
+
+    /**
+     * The time spent in each phase, summed over all paths.
+     */
+    std::map<BuildPhase, std::chrono::microseconds> phaseTotals;
+
+    /**
+     * The chain of builds and substitutions that finished last, starting
+     * with the one that was done first. Each step waited for the previous
+     * one.
+     */
+    std::vector<Step> criticalPath;
+
+    /**
+     * Summarise the events of `roots` and everything they waited for.
+     */
+    static BuildReport compute(const std::vector<BuildEvent> & events, const std::set<std::string> & roots);
+};
+
+}
@@ -13,7 +13,9 @@ GENERATE_CMP_EXT(
     me->startTime,
     me->stopTime,
     me->cpuUser,
-    me->cpuSystem);
+    me->cpuSystem,
+    me->memoryPeak,
+    me->sandboxSetup);
 
 KeyedBuildResult BuildResult::restrictTo(DerivedPath path) const
 {
@@ -103,6 +103,17 @@ struct BuildResult
      */
     std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
 
+    /**
+     * The highest memory usage of the build, in bytes.
+     */
+    std::optional<uint64_t> memoryPeak;
+
+    /**
+     * Time it took to set up the sandbox of the build, from forking the
+     * builder until it was about to execute.
+     */
+    std::optional<std::chrono::microseconds> sandboxSetup;
+
     DECLARE_CMP(BuildResult);
 
     bool success()
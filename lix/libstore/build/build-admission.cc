@@ -0,0 +1,78 @@
+#include "lix/libstore/build/build-admission.hh"
+#include "lix/libutil/cgroup.hh"
+#include "lix/libutil/fmt.hh"
+#include "lix/libutil/logging.hh"
+
+namespace nix {
+
+BuildAdmission::Readings BuildAdmission::systemReadings()
+{
+    return {
+        .pressure =
+            [](const std::string & resource) {
+                return getPressure(fmt("/proc/pressure/%s", resource));
+            },
+        .availableMemory = getAvailableMemory,
+        .now = Clock::now,
+    };
+}
+
+BuildAdmission::BuildAdmission(Readings readings) : readings(std::move(readings)) {}
+
+bool BuildAdmission::admit(std::optional<uint64_t> memoryPeak, unsigned int maxPressure, bool onlyBuild)
+{
+    auto now = readings.now();
+    while (!recent.empty() && now - recent.front().at >= window)
+        recent.pop_front();
+
+    std::map<std::string, std::optional<double>> pressures;
+    for (auto resource : {"cpu", "memory"})
+        pressures[resource] = readings.pressure(resource);
+
+    auto accept = [&] {
+        recent.push_back({now, memoryPeak.value_or(0)});
+        lastPressure.clear();
+        for (auto & [resource, pressure] : pressures)
+            if (pressure)
+                lastPressure[resource] = *pressure;
+        return true;
+    };
+
+    if (onlyBuild)
+        return accept();
+
+    bool settled = true;
+    for (auto & [resource, pressure] : pressures) {
+        if (pressure && *pressure > maxPressure) {
+            debug("not starting a build, %s pressure is %.2f%%", resource, *pressure);
+            return false;
+        }
+        auto last = lastPressure.find(resource);
+        if (!pressure || (last != lastPressure.end() && *pressure > last->second))
+            settled = false;
+    }
+
+    if (!settled && !recent.empty()) {
+        debug("not starting a build, another one was started recently and pressure is unknown or rising");
+        return false;
+    }
+
+    if (memoryPeak) {
+        /* Recently started builds may not have allocated their memory
+           yet, so it does not show up as used. */
+        uint64_t pending = 0;
+        for (auto & admitted : recent)
+            pending += admitted.memoryPeak;
+        auto available = readings.availableMemory();
+        if (available && *memoryPeak + pending > *available) {
+            debug("not starting a build, it may need %d bytes of memory but only %d are available "
+                "and recently started builds may need %d",
+                *memoryPeak, *available, pending);
+            return false;
+        }
+    }
+
+    return accept();
+}
+
+}
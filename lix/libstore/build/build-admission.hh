@@ -0,0 +1,89 @@
+#pragma once
+///@file
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+
+namespace nix {
+
+/**
+ * Decides whether a local build may start while others are running,
+ * according to `max-build-pressure`.
+ *
+ * The kernel averages pressure over 10 seconds and builds take a while to
+ * allocate their memory, so the readings lag behind the builds that were
+ * just started. Builds admitted within the last `window` are therefore
+ * counted against the available memory with their expected peak, and
+ * while pressure is unknown or has risen since the last admission at most
+ * one build is admitted per window.
+ *
+ * Only built on Linux, the only platform with `max-build-pressure`.
+ */
+class BuildAdmission
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * The period the `avg10` pressure values are averaged over.
+     */
+    static constexpr auto window = std::chrono::seconds(10);
+
+    /**
+     * Where the state of the system comes from, replaceable for testing.
+     */
+    struct Readings
+    {
+        /**
+         * The pressure of `resource` (`cpu` or `memory`), see `getPressure()`.
+         */
+        std::function<std::optional<double>(const std::string & resource)> pressure;
+
+        /**
+         * See `getAvailableMemory()`.
+         */
+        std::function<std::optional<uint64_t>()> availableMemory;
+
+        std::function<Clock::time_point()> now;
+    };
+
+    /**
+     * Readings from `/proc`.
+     */
+    static Readings systemReadings();
+
+    explicit BuildAdmission(Readings readings = systemReadings());
+
+    /**
+     * Whether to start a build that is expected to use at most `memoryPeak`
+     * bytes of memory, and if so record it as admitted. `onlyBuild` builds
+     * are always admitted, but still counted against later ones.
+     */
+    bool admit(std::optional<uint64_t> memoryPeak, unsigned int maxPressure, bool onlyBuild);
+
+private:
+    struct Admitted
+    {
+        Clock::time_point at;
+        uint64_t memoryPeak;
+    };
+
+    Readings readings;
+
+    /**
+     * Builds admitted within the last `window`, oldest first.
+     */
+    std::deque<Admitted> recent;
+
+    /**
+     * The known pressure of each resource when the last build was admitted.
+     */
+    std::map<std::string, double> lastPressure;
+};
+
+}
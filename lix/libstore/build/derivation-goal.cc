@@ -216,6 +216,32 @@ try {
 }
 
 
+/**
+ * @return The paths under which the goals in `dependencies` appear in the
+ * build event log.
+ */
+static std::vector<std::string> eventPathsOf(
+    Store & store, const kj::Vector<std::pair<GoalPtr, kj::Promise<Result<Goal::WorkResult>>>> & dependencies
+)
+{
+    std::vector<std::string> paths;
+    for (auto & [goal, _] : dependencies) {
+        if (auto drvGoal = dynamic_cast<DerivationGoal *>(goal.get()))
+            paths.push_back(store.printStorePath(drvGoal->drvPath));
+        else if (auto substGoal = dynamic_cast<PathSubstitutionGoal *>(goal.get()))
+            paths.push_back(store.printStorePath(substGoal->storePath));
+    }
+    return paths;
+}
+
+void DerivationGoal::recordEvent(BuildPhase phase, std::vector<std::string> inputs)
+{
+    if (phase == BuildPhase::Done && !eventsRecorded)
+        return;
+    recordBuildEvent(worker.store.printStorePath(drvPath), phase, std::move(inputs));
+    eventsRecorded = true;
+}
+
 kj::Promise<Result<Goal::WorkResult>> DerivationGoal::haveDerivation() noexcept
 try {
     trace("have derivation");
@@ -298,6 +324,7 @@ try {
     }
 
     if (!dependencies.empty()) { /* to prevent hang (no wake-up event) */
+        recordEvent(BuildPhase::Substituting, eventPathsOf(worker.store, dependencies));
         TRY_AWAIT(waitForGoals(dependencies.releaseAsArray()));
     }
     co_return co_await outputsSubstitutionTried();
@@ -449,7 +476,17 @@ try {
         dependencies.add(worker.goalFactory().makePathSubstitutionGoal(i));
     }
 
+    /* Let the inputs know how much is waiting for them, so that the
+       ones on the critical path are built first. */
+    for (auto & [goal, _] : dependencies) {
+        if (auto inputGoal = std::dynamic_pointer_cast<DerivationGoal>(goal)) {
+            inputGoals.push_back(inputGoal);
+            inputGoal->raiseDownstreamCost(buildPriority());
+        }
+    }
+
     if (!dependencies.empty()) {/* to prevent hang (no wake-up event) */
+        recordEvent(BuildPhase::WaitingForInputs, eventPathsOf(worker.store, dependencies));
         TRY_AWAIT(waitForGoals(dependencies.releaseAsArray()));
     }
     co_return co_await inputsRealised();
@@ -725,6 +762,8 @@ void DerivationGoal::started()
 
 kj::Promise<Result<Goal::WorkResult>> DerivationGoal::tryToBuild() noexcept
 try {
+    recordEvent(BuildPhase::WaitingForSlot);
+
 retry:
     trace("trying to build");
 
@@ -806,8 +845,10 @@ retry:
                 EOF from the hook. */
             actLock.reset();
             buildResult.startTime = time(0); // inexact
+            recordEvent(BuildPhase::BuildingRemotely);
             started();
             auto r = co_await a.promise;
+            worker.remoteBuildFinished();
             if (r.has_value()) {
                 co_return co_await buildDone();
             } else if (r.has_error()) {
@@ -824,13 +865,14 @@ retry:
 
         case 2: {
             HookReply::Postpone _ [[gnu::unused]] = std::get<2>(hookReply);
-            /* Not now; wait until at least one child finishes or
-                the wake-up timeout expires. */
+            /* Not now; wait until a remote build finishes and this is
+                the most important goal waiting for one, or until the
+                wake-up timeout expires. */
             if (!actLock)
                 actLock = std::make_unique<Activity>(*logger, lvlTalkative, actBuildWaiting,
                     fmt("waiting for a machine to build '%s'", Magenta(worker.store.printStorePath(drvPath))));
             outputLocks.reset();
-            co_await waitForAWhile();
+            co_await worker.waitForRemoteBuilder(buildPriority());
             goto retry;
         }
 
@@ -1066,6 +1108,11 @@ try {
             ((double) buildResult.cpuSystem->count()) / 1000000);
     }
 
+    if (buildResult.memoryPeak)
+        debug("builder for '%s' used at most %d bytes of memory",
+            worker.store.printStorePath(drvPath),
+            *buildResult.memoryPeak);
+
     bool diskFull = false;
 
     try {
@@ -1102,11 +1149,14 @@ try {
 
         /* Compute the FS closure of the outputs and register them as
            being valid. */
+        recordEvent(BuildPhase::RegisteringOutputs);
         auto builtOutputs = TRY_AWAIT(registerOutputs());
 
         StorePathSet outputPaths;
         for (auto & [_, output] : builtOutputs)
             outputPaths.insert(output.outPath);
+        if (settings.postBuildHook != "")
+            recordEvent(BuildPhase::PostBuildHook);
         runPostBuildHook(
             worker.store,
             *logger,
@@ -1122,6 +1172,15 @@ try {
            (unlinked) lock files. */
         outputLocks.reset();
 
+        if (!hook && buildResult.stopTime >= buildResult.startTime) {
+            if (auto durations = getBuildDurations())
+                durations->record(
+                    drv->name,
+                    std::chrono::seconds(buildResult.stopTime - buildResult.startTime),
+                    buildResult.memoryPeak
+                );
+        }
+
         co_return done(BuildResult::Built, std::move(builtOutputs));
     } catch (BuildError & e) {
         outputLocks.reset();
@@ -1149,6 +1208,35 @@ try {
     co_return result::current_exception();
 }
 
+const std::optional<BuildDurations::Entry> & DerivationGoal::previousBuilds()
+{
+    if (!previousBuildsLoaded) {
+        if (auto durations = getBuildDurations())
+            previousBuilds_ = durations->lookup(drv->name);
+        previousBuildsLoaded = true;
+    }
+    return previousBuilds_;
+}
+
+uint64_t DerivationGoal::estimatedDuration()
+{
+    auto & previous = previousBuilds();
+    return std::max<uint64_t>(1, previous ? previous->duration.count() : 1);
+}
+
+void DerivationGoal::raiseDownstreamCost(uint64_t cost)
+{
+    if (cost <= downstreamCost)
+        return;
+    downstreamCost = cost;
+    if (inputGoals.empty())
+        return;
+    auto priority = buildPriority();
+    for (auto & i : inputGoals)
+        if (auto inputGoal = i.lock())
+            inputGoal->raiseDownstreamCost(priority);
+}
+
 kj::Promise<Result<Goal::WorkResult>> DerivationGoal::resolvedFinished() noexcept
 try {
     trace("resolved derivation finished");
@@ -1759,6 +1847,7 @@ Goal::WorkResult DerivationGoal::done(
     std::optional<Error> ex)
 {
     isDone = true;
+    recordEvent(BuildPhase::Done);
 
     outputLocks.reset();
     buildResult.status = status;
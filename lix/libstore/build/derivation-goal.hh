@@ -2,6 +2,8 @@
 ///@file
 
 #include "lix/libutil/notifying-counter.hh"
+#include "lix/libstore/build-events.hh"
+#include "lix/libstore/build-durations.hh"
 #include "lix/libstore/parsed-derivations.hh"
 #include "lix/libstore/lock.hh"
 #include "lix/libstore/outputs-spec.hh"
@@ -189,6 +191,32 @@ struct DerivationGoal : public Goal
      */
     BuildResult buildResult;
 
+    /**
+     * Estimated time, in seconds, that it will take to build everything
+     * that waits for this goal once it is done, i.e. the length of the
+     * longest chain of builds that depend on it. Builds on long chains
+     * get a build slot first.
+     */
+    uint64_t downstreamCost = 0;
+
+    /**
+     * The goals of the input derivations, to update their
+     * `downstreamCost` when ours changes.
+     */
+    std::vector<std::weak_ptr<DerivationGoal>> inputGoals;
+
+    /**
+     * Cached result of `previousBuilds()`.
+     */
+    std::optional<BuildDurations::Entry> previousBuilds_;
+    bool previousBuildsLoaded = false;
+
+    /**
+     * Whether this goal has recorded anything in the `build-event-log`,
+     * and thus has to record when it is done.
+     */
+    bool eventsRecorded = false;
+
     /**
      * File descriptor for the log file.
      */
@@ -375,6 +403,39 @@ public:
 
     void waiteeDone(GoalPtr waitee) override;
 
+    /**
+     * @return The recorded duration and memory usage of previous local
+     * builds of this derivation.
+     */
+    const std::optional<BuildDurations::Entry> & previousBuilds();
+
+    /**
+     * Record in the `build-event-log` that this goal entered `phase`,
+     * waiting for the builds and substitutions of `inputs` if any.
+     */
+    void recordEvent(BuildPhase phase, std::vector<std::string> inputs = {});
+
+    /**
+     * @return The duration, in seconds, of previous local builds of this
+     * derivation, or 1 if it has not been built before.
+     */
+    uint64_t estimatedDuration();
+
+    /**
+     * Raise `downstreamCost` to `cost` if it is lower, and propagate the
+     * change to the goals of the inputs.
+     */
+    void raiseDownstreamCost(uint64_t cost);
+
+    /**
+     * The priority of this goal for the build slots, which is the
+     * estimated length of the longest chain of builds starting with it.
+     */
+    uint64_t buildPriority()
+    {
+        return downstreamCost + estimatedDuration();
+    }
+
     virtual bool respectsTimeouts()
     {
         return false;
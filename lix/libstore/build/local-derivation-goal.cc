@@ -25,8 +25,10 @@
 #include "lix/libutil/strings.hh"
 #include "lix/libutil/thread-name.hh"
 
+#include <algorithm>
 #include <cstddef>
 #include <exception>
+#include <list>
 #include <regex>
 #include <queue>
 
@@ -167,7 +169,19 @@ retry:
     if (!slotToken.valid()) {
         outputLocks.reset();
         if (worker.localBuilds.capacity() > 0) {
-            slotToken = co_await worker.localBuilds.acquire();
+            slotToken = co_await worker.localBuilds.acquire(buildPriority());
+            auto & previous = previousBuilds();
+            if (!worker.haveHeadroomFor(previous ? previous->memoryPeak : std::nullopt)) {
+                /* Give the slot to builds that may fit, and check
+                   again once running builds have made progress. */
+                slotToken = {};
+                if (!actLock)
+                    actLock = std::make_unique<Activity>(*logger, lvlTalkative, actBuildWaiting,
+                        fmt("waiting for resources to build '%s'", Magenta(worker.store.printStorePath(drvPath))));
+                co_await AIO().provider.getTimer().afterDelay(1 * kj::SECONDS);
+                goto retry;
+            }
+            actLock.reset();
             co_return co_await tryToBuild();
         }
         if (getMachines().empty()) {
@@ -408,6 +422,8 @@ void LocalDerivationGoal::cleanupPostOutputsRegisteredModeNonCheck()
 
 kj::Promise<Result<void>> LocalDerivationGoal::startBuilder()
 try {
+    recordEvent(BuildPhase::SandboxSetup);
+
     if ((buildUser && buildUser->getUIDCount() != 1)
         #if __linux__
         || settings.useCgroups
@@ -795,6 +811,7 @@ try {
     };
 
     buildResult.startTime = time(0);
+    auto setupStart = std::chrono::steady_clock::now();
 
     /* Fork a child to build the package. */
     pid = startChild(openSlave);
@@ -828,6 +845,17 @@ try {
         msgs.push_back(std::move(msg));
     }
 
+    if (useChroot) {
+        buildResult.sandboxSetup = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - setupStart
+        );
+        debug("setting up the sandbox for '%s' took %.3fs",
+            worker.store.printStorePath(drvPath),
+            ((double) buildResult.sandboxSetup->count()) / 1000000);
+    }
+
+    recordEvent(BuildPhase::Building);
+
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();
@@ -1560,11 +1588,10 @@ void LocalDerivationGoal::runChild()
                 throw SysError("unable to make '%s' shared", chrootStoreDir);
 
             /* Set up a nearly empty /dev, unless the user asked to
-               bind-mount the host /dev. */
+               bind-mount the host /dev. Its mount points and symlinks
+               are part of the sandbox skeleton. */
             Strings ss;
             if (pathsInChroot.find("/dev") == pathsInChroot.end()) {
-                createDirs(chrootRootDir + "/dev/shm");
-                createDirs(chrootRootDir + "/dev/pts");
                 ss.push_back("/dev/full");
                 if (worker.store.config().systemFeatures.get().count("kvm")
                     && pathExists("/dev/kvm"))
@@ -1576,10 +1603,6 @@ void LocalDerivationGoal::runChild()
                 ss.push_back("/dev/tty");
                 ss.push_back("/dev/urandom");
                 ss.push_back("/dev/zero");
-                createSymlink("/proc/self/fd", chrootRootDir + "/dev/fd");
-                createSymlink("/proc/self/fd/0", chrootRootDir + "/dev/stdin");
-                createSymlink("/proc/self/fd/1", chrootRootDir + "/dev/stdout");
-                createSymlink("/proc/self/fd/2", chrootRootDir + "/dev/stderr");
             }
 
             /* Fixed-output derivations typically need to access the
@@ -1627,11 +1650,25 @@ void LocalDerivationGoal::runChild()
             for (auto & i : ss) pathsInChroot.emplace(i, i);
 
             /* Bind-mount all the directories from the "host"
-               filesystem that we want in the chroot
-               environment. */
+               filesystem that we want in the chroot environment.
+               Store paths are mounted after unsharing the mount
+               namespace below, so that each of them only has to be
+               mounted once rather than once per namespace. */
+            const auto & storeDir = worker.store.config().storeDir;
+            std::vector<Path> storePathSources;
+            PathsInChroot pathsInStore;
             for (auto & i : pathsInChroot) {
                 if (i.second.source == "/proc") continue; // backwards compatibility
 
+                if (isInDir(i.first, storeDir) && i.second.source != "__embedded_sandbox_shell__") {
+                    if (dirOf(i.first) == storeDir && !i.second.optional
+                        && baseNameOf(i.second.source) == baseNameOf(i.first))
+                        storePathSources.push_back(i.second.source);
+                    else
+                        pathsInStore.insert(i);
+                    continue;
+                }
+
                 #if HAVE_EMBEDDED_SANDBOX_SHELL
                 if (i.second.source == "__embedded_sandbox_shell__") {
                     static unsigned char sh[] = {
@@ -1704,6 +1741,16 @@ void LocalDerivationGoal::runChild()
             if (unshare(CLONE_NEWNS) == -1)
                 throw SysError("unsharing mount namespace");
 
+            /* Keep receiving the mounts made by addDependency(), but
+               don't propagate the mounts below back into
+               sandboxMountNamespace, which doesn't need them. */
+            if (mount(0, chrootStoreDir.c_str(), 0, MS_SLAVE, 0) == -1)
+                throw SysError("unable to make '%s' a slave mount", chrootStoreDir);
+
+            bindPathsInto(chrootStoreDir, storePathSources);
+            for (auto & i : pathsInStore)
+                bindPath(i.second.source, chrootRootDir + i.first, i.second.optional);
+
             /* Creating a new cgroup namespace is independent of whether we enabled the cgroup experimental feature.
              * We always create a new cgroup namespace from a sandboxing perspective. */
             /* Unshare the cgroup namespace. This means
@@ -2026,10 +2073,34 @@ try {
        name so we can also use it in rewrites. */
     StringSet outputsToSort;
     struct AlreadyRegistered { StorePath path; };
-    struct PerhapsNeedToRegister { StorePathSet refs; };
+    struct PerhapsNeedToRegister {
+        StorePathSet refs;
+        /* Everything the scan found, even if references are discarded.
+           Rewriting the output is a no-op unless it contains one of them. */
+        StorePathSet found;
+        HashResult narHashAndSize;
+        /* The hash modulo the scratch path's hash part, for outputs whose
+           content address is computed from their NAR. */
+        std::optional<Hash> hashModulo;
+    };
     std::map<std::string, std::variant<AlreadyRegistered, PerhapsNeedToRegister>> outputReferencesIfUnregistered;
     std::map<std::string, struct stat> outputStats;
-    for (auto & [outputName, _] : drv->outputs) {
+
+    auto recursiveCAHashType = [](const DerivationOutput & output) -> std::optional<HashType> {
+        auto ifRecursive = [](const ContentAddressMethod & method, HashType ht) -> std::optional<HashType> {
+            if (method == ContentAddressMethod { FileIngestionMethod::Recursive })
+                return ht;
+            return std::nullopt;
+        };
+        return std::visit(overloaded {
+            [&](const DerivationOutput::CAFixed & dof) { return ifRecursive(dof.ca.method, dof.ca.hash.type); },
+            [&](const DerivationOutput::CAFloating & dof) { return ifRecursive(dof.method, dof.hashType); },
+            [&](const DerivationOutput::Impure & doi) { return ifRecursive(doi.method, doi.hashType); },
+            [&](const auto &) -> std::optional<HashType> { return std::nullopt; },
+        }, output.raw);
+    };
+
+    for (auto & [outputName, output] : drv->outputs) {
         auto scratchOutput = get(scratchOutputs, outputName);
         if (!scratchOutput)
             throw BuildError(
@@ -2095,20 +2166,31 @@ try {
             }
         }
 
-        StorePathSet references;
+        /* Scan for references, compute the NAR hash and, if needed, the hash
+           modulo self-references in one read of the output. It is only read
+           again if it has to be rewritten. */
+        debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
+
+        HashSink narSink{HashType::SHA256};
+        NullSink noModulo;
+        std::optional<HashModuloSink> moduloSink;
+        if (auto ht = recursiveCAHashType(output))
+            moduloSink.emplace(*ht, std::string(scratchOutput->hashPart()));
+        TeeSink sink{narSink, moduloSink ? static_cast<Sink &>(*moduloSink) : noModulo};
+
+        PerhapsNeedToRegister scanned {
+            .found = scanForReferences(sink, actualPath, referenceablePaths),
+            .narHashAndSize = narSink.finish(),
+        };
+        if (moduloSink)
+            scanned.hashModulo = moduloSink->finish().first;
+
         if (discardReferences)
             debug("discarding references of output '%s'", outputName);
-        else {
-            debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
-
-            /* Pass blank Sink as we are not ready to hash data at this stage. */
-            NullSink blank;
-            references = scanForReferences(blank, actualPath, referenceablePaths);
-        }
+        else
+            scanned.refs = scanned.found;
 
-        outputReferencesIfUnregistered.insert_or_assign(
-            outputName,
-            PerhapsNeedToRegister { .refs = references });
+        outputReferencesIfUnregistered.insert_or_assign(outputName, std::move(scanned));
         outputStats.insert_or_assign(outputName, std::move(st));
     }
 
@@ -2149,6 +2231,10 @@ try {
     std::vector<std::pair<Path, std::optional<Path>>> nondeterministic;
     std::map<std::string, StorePath> alreadyRegisteredOutputs;
 
+    /* Locks on final output paths that aren't known statically. They
+       are held until all outputs have been registered. */
+    std::list<PathLock> dynamicOutputLocks;
+
     for (auto & outputName : sortedOutputNames) {
         auto output = get(drv->outputs, outputName);
         auto scratchPath = get(scratchOutputs, outputName);
@@ -2168,37 +2254,52 @@ try {
         auto orifu = get(outputReferencesIfUnregistered, outputName);
         assert(orifu);
 
-        std::optional<StorePathSet> referencesOpt = std::visit(overloaded {
-            [&](const AlreadyRegistered & skippedFinalPath) -> std::optional<StorePathSet> {
+        std::optional<PerhapsNeedToRegister> scannedOpt = std::visit(overloaded {
+            [&](const AlreadyRegistered & skippedFinalPath) -> std::optional<PerhapsNeedToRegister> {
                 finish(skippedFinalPath.path);
                 alreadyRegisteredOutputs.insert_or_assign(outputName, skippedFinalPath.path);
                 return std::nullopt;
             },
-            [&](const PerhapsNeedToRegister & r) -> std::optional<StorePathSet> {
-                return r.refs;
+            [&](const PerhapsNeedToRegister & r) -> std::optional<PerhapsNeedToRegister> {
+                return r;
             },
         }, *orifu);
 
-        if (!referencesOpt)
+        if (!scannedOpt)
             continue;
-        auto references = *referencesOpt;
+        auto & scanned = *scannedOpt;
+        auto & references = scanned.refs;
 
         auto rewriteOutput = [&](const StringMap & rewrites) {
             /* Apply hash rewriting if necessary. */
-            if (!rewrites.empty()) {
-                debug("rewriting hashes in '%1%'; cross fingers", actualPath);
-
-                GeneratorSource dump{dumpPath(actualPath)};
-                RewritingSource rewritten(rewrites, dump);
-                Path tmpPath = actualPath + ".tmp";
-                restorePath(tmpPath, rewritten);
-                deletePath(actualPath);
-                movePath(tmpPath, actualPath);
-
-                /* FIXME: set proper permissions in restorePath() so
-                   we don't have to do another traversal. */
-                canonicalisePathMetaData(actualPath, {}, inodesSeen);
-            }
+            auto rewritesSomething = std::ranges::any_of(scanned.found, [&](const StorePath & p) {
+                return rewrites.contains(std::string(p.hashPart()));
+            });
+            if (!rewritesSomething)
+                return;
+
+            debug("rewriting hashes in '%1%'; cross fingers", actualPath);
+
+            /* Hash the rewritten NAR while restoring it so the result
+               doesn't have to be read back. */
+            HashSink narSink{HashType::SHA256};
+            GeneratorSource dump{dumpPath(actualPath)};
+            RewritingSource rewritten(rewrites, dump);
+            TeeSource hashed{rewritten, narSink};
+            Path tmpPath = actualPath + ".tmp";
+            restorePath(tmpPath, hashed);
+            deletePath(actualPath);
+            movePath(tmpPath, actualPath);
+
+            /* FIXME: set proper permissions in restorePath() so
+               we don't have to do another traversal. */
+            canonicalisePathMetaData(actualPath, {}, inodesSeen);
+
+            scanned.narHashAndSize = narSink.finish();
+            scanned.hashModulo.reset();
+            std::erase_if(scanned.found, [&](const StorePath & p) {
+                return rewrites.contains(std::string(p.hashPart()));
+            });
         };
 
         auto rewriteRefs = [&]() -> StoreReferences {
@@ -2245,21 +2346,24 @@ try {
             rewriteOutput(outputRewrites);
             /* FIXME optimize and deduplicate with addToStore */
             std::string oldHashPart { scratchPath->hashPart() };
-            auto input = std::visit(overloaded {
-                [&](const TextIngestionMethod &) -> GeneratorSource {
-                    return GeneratorSource(readFileSource(actualPath));
-                },
-                [&](const FileIngestionMethod & m2) -> GeneratorSource {
-                    switch (m2) {
-                    case FileIngestionMethod::Recursive:
-                        return GeneratorSource(dumpPath(actualPath));
-                    case FileIngestionMethod::Flat:
+            auto computeHash = [&] {
+                auto input = std::visit(overloaded {
+                    [&](const TextIngestionMethod &) -> GeneratorSource {
                         return GeneratorSource(readFileSource(actualPath));
-                    }
-                    assert(false);
-                },
-            }, outputHash.method.raw);
-            auto got = computeHashModulo(outputHash.hashType, oldHashPart, input).first;
+                    },
+                    [&](const FileIngestionMethod & m2) -> GeneratorSource {
+                        switch (m2) {
+                        case FileIngestionMethod::Recursive:
+                            return GeneratorSource(dumpPath(actualPath));
+                        case FileIngestionMethod::Flat:
+                            return GeneratorSource(readFileSource(actualPath));
+                        }
+                        assert(false);
+                    },
+                }, outputHash.method.raw);
+                return computeHashModulo(outputHash.hashType, oldHashPart, input).first;
+            };
+            auto got = scanned.hashModulo ? *scanned.hashModulo : computeHash();
 
             auto optCA = ContentAddressWithReferences::fromPartsOpt(
                 outputHash.method,
@@ -2288,9 +2392,8 @@ try {
                                std::string(newInfo0.path.hashPart())}});
             }
 
-            HashResult narHashAndSize = hashPath(HashType::SHA256, actualPath);
-            newInfo0.narHash = narHashAndSize.first;
-            newInfo0.narSize = narHashAndSize.second;
+            newInfo0.narHash = scanned.narHashAndSize.first;
+            newInfo0.narSize = scanned.narHashAndSize.second;
 
             assert(newInfo0.ca);
             return newInfo0;
@@ -2308,9 +2411,8 @@ try {
                         std::string { scratchPath->hashPart() },
                         std::string { requiredFinalPath.hashPart() });
                 rewriteOutput(outputRewrites);
-                auto narHashAndSize = hashPath(HashType::SHA256, actualPath);
-                ValidPathInfo newInfo0 { requiredFinalPath, narHashAndSize.first };
-                newInfo0.narSize = narHashAndSize.second;
+                ValidPathInfo newInfo0 { requiredFinalPath, scanned.narHashAndSize.first };
+                newInfo0.narSize = scanned.narHashAndSize.second;
                 auto refs = rewriteRefs();
                 newInfo0.references = std::move(refs.others);
                 if (refs.self)
@@ -2387,13 +2489,12 @@ try {
         /* Lock final output path, if not already locked. This happens with
            floating CA derivations and hash-mismatching fixed-output
            derivations. */
-        std::optional<PathLock> dynamicOutputLock;
         auto optFixedPath = output->path(worker.store, drv->name, outputName);
         if (!optFixedPath ||
             worker.store.printStorePath(*optFixedPath) != finalDestPath)
         {
             assert(newInfo.ca);
-            dynamicOutputLock = TRY_AWAIT(lockPathAsync(worker.store.toRealPath(finalDestPath)));
+            dynamicOutputLocks.push_back(TRY_AWAIT(lockPathAsync(worker.store.toRealPath(finalDestPath))));
         }
 
         /* Move files, if needed */
@@ -2469,12 +2570,6 @@ try {
 
         finish(newInfo.path);
 
-        /* If it's a CA path, register it right away. This is necessary if it
-           isn't statically known so that we can safely unlock the path before
-           the next iteration */
-        if (newInfo.ca)
-            TRY_AWAIT(localStore.registerValidPaths({{newInfo.path, newInfo}}));
-
         infos.emplace(outputName, std::move(newInfo));
     }
 
@@ -2503,8 +2598,10 @@ try {
     TRY_AWAIT(checkOutputs(infos, alreadyRegisteredOutputs));
 
     /* Register each output path as valid, and register the sets of
-       paths referenced by each of them.  If there are cycles in the
-       outputs, this will fail. */
+       paths referenced by each of them, in one transaction.  If there
+       are cycles in the outputs, this will fail.  Content-addressed
+       outputs whose paths weren't known statically are still locked,
+       so nobody else can have registered them in the meantime. */
     {
         auto & localStore = getLocalStore();
 
@@ -0,0 +1,182 @@
+#include "lix/libstore/build/sandbox-pool.hh"
+#include "lix/libstore/globals.hh"
+#include "lix/libutil/error.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/strings.hh"
+#include "lix/libutil/thread-name.hh"
+
+#include <map>
+#include <memory>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+void createSandboxSkeleton(const Path & dir, const Path & storeDir)
+{
+    if (mkdir(dir.c_str(), 0700) == -1)
+        throw SysError("cannot create '%1%'", dir);
+
+    /* Create a writable /tmp in the chroot.  Many builders need
+       this.  (Of course they should really respect $TMPDIR
+       instead.) */
+    createDirs(dir + "/tmp");
+    chmodPath(dir + "/tmp", 01777);
+
+    createDirs(dir + "/etc");
+
+    /* Set up the mount points and symlinks of a nearly empty /dev.
+       They are hidden if the user asked to bind-mount the host /dev. */
+    createDirs(dir + "/dev/shm");
+    createDirs(dir + "/dev/pts");
+    createSymlink("/proc/self/fd", dir + "/dev/fd");
+    createSymlink("/proc/self/fd/0", dir + "/dev/stdin");
+    createSymlink("/proc/self/fd/1", dir + "/dev/stdout");
+    createSymlink("/proc/self/fd/2", dir + "/dev/stderr");
+
+    createDirs(dir + "/proc");
+
+    createDirs(dir + storeDir);
+}
+
+SandboxPool::SandboxPool(const Path & realStoreDir, const Path & storeDir, size_t size)
+    : dir(realStoreDir + "/" + dirName)
+    , storeDir(storeDir)
+    , size(size)
+{
+    createDirs(dir);
+    thread = std::thread([this]() { run(); });
+}
+
+SandboxPool::~SandboxPool()
+{
+    state_.lock()->quit = true;
+    wakeup.notify_one();
+    thread.join();
+
+    auto state(state_.lock());
+    auto left = std::move(state->ready);
+    left.insert(left.end(), state->garbage.begin(), state->garbage.end());
+
+    for (auto & path : left) {
+        try {
+            deletePathUninterruptible(path);
+        } catch (...) {
+            ignoreExceptionInDestructor();
+        }
+    }
+}
+
+bool SandboxPool::take(const Path & target)
+{
+    Path skeleton;
+    {
+        auto state(state_.lock());
+        if (state->ready.empty())
+            return false;
+        skeleton = std::move(state->ready.back());
+        state->ready.pop_back();
+    }
+    wakeup.notify_one();
+
+    if (rename(skeleton.c_str(), target.c_str()) == -1) {
+        debug("cannot use sandbox skeleton '%s': %s", skeleton, strerror(errno));
+        state_.lock()->garbage.push_back(std::move(skeleton));
+        wakeup.notify_one();
+        return false;
+    }
+    return true;
+}
+
+bool SandboxPool::discard(const Path & path)
+{
+    Path garbage;
+    {
+        auto state(state_.lock());
+        if (state->quit)
+            return false;
+        garbage = fmt("%s/%d-%d", dir, getpid(), state->counter++);
+    }
+
+    /* This fails if the sandbox is still in use as a mount point in
+       our mount namespace, or if it has been deleted already. */
+    if (rename(path.c_str(), garbage.c_str()) == -1)
+        return false;
+
+    state_.lock()->garbage.push_back(std::move(garbage));
+    wakeup.notify_one();
+    return true;
+}
+
+void SandboxPool::deleteStale()
+{
+    for (auto & entry : readDirectory(dir)) {
+        auto pid = string2Int<pid_t>(entry.name.substr(0, entry.name.find('-')));
+        if (pid && *pid != getpid() && kill(*pid, 0) == -1 && errno == ESRCH)
+            deletePathUninterruptible(dir + "/" + entry.name);
+    }
+}
+
+void SandboxPool::run()
+{
+    setCurrentThreadName("sandbox pool");
+
+    try {
+        deleteStale();
+    } catch (std::exception & e) {
+        debug("cannot delete stale sandboxes in '%s': %s", dir, e.what());
+    }
+
+    while (true) {
+        Path path;
+        bool prepare;
+        {
+            auto state(state_.lock());
+            while (!state->quit && state->garbage.empty() && (state->failed || state->ready.size() >= size))
+                state.wait(wakeup);
+            if (state->quit)
+                return;
+            /* Preparing sandboxes takes precedence over deleting them,
+               since builds may be waiting for them. */
+            prepare = !state->failed && state->ready.size() < size;
+            if (prepare) {
+                path = fmt("%s/%d-%d", dir, getpid(), state->counter++);
+            } else {
+                path = std::move(state->garbage.back());
+                state->garbage.pop_back();
+            }
+        }
+
+        try {
+            if (prepare) {
+                createSandboxSkeleton(path, storeDir);
+                state_.lock()->ready.push_back(std::move(path));
+            } else
+                deletePathUninterruptible(path);
+        } catch (std::exception & e) {
+            printError("sandbox pool: %s", e.what());
+            /* Don't retry in a loop, builds will create their own
+               sandboxes instead. */
+            if (prepare)
+                state_.lock()->failed = true;
+        }
+    }
+}
+
+SandboxPool * SandboxPool::get(const Path & realStoreDir, const Path & storeDir)
+{
+    if (settings.sandboxPoolSize == 0)
+        return nullptr;
+
+    static Sync<std::map<Path, std::unique_ptr<SandboxPool>>> pools_;
+
+    auto pools(pools_.lock());
+    auto & pool = (*pools)[realStoreDir];
+    if (!pool)
+        pool = std::make_unique<SandboxPool>(realStoreDir, storeDir, settings.sandboxPoolSize);
+    return pool.get();
+}
+
+}
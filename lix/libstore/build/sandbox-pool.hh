@@ -0,0 +1,86 @@
+#pragma once
+///@file
+
+#include "lix/libutil/sync.hh"
+#include "lix/libutil/types.hh"
+
+#include <condition_variable>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace nix {
+
+/**
+ * Create the parts of a build sandbox in `dir` that are the same for all
+ * builds: `/tmp`, `/etc`, the mount points and symlinks in `/dev`, `/proc`
+ * and the empty store directory `storeDir`.
+ */
+void createSandboxSkeleton(const Path & dir, const Path & storeDir);
+
+/**
+ * Sandbox skeletons (see `createSandboxSkeleton()`) prepared by a
+ * background thread, and sandboxes of finished builds waiting to be
+ * deleted by it. This moves setting up and tearing down the parts of a
+ * sandbox that all builds share off the critical path of short builds.
+ *
+ * Both live in `dirName` in the real store directory, so that they can
+ * be renamed to and from the location of a sandbox.
+ *
+ * Only built on Linux, the only platform with `sandbox-pool-size`.
+ */
+class SandboxPool
+{
+    struct State
+    {
+        std::vector<Path> ready;
+        std::vector<Path> garbage;
+        uint64_t counter = 0;
+        bool failed = false;
+        bool quit = false;
+    };
+
+    const Path dir;
+    const Path storeDir;
+    const size_t size;
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::thread thread;
+
+    /**
+     * Delete the entries left behind by processes that no longer exist.
+     */
+    void deleteStale();
+
+    void run();
+
+public:
+    static constexpr std::string_view dirName = ".sandboxes";
+
+    SandboxPool(const Path & realStoreDir, const Path & storeDir, size_t size);
+    ~SandboxPool();
+
+    /**
+     * Move a prepared skeleton to `target`, which must not exist.
+     *
+     * @return Whether a skeleton was available.
+     */
+    bool take(const Path & target);
+
+    /**
+     * Schedule the deletion of the sandbox at `path`.
+     *
+     * @return Whether `path` was moved out of the way. If not, the caller
+     * has to delete it.
+     */
+    bool discard(const Path & path);
+
+    /**
+     * @return The pool of the store in `realStoreDir`, or `nullptr` if
+     * `sandbox-pool-size` is 0.
+     */
+    static SandboxPool * get(const Path & realStoreDir, const Path & storeDir);
+};
+
+}
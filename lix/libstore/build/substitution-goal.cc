@@ -34,11 +34,21 @@ PathSubstitutionGoal::~PathSubstitutionGoal()
 }
 
 
+void PathSubstitutionGoal::recordEvent(BuildPhase phase, std::vector<std::string> inputs)
+{
+    if (phase == BuildPhase::Done && !eventsRecorded)
+        return;
+    recordBuildEvent(worker.store.printStorePath(storePath), phase, std::move(inputs));
+    eventsRecorded = true;
+}
+
+
 Goal::WorkResult PathSubstitutionGoal::done(
     ExitCode result,
     BuildResult::Status status,
     std::optional<std::string> errorMsg)
 {
+    recordEvent(BuildPhase::Done);
     BuildResult buildResult{.status = status};
     if (errorMsg) {
         debug(*errorMsg);
@@ -48,6 +58,18 @@ Goal::WorkResult PathSubstitutionGoal::done(
 }
 
 
+std::optional<StorePath> PathSubstitutionGoal::pathIn(Store & sub)
+{
+    if (ca)
+        return sub.makeFixedOutputPathFromCA(
+            std::string { storePath.name() },
+            ContentAddressWithReferences::withoutRefs(*ca));
+    if (sub.config().storeDir != worker.store.config().storeDir)
+        return std::nullopt;
+    return storePath;
+}
+
+
 kj::Promise<Result<Goal::WorkResult>> PathSubstitutionGoal::workImpl() noexcept
 try {
     trace("init");
@@ -64,6 +86,14 @@ try {
 
     subs = settings.useSubstitutes ? TRY_AWAIT(getDefaultSubstituters()) : std::list<ref<Store>>();
 
+    /* Ask all substituters at once. `tryNext()` still goes through the
+       answers in order of priority, but no longer has to wait for one
+       substituter before asking the next. */
+    if (settings.parallelSubstituterQueries && subs.size() > 1)
+        for (auto & sub : subs)
+            if (auto path = pathIn(*sub))
+                pendingQueries.emplace(&*sub, sub->queryPathInfo(*path));
+
     BOOST_OUTCOME_CO_TRY(auto result, co_await tryNext());
     result.storePath = storePath;
     co_return result;
@@ -98,9 +128,7 @@ try {
     subs.pop_front();
 
     if (ca) {
-        subPath = sub->makeFixedOutputPathFromCA(
-            std::string { storePath.name() },
-            ContentAddressWithReferences::withoutRefs(*ca));
+        subPath = pathIn(*sub);
         if (sub->config().storeDir == worker.store.config().storeDir)
             assert(subPath == storePath);
     } else if (sub->config().storeDir != worker.store.config().storeDir) {
@@ -109,7 +137,14 @@ try {
 
     do {
         try {
-            info = TRY_AWAIT(sub->queryPathInfo(subPath ? *subPath : storePath));
+            auto pending = pendingQueries.find(&*sub);
+            if (pending != pendingQueries.end()) {
+                auto query = std::move(pending->second);
+                pendingQueries.erase(pending);
+                info = TRY_AWAIT(std::move(query));
+            } else {
+                info = TRY_AWAIT(sub->queryPathInfo(subPath ? *subPath : storePath));
+            }
             break;
         } catch (InvalidPath &) {
         } catch (SubstituterDisabled &) {
@@ -158,6 +193,9 @@ try {
         co_return co_await tryNext();
     }
 
+    /* The remaining substituters are only needed if this one fails. */
+    pendingQueries.clear();
+
     /* To maintain the closure invariant, we first have to realise the
        paths referenced by this one. */
     kj::Vector<std::pair<GoalPtr, kj::Promise<Result<WorkResult>>>> dependencies;
@@ -166,6 +204,11 @@ try {
             dependencies.add(worker.goalFactory().makePathSubstitutionGoal(i));
 
     if (!dependencies.empty()) {/* to prevent hang (no wake-up event) */
+        std::vector<std::string> inputs;
+        for (auto & i : info->references)
+            if (i != storePath)
+                inputs.push_back(worker.store.printStorePath(i));
+        recordEvent(BuildPhase::WaitingForInputs, std::move(inputs));
         TRY_AWAIT(waitForGoals(dependencies.releaseAsArray()));
     }
     co_return co_await referencesValid();
@@ -202,9 +245,12 @@ try {
     trace("trying to run");
 
     if (!slotToken.valid()) {
+        recordEvent(BuildPhase::WaitingForSlot);
         slotToken = co_await worker.substitutions.acquire();
     }
 
+    recordEvent(BuildPhase::Substituting);
+
     maintainRunningSubstitutions = worker.runningSubstitutions.addTemporarily(1);
 
     auto pipe = kj::newPromiseAndCrossThreadFulfiller<void>();
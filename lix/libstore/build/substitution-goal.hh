@@ -1,11 +1,14 @@
 #pragma once
 ///@file
 
+#include "lix/libstore/build-events.hh"
 #include "lix/libstore/lock.hh"
 #include "lix/libutil/notifying-counter.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libstore/build/goal.hh"
 
+#include <map>
+
 namespace nix {
 
 class Worker;
@@ -43,6 +46,12 @@ struct PathSubstitutionGoal : public Goal
      */
     std::shared_ptr<const ValidPathInfo> info;
 
+    /**
+     * Queries of the remaining substituters started ahead of time, see
+     * `parallel-substituter-queries`.
+     */
+    std::map<const Store *, kj::Promise<Result<ref<const ValidPathInfo>>>> pendingQueries;
+
     /**
      * Pipe for the substituter's standard output.
      */
@@ -72,6 +81,23 @@ struct PathSubstitutionGoal : public Goal
      */
     std::optional<ContentAddress> ca;
 
+    /**
+     * Whether this goal has recorded anything in the `build-event-log`,
+     * and thus has to record when it is done.
+     */
+    bool eventsRecorded = false;
+
+    /**
+     * Record in the `build-event-log` that this goal entered `phase`.
+     */
+    void recordEvent(BuildPhase phase, std::vector<std::string> inputs = {});
+
+    /**
+     * @return The path to ask `sub` for, or `std::nullopt` if `sub` cannot
+     * provide it.
+     */
+    std::optional<StorePath> pathIn(Store & sub);
+
     WorkResult done(
         ExitCode result,
         BuildResult::Status status,
@@ -59,6 +59,31 @@ Worker::~Worker()
 }
 
 
+bool Worker::haveHeadroomFor(std::optional<uint64_t> memoryPeak)
+{
+#if __linux__
+    if (settings.maxBuildPressure == 0)
+        return true;
+
+    return admission.admit(memoryPeak, settings.maxBuildPressure, localBuilds.used() <= 1);
+#else
+    return true;
+#endif
+}
+
+
+kj::Promise<void> Worker::waitForRemoteBuilder(uint64_t priority)
+{
+    return hook.postponed.wait(priority).exclusiveJoin(
+        AIO().provider.getTimer().afterDelay(settings.pollInterval.get() * kj::SECONDS)
+    );
+}
+
+void Worker::remoteBuildFinished()
+{
+    hook.postponed.notifyOne();
+}
+
 template<typename ID, std::derived_from<Goal> G>
 std::pair<std::shared_ptr<G>, kj::Promise<Result<Goal::WorkResult>>> Worker::makeGoalCommon(
     std::map<ID, CachedGoal<G>> & map,
@@ -3,17 +3,21 @@
 
 #include "lix/libutil/async.hh"
 #include "lix/libutil/async-semaphore.hh"
+#include "lix/libutil/async-wait-queue.hh"
 #include "lix/libutil/concepts.hh"
 #include "lix/libutil/notifying-counter.hh"
 #include "lix/libutil/result.hh"
 #include "lix/libutil/types.hh"
 #include "lix/libstore/lock.hh"
 #include "lix/libstore/store-api.hh"
+#include "lix/libstore/build/build-admission.hh"
 #include "lix/libstore/build/goal.hh"
 #include "lix/libstore/realisation.hh"
 
 #include <future>
+#include <functional>
 #include <kj/async-io.h>
+#include <map>
 #include <thread>
 
 namespace nix {
@@ -196,7 +200,19 @@ public:
     Store & evalStore;
     AsyncSemaphore substitutions, localBuilds;
 
+    /**
+     * Whether the system has the resources to start another local build,
+     * which is expected to use at most `memoryPeak` bytes of memory,
+     * according to `max-build-pressure` (see `BuildAdmission`). Always
+     * true for a build that holds the only used slot of `localBuilds`.
+     */
+    bool haveHeadroomFor(std::optional<uint64_t> memoryPeak);
+
 private:
+#if __linux__
+    BuildAdmission admission;
+#endif
+
     kj::TaskSet children;
 
 public:
@@ -208,10 +224,31 @@ public:
          * it answers with "decline-permanently", we don't try again.
          */
         bool available = true;
+
+        /**
+         * Goals the build hook told to postpone their build, ordered by
+         * their `DerivationGoal::buildPriority()`. Whenever a remote build
+         * finishes the first goal still waiting is woken up, so that the
+         * freed machine goes to the most important build instead of to
+         * whichever goal polls first.
+         */
+        AsyncWaitQueue postponed;
     };
 
     HookState hook;
 
+    /**
+     * Wait until a remote build finishes and no goal with a higher
+     * priority is waiting for one, or until `Goal::waitForAWhile()` would
+     * have returned.
+     */
+    kj::Promise<void> waitForRemoteBuilder(uint64_t priority);
+
+    /**
+     * Wake up the first goal waiting in `waitForRemoteBuilder()`.
+     */
+    void remoteBuildFinished();
+
     NotifyingCounter<uint64_t> expectedBuilds{[this] { updateStatisticsLater(); }};
     NotifyingCounter<uint64_t> doneBuilds{[this] { updateStatisticsLater(); }};
     NotifyingCounter<uint64_t> failedBuilds{[this] { updateStatisticsLater(); }};
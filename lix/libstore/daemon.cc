@@ -10,6 +10,7 @@
 #include "lix/libstore/log-store.hh"
 #include "lix/libstore/indirect-root-store.hh"
 #include "lix/libstore/path-with-outputs.hh"
+#include "lix/libutil/environment-variables.hh"
 #include "lix/libutil/finally.hh"
 #include "lix/libutil/archive.hh"
 #include "lix/libstore/derivations.hh"
@@ -885,7 +886,11 @@ static void performOp(AsyncIoRoot & aio, TunnelLogger * logger, ref<Store> store
         auto path = store->parseStorePath(readString(from));
         logger->startWork();
         logger->stopWork();
-        to << dumpPath(store->toRealPath(path));
+        if (auto fdSink = dynamic_cast<FdSink *>(&to)) {
+            dumpPath(store->toRealPath(path), *fdSink);
+        } else {
+            to << dumpPath(store->toRealPath(path));
+        }
         break;
     }
 
@@ -951,6 +956,25 @@ static void performOp(AsyncIoRoot & aio, TunnelLogger * logger, ref<Store> store
         break;
     }
 
+    case WorkerProto::Op::QueryClosure: {
+        /* Lets the tests act like a daemon that predates this operation. */
+        if (getEnv("_NIX_TEST_NO_QUERY_CLOSURE") == "1")
+            throw Error("invalid operation %1%", op);
+        auto paths = WorkerProto::Serialise<StorePathSet>::read(*store, rconn);
+        bool includeOutputs, includeDerivers;
+        from >> includeOutputs >> includeDerivers;
+        logger->startWork();
+        StorePathSet closure;
+        aio.blockOn(store->computeFSClosure(paths, closure, false, includeOutputs, includeDerivers));
+        std::vector<ValidPathInfo> infos;
+        infos.reserve(closure.size());
+        for (auto & path : closure)
+            infos.push_back(*aio.blockOn(store->queryPathInfo(path)));
+        logger->stopWork();
+        to << WorkerProto::write(*store, wconn, infos);
+        break;
+    }
+
     case WorkerProto::Op::RegisterDrvOutput: {
         logger->startWork();
         if (GET_PROTOCOL_MINOR(clientVersion) < 31) {
@@ -23,7 +23,11 @@
 
 #include <algorithm>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <map>
+#include <queue>
 #include <random>
 #include <thread>
 #include <regex>
@@ -57,12 +61,41 @@ struct curlFileTransfer : public FileTransfer
         std::unique_ptr<FILE, decltype([](FILE * f) { fclose(f); })> uploadData;
         Sync<DownloadState> downloadState;
         std::condition_variable downloadEvent;
+
+        struct UploadState
+        {
+            /** Data written by the uploader that curl has not yet read from `pos` on. */
+            std::string data;
+            size_t pos = 0;
+            /** Whether the uploader has written all data. */
+            bool finished = false;
+            /** Whether the transfer has finished or failed. */
+            bool transferDone = false;
+        };
+
+        /**
+         * Whether the data to upload is streamed through `uploadState`.
+         */
+        bool streamUpload = false;
+        Sync<UploadState> uploadState;
+        std::condition_variable uploadEvent;
         bool headersDone = false, metadataReturned = false;
         std::promise<FileTransferResult> metadataPromise;
         std::string statusMsg;
 
         uint64_t bodySize = 0;
 
+        /**
+         * Keep the whole body in `downloadState` instead of pausing the
+         * transfer until someone reads from it.
+         */
+        bool bufferBody = false;
+
+        /**
+         * Called once when the transfer has finished or failed.
+         */
+        std::function<void()> onFinish;
+
         std::unique_ptr<curl_slist, decltype([](auto * s) { curl_slist_free_all(s); })> requestHeaders;
         std::unique_ptr<CURL, decltype([](auto * c) { curl_easy_cleanup(c); })> req;
         // buffer to accompany the `req` above
@@ -108,7 +141,7 @@ struct curlFileTransfer : public FileTransfer
 
         std::string verb() const
         {
-            return uploadData ? "upload" : "download";
+            return uploadData || streamUpload ? "upload" : "download";
         }
 
         TransferItem(const std::string & uri,
@@ -116,12 +149,14 @@ struct curlFileTransfer : public FileTransfer
             ActivityId parentAct,
             std::optional<std::string_view> uploadData,
             bool noBody,
-            curl_off_t writtenToSink
+            curl_off_t writtenToSink,
+            bool streamUpload = false
         )
             : uri(uri)
             , act(*logger, lvlTalkative, actFileTransfer,
-                fmt(uploadData ? "uploading '%s'" : "downloading '%s'", uri),
+                fmt(uploadData || streamUpload ? "uploading '%s'" : "downloading '%s'", uri),
                 {uri}, parentAct)
+            , streamUpload(streamUpload)
             , req(curl_easy_init())
         {
             if (req == nullptr) {
@@ -185,6 +220,11 @@ struct curlFileTransfer : public FileTransfer
                 curl_easy_setopt(req.get(), CURLOPT_UPLOAD, 1L);
                 curl_easy_setopt(req.get(), CURLOPT_READDATA, this->uploadData.get());
                 curl_easy_setopt(req.get(), CURLOPT_INFILESIZE_LARGE, (curl_off_t) uploadData->length());
+            } else if (streamUpload) {
+                // without a size curl uses chunked transfer encoding over HTTP/1.1
+                curl_easy_setopt(req.get(), CURLOPT_UPLOAD, 1L);
+                curl_easy_setopt(req.get(), CURLOPT_READFUNCTION, TransferItem::readCallbackWrapper);
+                curl_easy_setopt(req.get(), CURLOPT_READDATA, this);
             }
 
             if (settings.caFile != "")
@@ -267,9 +307,11 @@ struct curlFileTransfer : public FileTransfer
 
                 auto state = downloadState.lock();
 
-                // when the buffer is full (as determined by a historical magic value) we
+                // when the buffer is full (as determined by download-buffer-size) we
                 // pause the transfer and wait for the receiver to unpause it when ready.
-                if (successfulStatuses.count(getHTTPStatus()) && state->data.size() > 1024 * 1024) {
+                if (successfulStatuses.count(getHTTPStatus()) && !bufferBody
+                    && state->data.size() > fileTransferSettings.downloadBufferSize.get())
+                {
                     return CURL_WRITEFUNC_PAUSE;
                 }
 
@@ -288,6 +330,32 @@ struct curlFileTransfer : public FileTransfer
             return static_cast<TransferItem *>(userp)->writeCallback(contents, size, nmemb);
         }
 
+        size_t readCallback(char * buffer, size_t size, size_t nitems)
+        {
+            auto state = uploadState.lock();
+
+            // like downloads, streamed uploads are paused until the uploader
+            // has written more data and unpauses them
+            if (state->pos == state->data.size()) {
+                return state->finished ? 0 : CURL_READFUNC_PAUSE;
+            }
+
+            const auto n = std::min(size * nitems, state->data.size() - state->pos);
+            memcpy(buffer, state->data.data() + state->pos, n);
+            state->pos += n;
+            if (state->pos == state->data.size()) {
+                state->data.clear();
+                state->pos = 0;
+            }
+            uploadEvent.notify_all();
+            return n;
+        }
+
+        static size_t readCallbackWrapper(char * buffer, size_t size, size_t nitems, void * userp)
+        {
+            return static_cast<TransferItem *>(userp)->readCallback(buffer, size, nitems);
+        }
+
         size_t headerCallback(void * contents, size_t size, size_t nmemb)
         try {
             size_t realSize = size * nmemb;
@@ -448,6 +516,46 @@ struct curlFileTransfer : public FileTransfer
 
                 fail(std::move(exc));
             }
+
+            if (streamUpload) {
+                uploadState.lock()->transferDone = true;
+                uploadEvent.notify_all();
+            }
+
+            if (auto onFinish = std::exchange(this->onFinish, nullptr)) {
+                onFinish();
+            }
+        }
+
+        /**
+         * Called by the worker thread once it has dropped a cancelled transfer
+         * to wake up anyone still waiting for it to finish.
+         */
+        void abandon()
+        {
+            {
+                auto state = downloadState.lock();
+                if (!state->done && !state->exc) {
+                    auto ex = std::make_exception_ptr(
+                        FileTransferError(Interrupted, {}, "%s of '%s' was cancelled", verb(), uri)
+                    );
+                    if (!metadataReturned) {
+                        metadataPromise.set_exception(ex);
+                        metadataReturned = true;
+                    }
+                    state->exc = ex;
+                    downloadEvent.notify_all();
+                }
+            }
+
+            if (streamUpload) {
+                uploadState.lock()->transferDone = true;
+                uploadEvent.notify_all();
+            }
+
+            if (auto onFinish = std::exchange(this->onFinish, nullptr)) {
+                onFinish();
+            }
         }
     };
 
@@ -565,10 +673,20 @@ struct curlFileTransfer : public FileTransfer
 
         while (true) {
             {
-                auto cancel = [&] { return std::move(state_.lock()->cancel); }();
+                auto cancel = [&] {
+                    auto state(state_.lock());
+                    // transfers that were cancelled before we got to start them
+                    // must not be started later.
+                    std::erase_if(state->incoming, [&](auto & item) {
+                        return state->cancel.contains(item);
+                    });
+                    return std::move(state->cancel);
+                }();
                 for (auto & [item, promise] : cancel) {
-                    curl_multi_remove_handle(curlm.get(), item->req.get());
-                    items.erase(item->req.get());
+                    if (items.erase(item->req.get())) {
+                        curl_multi_remove_handle(curlm.get(), item->req.get());
+                    }
+                    item->abandon();
                     promise.set_value();
                 }
             }
@@ -657,7 +775,7 @@ struct curlFileTransfer : public FileTransfer
 
     void enqueueItem(std::shared_ptr<TransferItem> item)
     {
-        if (item->uploadData
+        if ((item->uploadData || item->streamUpload)
             && !item->uri.starts_with("http://")
             && !item->uri.starts_with("https://"))
             throw nix::Error("uploading to '%s' is not supported", item->uri);
@@ -692,6 +810,86 @@ struct curlFileTransfer : public FileTransfer
         enqueueFileTransfer(uri, headers, std::move(data), false);
     }
 
+    struct UploadSink : FinishSink
+    {
+        curlFileTransfer & parent;
+        std::shared_ptr<TransferItem> transfer;
+        bool finished = false;
+
+        UploadSink(curlFileTransfer & parent, const std::string & uri, const Headers & headers)
+            : parent(parent)
+            , transfer(std::make_shared<TransferItem>(
+                  uri, headers, getCurActivity(), std::nullopt, false, 0, true
+              ))
+        {
+            parent.enqueueItem(transfer);
+        }
+
+        ~UploadSink()
+        {
+            try {
+                if (!finished) {
+                    parent.cancel(transfer);
+                }
+            } catch (...) {
+                ignoreExceptionInDestructor();
+            }
+        }
+
+        void operator()(std::string_view data) override
+        {
+            bool transferDone = [&] {
+                auto state(transfer->uploadState.lock());
+                /* Wait for curl to catch up if it is too far behind. */
+                while (state->data.size() - state->pos > 1024 * 1024 && !state->transferDone) {
+                    checkInterrupt();
+                    state.wait(transfer->uploadEvent);
+                }
+                if (!state->transferDone) {
+                    state->data.append(data);
+                }
+                return state->transferDone;
+            }();
+            if (transferDone) {
+                throwTransferError();
+            }
+            parent.unpause(transfer);
+        }
+
+        void finish() override
+        {
+            transfer->uploadState.lock()->finished = true;
+            parent.unpause(transfer);
+
+            auto state(transfer->downloadState.lock());
+            while (!state->done && !state->exc) {
+                state.wait(transfer->downloadEvent);
+            }
+            finished = true;
+            if (state->exc) {
+                std::rethrow_exception(state->exc);
+            }
+        }
+
+    private:
+        [[noreturn]] void throwTransferError()
+        {
+            finished = true;
+            auto state(transfer->downloadState.lock());
+            if (state->exc) {
+                std::rethrow_exception(state->exc);
+            }
+            throw FileTransferError(
+                Misc, {}, "upload to '%s' finished before all data was sent", transfer->uri
+            );
+        }
+    };
+
+    box_ptr<FinishSink> uploadStream(const std::string & uri, const Headers & headers) override
+    {
+        return make_box_ptr<UploadSink>(*this, uri, headers);
+    }
+
     std::optional<std::pair<FileTransferResult, box_ptr<Source>>> tryEagerTransfers(
         const std::string & uri,
         const Headers & headers,
@@ -805,6 +1003,11 @@ struct curlFileTransfer : public FileTransfer
         ActivityId parentAct = getCurActivity();
 
         std::shared_ptr<TransferItem> transfer;
+        /**
+         * Guards replacing `transfer` on retries against `cancel()`, which
+         * may be called from another thread than the reader.
+         */
+        Sync<bool> cancelled_;
         FileTransferResult metadata;
         std::string chunk;
         std::string_view buffered;
@@ -871,8 +1074,15 @@ struct curlFileTransfer : public FileTransfer
         {
             attempt += 1;
             auto uploadData = data ? std::optional(std::string_view(*data)) : std::nullopt;
-            transfer =
-                std::make_shared<TransferItem>(uri, headers, parentAct, uploadData, noBody, offset);
+            {
+                auto cancelled(cancelled_.lock());
+                if (*cancelled) {
+                    throw FileTransferError(Interrupted, {}, "download of '%s' was cancelled", uri);
+                }
+                transfer = std::make_shared<TransferItem>(
+                    uri, headers, parentAct, uploadData, noBody, offset
+                );
+            }
             parent.enqueueItem(transfer);
             return transfer->metadataPromise.get_future().get();
         }
@@ -965,8 +1175,59 @@ struct curlFileTransfer : public FileTransfer
 
             return total;
         }
+
+        void cancel() override
+        {
+            auto toCancel = [&] {
+                auto cancelled(cancelled_.lock());
+                *cancelled = true;
+                return transfer;
+            }();
+            if (toCancel) {
+                parent.cancel(toCancel);
+            }
+        }
     };
 
+    std::shared_future<std::string>
+    enqueueDownload(const std::string & uri, std::function<void()> onDone) override
+    {
+        auto promise = std::make_shared<std::promise<std::string>>();
+        std::shared_future<std::string> result = promise->get_future();
+
+        try {
+            if (auto eager = tryEagerTransfers(uri, {}, std::nullopt, false)) {
+                promise->set_value(eager->second->drain());
+            } else {
+                auto transfer =
+                    std::make_shared<TransferItem>(uri, Headers{}, getCurActivity(), std::nullopt, false, 0);
+                transfer->bufferBody = true;
+                transfer->onFinish = [transfer{transfer.get()}, promise, onDone] {
+                    {
+                        auto state(transfer->downloadState.lock());
+                        if (state->exc) {
+                            promise->set_exception(state->exc);
+                        } else {
+                            promise->set_value(std::move(state->data));
+                        }
+                    }
+                    if (onDone) {
+                        onDone();
+                    }
+                };
+                enqueueItem(transfer);
+                return result;
+            }
+        } catch (...) {
+            promise->set_exception(std::current_exception());
+        }
+
+        if (onDone) {
+            onDone();
+        }
+        return result;
+    }
+
     bool exists(const std::string & uri, const Headers & headers) override
     {
         try {
@@ -1008,6 +1269,174 @@ ref<FileTransfer> makeFileTransfer(std::optional<unsigned int> baseRetryTimeMs)
     return makeCurlFileTransfer(baseRetryTimeMs);
 }
 
+struct DownloadPrefetcher::Shared
+{
+    struct Entry
+    {
+        /**
+         * Unset until the request has been sent.
+         */
+        std::optional<std::shared_future<std::string>> body;
+        bool arrived = false;
+        /**
+         * Whether the download has been taken before it arrived. It is
+         * forgotten once it does, after calling `waiters`.
+         */
+        bool taken = false;
+        std::vector<std::function<void()>> waiters;
+    };
+
+    struct State
+    {
+        std::map<std::string, Entry> files;
+        /**
+         * Files that have arrived, oldest first. These are the ones that
+         * are given up on when the limit is reached.
+         */
+        std::deque<std::string> arrived;
+        /**
+         * Files that have arrived but have not been passed to
+         * `onArrival` yet.
+         */
+        std::queue<std::pair<std::string, std::shared_future<std::string>>> pending;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /**
+     * Called from the transfer thread, so this must be quick.
+     */
+    void arrived(const std::string & key)
+    {
+        std::vector<std::function<void()>> waiters;
+        {
+            auto state(state_.lock());
+            auto i = state->files.find(key);
+            if (i == state->files.end())
+                return;
+            auto & entry = i->second;
+            entry.arrived = true;
+            if (entry.taken) {
+                waiters = std::move(entry.waiters);
+                state->files.erase(i);
+            } else {
+                state->arrived.push_back(key);
+                /* Otherwise `prefetch()` queues it once the request has
+                   been sent. */
+                if (entry.body) {
+                    state->pending.emplace(key, *entry.body);
+                    wakeup.notify_one();
+                }
+            }
+        }
+        for (auto & waiter : waiters)
+            waiter();
+    }
+};
+
+DownloadPrefetcher::DownloadPrefetcher(
+    ref<FileTransfer> transfer,
+    size_t limit,
+    std::function<void(const std::string & key, const std::string & body)> onArrival
+)
+    : transfer(transfer)
+    , limit(limit)
+    , onArrival(std::move(onArrival))
+    , shared(std::make_shared<Shared>())
+{
+}
+
+DownloadPrefetcher::~DownloadPrefetcher()
+{
+    shared->state_.lock()->quit = true;
+    shared->wakeup.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+bool DownloadPrefetcher::prefetch(const std::string & key, const std::string & uri)
+{
+    {
+        auto state(shared->state_.lock());
+        if (state->files.contains(key))
+            return true;
+        while (state->files.size() >= limit && !state->arrived.empty()) {
+            auto i = state->files.find(state->arrived.front());
+            if (i != state->files.end() && i->second.arrived)
+                state->files.erase(i);
+            state->arrived.pop_front();
+        }
+        if (state->files.size() >= limit)
+            return false;
+        state->files.emplace(key, Shared::Entry{});
+    }
+
+    std::call_once(started, [&] { worker = std::thread([this] { run(); }); });
+
+    auto body = transfer->enqueueDownload(uri, [shared{shared}, key] { shared->arrived(key); });
+
+    auto state(shared->state_.lock());
+    auto i = state->files.find(key);
+    if (i != state->files.end()) {
+        i->second.body = body;
+        if (i->second.arrived) {
+            state->pending.emplace(key, body);
+            shared->wakeup.notify_one();
+        }
+    }
+    return true;
+}
+
+std::optional<std::shared_future<std::string>>
+DownloadPrefetcher::take(const std::string & key, std::function<void()> onDone)
+{
+    std::shared_future<std::string> body;
+    {
+        auto state(shared->state_.lock());
+        auto i = state->files.find(key);
+        if (i == state->files.end() || !i->second.body)
+            return std::nullopt;
+        body = *i->second.body;
+        if (!i->second.arrived) {
+            i->second.taken = true;
+            if (onDone)
+                i->second.waiters.push_back(std::move(onDone));
+            return body;
+        }
+        state->files.erase(i);
+    }
+    if (onDone)
+        onDone();
+    return body;
+}
+
+void DownloadPrefetcher::run()
+{
+    setCurrentThreadName("prefetch");
+
+    while (true) {
+        std::pair<std::string, std::shared_future<std::string>> next;
+        {
+            auto state(shared->state_.lock());
+            while (!state->quit && state->pending.empty())
+                state.wait(shared->wakeup);
+            if (state->quit)
+                return;
+            next = std::move(state->pending.front());
+            state->pending.pop();
+        }
+
+        try {
+            onArrival(next.first, next.second.get());
+        } catch (...) {
+            /* Whatever went wrong will be reported if and when the file
+               is actually asked for. */
+        }
+    }
+}
+
 template<typename... Args>
 FileTransferError::FileTransferError(FileTransfer::Error error, std::optional<std::string> response, const Args & ... args)
     : Error(args...), error(error), response(response)
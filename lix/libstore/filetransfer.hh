@@ -8,8 +8,11 @@
 #include "lix/libutil/types.hh"
 #include "lix/libutil/config.hh"
 
+#include <functional>
+#include <mutex>
 #include <string>
 #include <future>
+#include <thread>
 
 namespace nix {
 
@@ -43,6 +46,16 @@ struct FileTransfer
     virtual void
     upload(const std::string & uri, std::string data, const Headers & headers = {}) = 0;
 
+    /**
+     * Upload data of unknown size while it is written to the returned sink,
+     * using chunked transfer encoding where necessary. Calling `finish()` on
+     * the sink waits for the upload to complete and may throw a
+     * FileTransferError exception. Destroying the sink before that aborts
+     * the upload. Streamed uploads are not retried.
+     */
+    virtual box_ptr<FinishSink>
+    uploadStream(const std::string & uri, const Headers & headers = {}) = 0;
+
     /**
      * Checks whether the given URI exists. For historical reasons this function
      * treats HTTP 403 responses like HTTP 404 responses and returns `false` for
@@ -65,6 +78,19 @@ struct FileTransfer
     virtual std::pair<FileTransferResult, box_ptr<Source>>
     download(const std::string & uri, const Headers & headers = {}) = 0;
 
+    /**
+     * Start downloading a small file in the background and return at once.
+     * The transfer shares connections and HTTP/2 multiplexing with all other
+     * transfers, but no thread has to wait for it while it is in flight.
+     * `onDone`, if set, is called once the result is available, usually
+     * from the transfer thread, so it must be quick and must not throw.
+     *
+     * Failed transfers are not retried. This is meant for speculative
+     * requests whose callers can fall back to `download()`.
+     */
+    virtual std::shared_future<std::string>
+    enqueueDownload(const std::string & uri, std::function<void()> onDone = {}) = 0;
+
     enum Error { NotFound, Forbidden, Misc, Transient, Interrupted };
 };
 
@@ -83,6 +109,56 @@ ref<FileTransfer> getFileTransfer();
  */
 ref<FileTransfer> makeFileTransfer(std::optional<unsigned int> baseRetryTimeMs = {});
 
+/**
+ * Speculative downloads of small files, started with
+ * `FileTransfer::enqueueDownload()` and deduplicated by key. Files that
+ * arrive and have not been taken yet are handed to `onArrival` on a
+ * thread of the prefetcher's own, never on the transfer thread, so
+ * `onArrival` may take its time and start more prefetches.
+ */
+class DownloadPrefetcher
+{
+    struct Shared;
+
+    ref<FileTransfer> transfer;
+    size_t limit;
+    std::function<void(const std::string & key, const std::string & body)> onArrival;
+    std::shared_ptr<Shared> shared;
+    std::once_flag started;
+    std::thread worker;
+
+    void run();
+
+public:
+    /**
+     * @param limit The maximum number of downloads that are in flight
+     * or have arrived without being taken. Once it is reached, files
+     * that have arrived are given up on, oldest first.
+     */
+    DownloadPrefetcher(
+        ref<FileTransfer> transfer,
+        size_t limit,
+        std::function<void(const std::string & key, const std::string & body)> onArrival
+    );
+    ~DownloadPrefetcher();
+
+    /**
+     * Start downloading `uri` unless `key` has been prefetched already.
+     *
+     * @return Whether there is still room for more prefetches.
+     */
+    bool prefetch(const std::string & key, const std::string & uri);
+
+    /**
+     * Take over the prefetched download of `key`, if any. `onDone` is
+     * called once its result is available, possibly at once and
+     * possibly from the transfer thread, so it must be quick and must
+     * not throw.
+     */
+    std::optional<std::shared_future<std::string>>
+    take(const std::string & key, std::function<void()> onDone = {});
+};
+
 class FileTransferError : public Error
 {
 public:
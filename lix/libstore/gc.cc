@@ -1,6 +1,8 @@
+#include "lix/libstore/build/sandbox-pool.hh"
 #include "lix/libstore/globals.hh"
 #include "lix/libstore/local-store.hh"
 #include "lix/libstore/pathlocks.hh"
+#include "lix/libstore/valid-path-graph.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/error.hh"
 #include "lix/libutil/processes.hh"
@@ -198,6 +200,10 @@ try {
        seen by a future run of the garbage collector. */
     auto s = printStorePath(path) + '\0';
     writeFull(_fdTempRoots.lock()->get(), s);
+
+    /* Callers check the validity of a path after rooting it, and a
+       garbage collector may have deleted it just before. */
+    if (pathGraph) pathGraph->invalidate();
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();
@@ -871,7 +877,8 @@ try {
             while (errno = 0, dirent = readdir(dir.get())) {
                 checkInterrupt();
                 std::string name = dirent->d_name;
-                if (name == "." || name == ".." || name == linksName) continue;
+                if (name == "." || name == ".." || name == linksName || name == SandboxPool::dirName)
+                    continue;
 
                 if (auto storePath = maybeParseStorePath(config().storeDir + "/" + name))
                     TRY_AWAIT(deleteReferrersClosure(*storePath));
@@ -2,6 +2,7 @@
 #include "lix/libstore/binary-cache-store.hh"
 #include "lix/libstore/filetransfer.hh"
 #include "lix/libstore/globals.hh"
+#include "lix/libstore/nar-info.hh"
 #include "lix/libstore/nar-info-disk-cache.hh"
 #include "lix/libutil/result.hh"
 
@@ -13,6 +14,15 @@ struct HttpBinaryCacheStoreConfig final : BinaryCacheStoreConfig
 {
     using BinaryCacheStoreConfig::BinaryCacheStoreConfig;
 
+    const Setting<unsigned int> narinfoPrefetch{this, 256, "narinfo-prefetch",
+        R"(
+          Maximum number of `.narinfo` files of referenced paths to request
+          ahead of time. Whenever a `.narinfo` file arrives, the files of all
+          its references that are not known yet are requested as well, so
+          that walking a closure does not wait for it one level at a time.
+          `0` disables prefetching.
+        )"};
+
     const std::string name() override { return "HTTP Binary Cache Store"; }
 
     std::string doc() override
@@ -38,6 +48,12 @@ private:
 
     Sync<State> _state;
 
+    /**
+     * Prefetched `.narinfo` files that have not been asked for yet,
+     * keyed by file name.
+     */
+    DownloadPrefetcher prefetcher;
+
 public:
 
     HttpBinaryCacheStore(
@@ -48,6 +64,13 @@ public:
         , BinaryCacheStore(config)
         , config_(std::move(config))
         , cacheUri(scheme + "://" + _cacheUri)
+        , prefetcher(
+              getFileTransfer(),
+              config_.narinfoPrefetch,
+              [this](const std::string & file, const std::string & body) {
+                  prefetchReferences(file, body);
+              }
+          )
     {
         if (cacheUri.back() == '/')
             cacheUri.pop_back();
@@ -143,6 +166,56 @@ protected:
         }
     }
 
+    bool canRenameFiles() override
+    {
+        return false;
+    }
+
+    std::unique_ptr<Upload> beginUpload(const std::string & tempPath, const std::string & mimeType) override
+    {
+        /* HTTP has no way to rename files, so the upload keeps its name. */
+        struct HttpUpload : Upload
+        {
+            HttpBinaryCacheStore & store;
+            std::string path;
+            box_ptr<FinishSink> sink;
+
+            HttpUpload(HttpBinaryCacheStore & store, const std::string & path, box_ptr<FinishSink> sink)
+                : store(store)
+                , path(path)
+                , sink(std::move(sink))
+            {
+            }
+
+            void operator()(std::string_view data) override
+            {
+                try {
+                    (*sink)(data);
+                } catch (FileTransferError & e) {
+                    throw UploadToHTTP(
+                        "while uploading to HTTP binary cache at '%s': %s", store.cacheUri, e.msg()
+                    );
+                }
+            }
+
+            std::string commit(const std::string &) override
+            {
+                try {
+                    sink->finish();
+                } catch (FileTransferError & e) {
+                    throw UploadToHTTP(
+                        "while uploading to HTTP binary cache at '%s': %s", store.cacheUri, e.msg()
+                    );
+                }
+                return path;
+            }
+        };
+
+        return std::make_unique<HttpUpload>(
+            *this, tempPath, getFileTransfer()->uploadStream(makeURI(tempPath), {{"Content-Type", mimeType}})
+        );
+    }
+
     std::string makeURI(const std::string & path)
     {
         return path.starts_with("https://") || path.starts_with("http://")
@@ -151,6 +224,123 @@ protected:
             : cacheUri + "/" + path;
     }
 
+    std::optional<std::string> getFileContents(const std::string & path) override
+    {
+        checkEnabled();
+
+        if (auto body = prefetcher.take(path)) {
+            try {
+                return body->get();
+            } catch (FileTransferError & e) {
+                if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                    return std::nullopt;
+                /* Prefetches are not retried, so try again the normal way. */
+            } catch (std::future_error &) {
+                /* The transfer thread went away without an answer. */
+            }
+        }
+
+        return BinaryCacheStore::getFileContents(path);
+    }
+
+    kj::Promise<Result<std::optional<std::string>>>
+    getFileContentsAsync(const std::string & path) override
+    try {
+        checkEnabled();
+
+        auto arrived = kj::newPromiseAndCrossThreadFulfiller<void>();
+        auto onDone = [fulfiller{std::make_shared<decltype(arrived.fulfiller)>(std::move(arrived.fulfiller))}] {
+            (*fulfiller)->fulfill();
+        };
+
+        auto body = prefetcher.take(path, onDone);
+        if (!body)
+            body = getFileTransfer()->enqueueDownload(makeURI(path), onDone);
+        co_await arrived.promise;
+
+        try {
+            co_return std::optional(body->get());
+        } catch (FileTransferError & e) {
+            if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                co_return std::nullopt;
+        } catch (std::future_error &) {
+        }
+
+        /* Background downloads are not retried, so try again the normal
+           way. */
+        co_return BinaryCacheStore::getFileContents(path);
+    } catch (...) {
+        co_return result::current_exception();
+    }
+
+    std::optional<std::string>
+    getFileRange(const std::string & path, uint64_t offset, uint64_t length) override
+    {
+        checkEnabled();
+        if (length == 0)
+            return "";
+        try {
+            auto body = getFileTransfer()
+                            ->download(
+                                makeURI(path),
+                                {{"Range", fmt("bytes=%d-%d", offset, offset + length - 1)}}
+                            )
+                            .second->drain();
+            /* Servers are free to ignore the range and send everything. */
+            if (body.size() > length)
+                body = body.substr(std::min<uint64_t>(offset, body.size()), length);
+            return body;
+        } catch (FileTransferError & e) {
+            if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                return std::nullopt;
+            maybeDisable();
+            throw;
+        }
+    }
+
+    kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>>
+    queryPathInfoUncached(const StorePath & path) override
+    try {
+        auto info = TRY_AWAIT(BinaryCacheStore::queryPathInfoUncached(path));
+        if (info) {
+            try {
+                prefetchNarInfos(info->references);
+            } catch (Error & e) {
+                debug("not prefetching references of '%s': %s", printStorePath(path), e.msg());
+            }
+        }
+        co_return info;
+    } catch (...) {
+        co_return result::current_exception();
+    }
+
+    void prefetchNarInfos(const StorePathSet & paths)
+    {
+        if (config_.narinfoPrefetch == 0 || !_state.lock()->enabled)
+            return;
+
+        for (auto & path : paths) {
+            if (diskCache->lookupNarInfo(cacheUri, std::string(path.hashPart())).first
+                != NarInfoDiskCache::oUnknown)
+            {
+                continue;
+            }
+
+            auto file = narInfoFileFor(path);
+            if (!prefetcher.prefetch(file, makeURI(file)))
+                return;
+        }
+    }
+
+    /**
+     * Called on the prefetcher's thread.
+     */
+    void prefetchReferences(const std::string & file, const std::string & body)
+    {
+        NarInfo info(*this, body, file);
+        prefetchNarInfos(info.references);
+    }
+
     box_ptr<Source> getFile(const std::string & path) override
     {
         checkEnabled();
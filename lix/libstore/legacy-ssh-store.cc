@@ -121,7 +121,9 @@ struct LegacySSHStore final : public Store
             // Use SSH master only if using more than 1 connection.
             connections->capacity() > 1,
             config_.compress,
-            config_.logFD)
+            config_.logFD,
+            config_.controlPath,
+            config_.controlPersist)
     {
     }
 
@@ -192,60 +194,147 @@ struct LegacySSHStore final : public Store
         co_return result::current_exception();
     }
 
-    kj::Promise<Result<void>> addToStore(const ValidPathInfo & info, AsyncInputStream & source,
-        RepairFlag repair, CheckSigsFlag checkSigs) override
+    /**
+     * Send a path to the remote host without waiting for it to be added.
+     * The caller must read the reply with `checkAdded()`.
+     */
+    kj::Promise<Result<void>>
+    sendPath(Connection & conn, const ValidPathInfo & info, AsyncInputStream & source)
     try {
-        debug("adding path '%s' to remote host '%s'", printStorePath(info.path), host);
-
-        auto conn(TRY_AWAIT(connections->get()));
-
-        if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 5) {
+        if (GET_PROTOCOL_MINOR(conn.remoteVersion) >= 5) {
 
-            conn->to
+            conn.to
                 << ServeProto::Command::AddToStoreNar
                 << printStorePath(info.path)
                 << (info.deriver ? printStorePath(*info.deriver) : "")
                 << info.narHash.to_string(Base::Base16, false);
-            conn->to << ServeProto::write(*this, *conn, info.references);
-            conn->to
+            conn.to << ServeProto::write(*this, conn, info.references);
+            conn.to
                 << info.registrationTime
                 << info.narSize
                 << info.ultimate
                 << info.sigs
                 << renderContentAddress(info.ca);
             try {
-                TRY_AWAIT(copyNAR(source)->drainInto(conn->to));
+                TRY_AWAIT(copyNAR(source)->drainInto(conn.to));
             } catch (...) {
-                conn->good = false;
+                conn.good = false;
                 throw;
             }
-            conn->to.flush();
 
         } else {
 
-            conn->to
+            conn.to
                 << ServeProto::Command::ImportPaths
                 << 1;
             try {
-                TRY_AWAIT(copyNAR(source)->drainInto(conn->to));
+                TRY_AWAIT(copyNAR(source)->drainInto(conn.to));
             } catch (...) {
-                conn->good = false;
+                conn.good = false;
                 throw;
             }
-            conn->to
+            conn.to
                 << exportMagic
                 << printStorePath(info.path);
-            conn->to << ServeProto::write(*this, *conn, info.references);
-            conn->to
+            conn.to << ServeProto::write(*this, conn, info.references);
+            conn.to
                 << (info.deriver ? printStorePath(*info.deriver) : "")
                 << 0
                 << 0;
+
+        }
+        co_return result::success();
+    } catch (...) {
+        co_return result::current_exception();
+    }
+
+    void checkAdded(Connection & conn, const StorePath & path)
+    {
+        if (readInt(conn.from) != 1)
+            throw Error("failed to add path '%s' to remote host '%s'", printStorePath(path), host);
+    }
+
+    kj::Promise<Result<void>> addToStore(const ValidPathInfo & info, AsyncInputStream & source,
+        RepairFlag repair, CheckSigsFlag checkSigs) override
+    try {
+        debug("adding path '%s' to remote host '%s'", printStorePath(info.path), host);
+
+        auto conn(TRY_AWAIT(connections->get()));
+
+        TRY_AWAIT(sendPath(*conn, info, source));
+        conn->to.flush();
+        checkAdded(*conn, info.path);
+        co_return result::success();
+    } catch (...) {
+        co_return result::current_exception();
+    }
+
+    /**
+     * Paths with a NAR of at most this size are sent without waiting for
+     * the remote host to acknowledge the previous ones.
+     */
+    static constexpr uint64_t maxPipelinedNarSize = 1024 * 1024;
+
+    /**
+     * The maximum number of unacknowledged paths.
+     */
+    static constexpr size_t maxPipelinedPaths = 256;
+
+    /**
+     * Unlike the default implementation, which checks and adds one path at
+     * a time, this streams all paths over one connection and only waits
+     * for the remote host after large paths. The caller is expected to
+     * have filtered out valid paths already, as `copyPaths()` does.
+     */
+    kj::Promise<Result<void>> addMultipleToStore(
+        PathsSource & pathsToCopy,
+        Activity & act,
+        RepairFlag repair,
+        CheckSigsFlag checkSigs) override
+    try {
+        if (GET_PROTOCOL_MINOR(TRY_AWAIT(getProtocol())) < 5) {
+            TRY_AWAIT(Store::addMultipleToStore(pathsToCopy, act, repair, checkSigs));
+            co_return result::success();
+        }
+
+        auto conn(TRY_AWAIT(connections->get()));
+
+        uint64_t bytesExpected = 0;
+        for (auto & [info, _] : pathsToCopy)
+            bytesExpected += info.narSize;
+        act.setExpected(actCopyPath, bytesExpected);
+
+        size_t nrDone = 0;
+        std::vector<StorePath> unacknowledged;
+
+        auto acknowledge = [&]() {
             conn->to.flush();
+            for (auto & path : unacknowledged) {
+                checkAdded(*conn, path);
+                act.progress(++nrDone, pathsToCopy.size());
+            }
+            unacknowledged.clear();
+        };
+
+        for (auto & [info_, source_] : pathsToCopy) {
+            checkInterrupt();
+
+            auto info = info_;
+            info.ultimate = false;
+
+            /* Destroy the source as soon as the path has been sent, see
+               `Store::addMultipleToStore()`. */
+            auto source = std::move(source_);
+
+            debug("adding path '%s' to remote host '%s'", printStorePath(info.path), host);
+            TRY_AWAIT(sendPath(*conn, info, *TRY_AWAIT(source())));
+            unacknowledged.push_back(info.path);
 
+            if (info.narSize > maxPipelinedNarSize || unacknowledged.size() >= maxPipelinedPaths)
+                acknowledge();
         }
 
-        if (readInt(conn->from) != 1)
-            throw Error("failed to add path '%s' to remote host '%s'", printStorePath(info.path), host);
+        acknowledge();
         co_return result::success();
     } catch (...) {
         co_return result::current_exception();
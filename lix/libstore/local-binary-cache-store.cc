@@ -5,6 +5,8 @@
 #include "lix/libutil/result.hh"
 
 #include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace nix {
 
@@ -58,20 +60,69 @@ protected:
 
     bool fileExists(const std::string & path) override;
 
+    /**
+     * @return A fresh temporary file name next to `path`, so that it can be
+     * renamed to `path` atomically.
+     */
+    Path tempFileFor(const std::string & path)
+    {
+        static std::atomic<int> counter{0};
+        return fmt("%s/%s.tmp.%d.%d", binaryCacheDir, path, getpid(), ++counter);
+    }
+
     void upsertFile(const std::string & path,
         std::shared_ptr<std::basic_iostream<char>> istream,
         const std::string & mimeType) override
     {
-        auto path2 = binaryCacheDir + "/" + path;
-        static std::atomic<int> counter{0};
-        Path tmp = fmt("%s.tmp.%d.%d", path2, getpid(), ++counter);
+        Path tmp = tempFileFor(path);
         AutoDelete del(tmp, false);
         StreamToSourceAdapter source(istream);
         writeFile(tmp, source);
-        renameFile(tmp, path2);
+        renameFile(tmp, binaryCacheDir + "/" + path);
         del.cancel();
     }
 
+    std::unique_ptr<Upload> beginUpload(const std::string & tempPath, const std::string & mimeType) override
+    {
+        /* Write the file into the cache directly and rename it into place
+           when it is complete. */
+        struct LocalUpload : Upload
+        {
+            Path binaryCacheDir;
+            Path tmp;
+            AutoCloseFD fd;
+            AutoDelete del;
+            FdSink sink;
+
+            LocalUpload(const Path & binaryCacheDir, Path tmp)
+                : binaryCacheDir(binaryCacheDir)
+                , tmp(std::move(tmp))
+                , fd(open(this->tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666))
+                , del(this->tmp, false)
+                , sink(fd.get())
+            {
+                if (!fd)
+                    throw SysError("creating file '%s'", this->tmp);
+            }
+
+            void operator()(std::string_view data) override
+            {
+                sink(data);
+            }
+
+            std::string commit(const std::string & path) override
+            {
+                sink.flush();
+                fd.close();
+                renameFile(tmp, binaryCacheDir + "/" + path);
+                del.cancel();
+                return path;
+            }
+        };
+
+        return std::make_unique<LocalUpload>(binaryCacheDir, tempFileFor(tempPath));
+    }
+
     box_ptr<Source> getFile(const std::string & path) override
     {
         try {
@@ -83,6 +134,34 @@ protected:
         }
     }
 
+    std::optional<std::string>
+    getFileRange(const std::string & path, uint64_t offset, uint64_t length) override
+    {
+        auto path2 = binaryCacheDir + "/" + path;
+        AutoCloseFD fd{open(path2.c_str(), O_RDONLY | O_CLOEXEC)};
+        if (!fd) {
+            if (errno == ENOENT)
+                return std::nullopt;
+            throw SysError("opening '%s'", path2);
+        }
+
+        std::string data(length, 0);
+        size_t got = 0;
+        while (got < length) {
+            auto n = pread(fd.get(), data.data() + got, length - got, offset + got);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw SysError("reading '%s'", path2);
+            }
+            if (n == 0)
+                break;
+            got += n;
+        }
+        data.resize(got);
+        return data;
+    }
+
     kj::Promise<Result<StorePathSet>> queryAllValidPaths() override
     try {
         StorePathSet paths;
@@ -6,6 +6,7 @@
 #include "lix/libstore/worker-protocol.hh"
 #include "lix/libstore/derivations.hh"
 #include "lix/libstore/nar-info.hh"
+#include "lix/libstore/valid-path-graph.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/references.hh"
@@ -16,9 +17,11 @@
 #include "lix/libutil/finally.hh"
 #include "lix/libutil/compression.hh"
 #include "lix/libutil/strings.hh"
+#include "lix/libutil/thread-pool.hh"
 #include "lix/libutil/types.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
 
 #include <limits>
@@ -26,6 +29,7 @@
 #include <mutex>
 #include <new>
 #include <optional>
+#include <unordered_map>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
@@ -63,6 +67,7 @@ struct LocalStore::DBState::Stmts {
     SQLiteStmt RegisterValidPath;
     SQLiteStmt UpdatePathInfo;
     SQLiteStmt AddReference;
+    SQLiteStmt AddReferences;
     SQLiteStmt QueryPathInfo;
     SQLiteStmt QueryReferences;
     SQLiteStmt QueryReferrers;
@@ -80,6 +85,13 @@ struct LocalStore::DBState::Stmts {
     SQLiteStmt AddRealisationReference;
 };
 
+/**
+ * Number of rows inserted by a single `AddReferences` statement. Two
+ * parameters per row keeps us well below SQLITE_MAX_VARIABLE_NUMBER,
+ * even on SQLite builds that still use the historical limit of 999.
+ */
+static constexpr size_t addReferencesBatchSize = 128;
+
 int getSchema(Path schemaPath)
 {
     int curSchema = 0;
@@ -293,6 +305,13 @@ LocalStore::LocalStore(LocalStoreConfig config)
     }
 
     initDB(*state);
+
+    if (settings.pathGraphCache)
+        pathGraph = ValidPathGraph::open(
+            config_.storeDir,
+            dbDir + "/db.sqlite",
+            config_.readOnly ? SQLiteOpenMode::Immutable : SQLiteOpenMode::NoCreate
+        );
 }
 
 void LocalStore::initDB(DBState & state)
@@ -395,6 +414,13 @@ void LocalStore::prepareStatements(DBState & state)
         "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
     state.stmts->AddReference = state.db.create(
         "insert or replace into Refs (referrer, reference) values (?, ?);");
+    {
+        std::string rows = "(?, ?)";
+        for (size_t n = 1; n < addReferencesBatchSize; n++)
+            rows += ", (?, ?)";
+        state.stmts->AddReferences = state.db.create(
+            "insert or replace into Refs (referrer, reference) values " + rows + ";");
+    }
     state.stmts->QueryPathInfo = state.db.create(
         "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
     state.stmts->QueryReferences = state.db.create(
@@ -602,7 +628,8 @@ void LocalStore::makeStoreWritable()
 const time_t mtimeStore = 1; /* 1 second into the epoch */
 
 
-static void canonicaliseTimestampAndPermissions(const Path & path, const struct stat & st)
+static void canonicaliseTimestampAndPermissions(
+    int dirFd, const char * name, const Path & path, const struct stat & st)
 {
     if (!S_ISLNK(st.st_mode)) {
 
@@ -613,40 +640,81 @@ static void canonicaliseTimestampAndPermissions(const Path & path, const struct
             mode = (st.st_mode & S_IFMT)
                  | 0444
                  | (st.st_mode & S_IXUSR ? 0111 : 0);
-            if (chmod(path.c_str(), mode) == -1)
+            if (fchmodat(dirFd, name, mode, 0) == -1)
                 throw SysError("changing mode of '%1%' to %2$o", path, mode);
         }
 
     }
 
     if (st.st_mtime != mtimeStore) {
-        struct timeval times[2];
+        struct timespec times[2];
         times[0].tv_sec = st.st_atime;
-        times[0].tv_usec = 0;
+        times[0].tv_nsec = 0;
         times[1].tv_sec = mtimeStore;
-        times[1].tv_usec = 0;
-#if HAVE_LUTIMES
-        if (lutimes(path.c_str(), times) == -1)
-            if (errno != ENOSYS ||
-                (!S_ISLNK(st.st_mode) && utimes(path.c_str(), times) == -1))
-#else
-        if (!S_ISLNK(st.st_mode) && utimes(path.c_str(), times) == -1)
-#endif
-            throw SysError("changing modification time of '%1%'", path);
+        times[1].tv_nsec = 0;
+        if (utimensat(dirFd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+            /* Some file systems can't set the times of symlinks. */
+            if (!S_ISLNK(st.st_mode) || (errno != ENOSYS && errno != EOPNOTSUPP))
+                throw SysError("changing modification time of '%1%'", path);
     }
 }
 
 
 void canonicaliseTimestampAndPermissions(const Path & path)
 {
-    canonicaliseTimestampAndPermissions(path, lstat(path));
+    canonicaliseTimestampAndPermissions(AT_FDCWD, path.c_str(), path, lstat(path));
 }
 
 
-static void canonicalisePathMetaData_(
-    const Path & path,
-    std::optional<std::pair<uid_t, uid_t>> uidRange,
-    InodesSeen & inodesSeen)
+namespace {
+
+/**
+ * Canonicalises the files below one path. Each directory is a separate
+ * work item on a thread pool that gets a file descriptor of the directory,
+ * opened relative to the descriptor of its parent. Files are processed
+ * relative to the descriptor of their directory, except for changing their
+ * extended attributes, which can only be done by path.
+ */
+struct MetaDataCanonicaliser
+{
+    std::optional<std::pair<uid_t, uid_t>> uidRange;
+    InodesSeen & inodesSeen;
+
+    /**
+     * Guards `inodesSeen` and `claimed`.
+     */
+    std::mutex inodesLock;
+
+    /**
+     * The inodes processed by this traversal. Hard links to the same
+     * file may be found by different threads at the same time, but only
+     * the first of them processes the file.
+     */
+    InodesSeen claimed;
+
+    ThreadPool pool{"canonicalisePathMetaData"};
+
+    /**
+     * Every queued directory holds a file descriptor, so directories are
+     * processed by the thread that found them once this many are queued.
+     */
+    static constexpr size_t maxQueuedDirs = 256;
+    std::atomic<size_t> queuedDirs = 0;
+
+    MetaDataCanonicaliser(std::optional<std::pair<uid_t, uid_t>> uidRange, InodesSeen & inodesSeen)
+        : uidRange(uidRange)
+        , inodesSeen(inodesSeen)
+    {
+    }
+
+    void canonicaliseEntry(int dirFd, const char * name, const Path & path);
+    void canonicaliseDirectory(AutoCloseFD fd, const Path & path);
+};
+
+}
+
+
+void MetaDataCanonicaliser::canonicaliseEntry(int dirFd, const char * name, const Path & path)
 {
     checkInterrupt();
 
@@ -660,28 +728,47 @@ static void canonicalisePathMetaData_(
     }
 #endif
 
-    auto st = lstat(path);
+    struct stat st;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        throw SysError("getting status of '%1%'", path);
 
     /* Really make sure that the path is of a supported type. */
     if (!(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)))
         throw Error("file '%1%' has an unsupported type", path);
 
+    Inode inode(st.st_dev, st.st_ino);
+
     /* Fail if the file is not owned by the build user.  This prevents
        us from messing up the ownership/permissions of files
        hard-linked into the output (e.g. "ln /etc/shadow $out/foo").
        However, ignore files that we chown'ed ourselves previously to
        ensure that we don't fail on hard links within the same build
-       (i.e. "touch $out/foo; ln $out/foo $out/bar"). */
+       (i.e. "touch $out/foo; ln $out/foo $out/bar").  A file is added
+       to `inodesSeen` before it is chown'ed, so another thread that
+       sees the new owner also sees the inode. */
     if (uidRange && (st.st_uid < uidRange->first || st.st_uid > uidRange->second)) {
-        if (S_ISDIR(st.st_mode) || !inodesSeen.count(Inode(st.st_dev, st.st_ino)))
+        bool seen = [&] {
+            std::lock_guard lock(inodesLock);
+            return inodesSeen.count(inode) > 0;
+        }();
+        if (S_ISDIR(st.st_mode) || !seen)
             throw BuildError("invalid ownership on file '%1%'", path);
         mode_t mode = st.st_mode & ~S_IFMT;
         assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
         return;
     }
 
+    {
+        std::lock_guard lock(inodesLock);
+        /* Another link to this file is already being taken care of. */
+        if (!claimed.insert(inode).second)
+            return;
+        inodesSeen.insert(inode);
+    }
+
 #if __linux__
-    /* Remove extended attributes / ACLs. */
+    /* Remove extended attributes / ACLs. There are no *at() variants
+       of these calls, so they go by path. */
     ssize_t eaSize = llistxattr(path.c_str(), nullptr, 0);
 
     if (eaSize < 0) {
@@ -710,45 +797,64 @@ static void canonicalisePathMetaData_(
      }
 #endif
 
-    inodesSeen.insert(Inode(st.st_dev, st.st_ino));
-
-    canonicaliseTimestampAndPermissions(path, st);
+    canonicaliseTimestampAndPermissions(dirFd, name, path, st);
 
-    /* Change ownership to the current uid.  If it's a symlink, use
-       lchown if available, otherwise don't bother.  Wrong ownership
-       of a symlink doesn't matter, since the owning user can't change
+    /* Change ownership to the current uid.  Wrong ownership of a
+       symlink doesn't matter much, since the owning user can't change
        the symlink and can't delete it because the directory is not
        writable.  The only exception is top-level paths in the Nix
        store (since that directory is group-writable for the Nix build
        users group); we check for this case below. */
     if (st.st_uid != geteuid()) {
-#if HAVE_LCHOWN
-        if (lchown(path.c_str(), geteuid(), getegid()) == -1)
-#else
-        if (!S_ISLNK(st.st_mode) &&
-            chown(path.c_str(), geteuid(), getegid()) == -1)
-#endif
-            throw SysError("changing owner of '%1%' to %2%",
-                path, geteuid());
+        if (fchownat(dirFd, name, geteuid(), getegid(), AT_SYMLINK_NOFOLLOW) == -1)
+            if (!S_ISLNK(st.st_mode) || (errno != ENOSYS && errno != EOPNOTSUPP))
+                throw SysError("changing owner of '%1%' to %2%",
+                    path, geteuid());
     }
 
     if (S_ISDIR(st.st_mode)) {
-        DirEntries entries = readDirectory(path);
-        for (auto & i : entries)
-            canonicalisePathMetaData_(path + "/" + i.name, uidRange, inodesSeen);
+        AutoCloseFD fd{openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)};
+        if (!fd)
+            throw SysError("opening directory '%1%'", path);
+        if (queuedDirs.fetch_add(1) < maxQueuedDirs) {
+            pool.enqueue([this, path, fd{std::make_shared<AutoCloseFD>(std::move(fd))}] {
+                queuedDirs--;
+                canonicaliseDirectory(std::move(*fd), path);
+            });
+        } else {
+            queuedDirs--;
+            canonicaliseDirectory(std::move(fd), path);
+        }
     }
 }
 
 
+void MetaDataCanonicaliser::canonicaliseDirectory(AutoCloseFD fd, const Path & path)
+{
+    AutoCloseDir dir(fdopendir(fd.get()));
+    if (!dir)
+        throw SysError("opening directory '%1%'", path);
+    fd.release();
+
+    for (auto & i : readDirectory(dir.get(), path))
+        canonicaliseEntry(dirfd(dir.get()), i.name.c_str(), path + "/" + i.name);
+}
+
+
 void canonicalisePathMetaData(
     const Path & path,
     std::optional<std::pair<uid_t, uid_t>> uidRange,
     InodesSeen & inodesSeen)
 {
-    canonicalisePathMetaData_(path, uidRange, inodesSeen);
+    {
+        MetaDataCanonicaliser canonicaliser(uidRange, inodesSeen);
+        canonicaliser.canonicaliseEntry(AT_FDCWD, path.c_str(), path);
+        canonicaliser.pool.process();
+    }
 
-    /* On platforms that don't have lchown(), the top-level path can't
-       be a symlink, since we can't change its ownership. */
+    /* On platforms that can't change the owner of a symlink, the
+       top-level path can't be a symlink, since we can't change its
+       ownership. */
     auto st = lstat(path);
 
     if (st.st_uid != geteuid()) {
@@ -912,6 +1018,8 @@ try {
 kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>>
 LocalStore::queryPathInfoUncached(const StorePath & path)
 try {
+    if (pathGraph) co_return pathGraph->queryPathInfo(path);
+
     co_return TRY_AWAIT(
         // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
         retrySQLite([&]() -> kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>> {
@@ -1009,6 +1117,8 @@ bool LocalStore::isValidPath_(DBState & state, const StorePath & path)
 
 kj::Promise<Result<bool>> LocalStore::isValidPathUncached(const StorePath & path)
 try {
+    if (pathGraph) co_return pathGraph->isValidPath(path);
+
     // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
     co_return TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<bool>> {
         try {
@@ -1026,10 +1136,27 @@ try {
 kj::Promise<Result<StorePathSet>>
 LocalStore::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 try {
-    StorePathSet res;
-    for (auto & i : paths)
-        if (TRY_AWAIT(isValidPath(i))) res.insert(i);
-    co_return res;
+    if (pathGraph) {
+        StorePathSet res;
+        for (auto & i : paths)
+            if (pathGraph->isValidPath(i)) res.insert(i);
+        co_return res;
+    }
+
+    /* Answer the whole batch under a single database lock rather than
+       taking it once per path; copyPaths() asks about entire closures. */
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+    co_return TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<StorePathSet>> {
+        try {
+            auto state = co_await _dbState.lock();
+            StorePathSet res;
+            for (auto & i : paths)
+                if (isValidPath_(*state, i)) res.insert(i);
+            co_return res;
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    }));
 } catch (...) {
     co_return result::current_exception();
 }
@@ -1037,6 +1164,8 @@ try {
 
 kj::Promise<Result<StorePathSet>> LocalStore::queryAllValidPaths()
 try {
+    if (pathGraph) co_return pathGraph->queryAllValidPaths();
+
     // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
     co_return TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<StorePathSet>> {
         try {
@@ -1066,6 +1195,11 @@ void LocalStore::queryReferrers(DBState & state, const StorePath & path, StorePa
 kj::Promise<Result<void>>
 LocalStore::queryReferrers(const StorePath & path, StorePathSet & referrers)
 try {
+    if (pathGraph) {
+        pathGraph->queryReferrers(path, referrers);
+        co_return result::success();
+    }
+
     // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
     TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<void>> {
         try {
@@ -1174,7 +1308,7 @@ try {
         if (sub->config().storeDir != config_.storeDir) continue;
         if (!sub->config().wantMassQuery) continue;
 
-        auto valid = TRY_AWAIT(sub->queryValidPaths(remaining));
+        auto valid = TRY_AWAIT(sub->queryValidPathsForSubstitution(remaining));
 
         StorePathSet remaining2;
         for (auto & path : remaining)
@@ -1217,21 +1351,50 @@ try {
             SQLiteTxn txn = state->db.beginTransaction(SQLiteTxnType::Immediate);
             StorePathSet paths;
 
+            /* Database ids of the paths in this batch and of every
+               reference resolved so far. Each path is looked up at
+               most once, no matter how many paths refer to it. */
+            std::unordered_map<StorePath, uint64_t> ids;
+            ids.reserve(infos.size());
+
             for (auto & [_, i] : infos) {
                 assert(i.narHash.type == HashType::SHA256);
-                if (isValidPath_(*state, i.path))
+                std::optional<uint64_t> id;
+                {
+                    auto use(state->stmts->QueryPathInfo.use()(printStorePath(i.path)));
+                    if (use.next()) id = use.getInt(0);
+                }
+                if (id)
                     updatePathInfo(*state, i);
                 else
-                    TRY_AWAIT(addValidPath(*state, i, false));
+                    id = TRY_AWAIT(addValidPath(*state, i, false));
+                ids.emplace(i.path, *id);
                 paths.insert(i.path);
             }
 
+            std::vector<std::pair<uint64_t, uint64_t>> refs;
             for (auto & [_, i] : infos) {
-                auto referrer = queryValidPathId(*state, i.path);
-                for (auto & j : i.references)
-                    state->stmts->AddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
+                auto referrer = ids.at(i.path);
+                for (auto & j : i.references) {
+                    auto reference = ids.find(j);
+                    if (reference == ids.end())
+                        reference = ids.emplace(j, queryValidPathId(*state, j)).first;
+                    refs.emplace_back(referrer, reference->second);
+                }
             }
 
+            /* Insert the references with multi-row statements, leaving
+               only the tail of the batch to the single-row statement. */
+            size_t n = 0;
+            for (; n + addReferencesBatchSize <= refs.size(); n += addReferencesBatchSize) {
+                auto use(state->stmts->AddReferences.use());
+                for (size_t k = n; k < n + addReferencesBatchSize; k++)
+                    use(refs[k].first)(refs[k].second);
+                use.exec();
+            }
+            for (; n < refs.size(); n++)
+                state->stmts->AddReference.use()(refs[n].first)(refs[n].second).exec();
+
             /* Check that the derivation outputs are correct.  We can't do
                this in addValidPath() above, because the references might
                not be valid yet. */
@@ -1260,6 +1423,16 @@ try {
                 }});
 
             txn.commit();
+
+            /* Paths registered for the first time are picked up by the
+               graph on its next read; it cannot see updates of existing
+               rows. */
+            if (pathGraph) {
+                pathGraph->invalidate();
+                for (auto & [_, i] : infos)
+                    pathGraph->update(i);
+            }
+
             co_return result::success();
         } catch (...) {
             co_return result::current_exception();
@@ -1659,6 +1832,7 @@ try {
             }
 
             txn.commit();
+            if (pathGraph) pathGraph->invalidate();
             co_return result::success();
         } catch (...) {
             co_return result::current_exception();
@@ -1670,6 +1844,12 @@ try {
 }
 
 
+/**
+ * Number of links or store paths whose contents `verifyStore()` hashes in
+ * parallel before reporting on them.
+ */
+static constexpr size_t verifyBatchSize = 256;
+
 kj::Promise<Result<bool>> LocalStore::verifyStore(bool checkContents, RepairFlag repair)
 try {
     printInfo("reading the Nix store...");
@@ -1716,20 +1896,33 @@ try {
 
         printInfo("checking link hashes...");
 
-        for (auto & link : readDirectory(linksDir)) {
-            printMsg(lvlTalkative, "checking contents of '%s'", link.name);
-            Path linkPath = linksDir + "/" + link.name;
-            std::string hash = hashPath(HashType::SHA256, linkPath).first.to_string(Base::Base32, false);
-            if (hash != link.name) {
-                printError("link '%s' was modified! expected hash '%s', got '%s'",
-                    linkPath, link.name, hash);
-                if (repair) {
-                    if (unlink(linkPath.c_str()) == 0)
-                        printInfo("removed link '%s'", linkPath);
-                    else
-                        throw SysError("removing corrupt link '%s'", linkPath);
-                } else {
-                    errors = true;
+        auto links = readDirectory(linksDir);
+
+        for (size_t start = 0; start < links.size(); start += verifyBatchSize) {
+            auto end = std::min(links.size(), start + verifyBatchSize);
+
+            std::vector<Path> linkPaths;
+            for (size_t n = start; n < end; n++) {
+                linkPaths.push_back(linksDir + "/" + links[n].name);
+            }
+            auto linkHashes = hashPaths(HashType::SHA256, linkPaths);
+
+            for (size_t n = start; n < end; n++) {
+                auto & link = links[n];
+                printMsg(lvlTalkative, "checking contents of '%s'", link.name);
+                auto & linkPath = linkPaths[n - start];
+                std::string hash = linkHashes[n - start].value().first.to_string(Base::Base32, false);
+                if (hash != link.name) {
+                    printError("link '%s' was modified! expected hash '%s', got '%s'",
+                        linkPath, link.name, hash);
+                    if (repair) {
+                        if (unlink(linkPath.c_str()) == 0)
+                            printInfo("removed link '%s'", linkPath);
+                        else
+                            throw SysError("removing corrupt link '%s'", linkPath);
+                    } else {
+                        errors = true;
+                    }
                 }
             }
         }
@@ -1738,61 +1931,87 @@ try {
 
         Hash nullHash(HashType::SHA256);
 
-        for (auto & i : validPaths) {
-            std::optional<Error> caught;
-            try {
-                auto info = std::const_pointer_cast<ValidPathInfo>(
-                    std::shared_ptr<const ValidPathInfo>(TRY_AWAIT(queryPathInfo(i)))
-                );
+        std::vector<StorePath> paths(validPaths.begin(), validPaths.end());
 
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
+        for (size_t start = 0; start < paths.size(); start += verifyBatchSize) {
+            auto end = std::min(paths.size(), start + verifyBatchSize);
 
-                auto hashSink = HashSink(info->narHash.type);
+            /* Look up the hash types first, then hash the whole batch
+               in parallel. */
+            std::vector<std::shared_ptr<ValidPathInfo>> infos(end - start);
+            std::vector<std::optional<Error>> caught(end - start);
+            std::vector<std::pair<HashType, Path>> toHash;
+            std::vector<size_t> hashIndex(end - start);
 
-                hashSink << dumpPath(Store::toRealPath(i));
-                auto current = hashSink.finish();
+            for (size_t n = start; n < end; n++) {
+                try {
+                    infos[n - start] = std::const_pointer_cast<ValidPathInfo>(
+                        std::shared_ptr<const ValidPathInfo>(TRY_AWAIT(queryPathInfo(paths[n])))
+                    );
+                    hashIndex[n - start] = toHash.size();
+                    toHash.emplace_back(infos[n - start]->narHash.type, Store::toRealPath(paths[n]));
+                } catch (Error & e) {
+                    caught[n - start] = std::move(e);
+                }
+            }
 
-                if (info->narHash != nullHash && info->narHash != current.first) {
-                    printError("path '%s' was modified! expected hash '%s', got '%s'",
-                        printStorePath(i), info->narHash.to_string(Base::SRI, true), current.first.to_string(Base::SRI, true));
-                    if (repair) TRY_AWAIT(repairPath(i)); else errors = true;
-                } else {
+            auto hashes = hashPaths(toHash);
 
-                    bool update = false;
+            for (size_t n = start; n < end; n++) {
+                auto & i = paths[n];
+                auto & info = infos[n - start];
+                auto & caughtHere = caught[n - start];
 
-                    /* Fill in missing hashes. */
-                    if (info->narHash == nullHash) {
-                        printInfo("fixing missing hash on '%s'", printStorePath(i));
-                        info->narHash = current.first;
-                        update = true;
-                    }
+                if (!caughtHere) {
+                    try {
+                        /* Check the content hash (optionally - slow). */
+                        printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
 
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info->narSize == 0) {
-                        printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
-                        info->narSize = current.second;
-                        update = true;
-                    }
+                        auto current = hashes[hashIndex[n - start]].value();
 
-                    if (update) {
-                        auto state(co_await _dbState.lock());
-                        updatePathInfo(*state, *info);
-                    }
+                        if (info->narHash != nullHash && info->narHash != current.first) {
+                            printError("path '%s' was modified! expected hash '%s', got '%s'",
+                                printStorePath(i), info->narHash.to_string(Base::SRI, true), current.first.to_string(Base::SRI, true));
+                            if (repair) TRY_AWAIT(repairPath(i)); else errors = true;
+                        } else {
 
-                }
+                            bool update = false;
 
-            } catch (Error & e) {
-                caught = std::move(e);
-            }
-            if (caught) {
-                /* It's possible that the path got GC'ed, so ignore
-                   errors on invalid paths. */
-                if (TRY_AWAIT(isValidPath(i)))
-                    logError(caught->info());
-                else
-                    warn(caught->msg());
-                errors = true;
+                            /* Fill in missing hashes. */
+                            if (info->narHash == nullHash) {
+                                printInfo("fixing missing hash on '%s'", printStorePath(i));
+                                info->narHash = current.first;
+                                update = true;
+                            }
+
+                            /* Fill in missing narSize fields (from old stores). */
+                            if (info->narSize == 0) {
+                                printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
+                                info->narSize = current.second;
+                                update = true;
+                            }
+
+                            if (update) {
+                                auto state(co_await _dbState.lock());
+                                updatePathInfo(*state, *info);
+                                if (pathGraph) pathGraph->update(*info);
+                            }
+
+                        }
+
+                    } catch (Error & e) {
+                        caughtHere = std::move(e);
+                    }
+                }
+                if (caughtHere) {
+                    /* It's possible that the path got GC'ed, so ignore
+                       errors on invalid paths. */
+                    if (TRY_AWAIT(isValidPath(i)))
+                        logError(caughtHere->info());
+                    else
+                        warn(caughtHere->msg());
+                    errors = true;
+                }
             }
         }
     }
@@ -1834,6 +2053,7 @@ try {
             printInfo("path '%s' disappeared, removing from database...", pathS);
             auto state(co_await _dbState.lock());
             TRY_AWAIT(invalidatePath(*state, path));
+            if (pathGraph) pathGraph->invalidate();
         } else {
             printError("path '%s' disappeared, but it still has valid referrers!", pathS);
             if (repair)
@@ -1884,6 +2104,9 @@ try {
             updatePathInfo(*state, *info);
 
             txn.commit();
+
+            if (pathGraph) pathGraph->update(*info);
+
             co_return result::success();
         } catch (...) {
             co_return result::current_exception();
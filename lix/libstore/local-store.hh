@@ -20,6 +20,8 @@
 
 namespace nix {
 
+class ValidPathGraph;
+
 
 /**
  * Nix store and database schema version.
@@ -108,6 +110,12 @@ private:
 
     Sync<DBState, AsyncMutex> _dbState;
 
+    /**
+     * In-memory mirror of the path graph, if `path-graph-cache` is set.
+     * Serves read-only queries without taking `_dbState`.
+     */
+    std::shared_ptr<ValidPathGraph> pathGraph;
+
     struct GCState
     {
         /**
@@ -302,6 +310,15 @@ public:
 
     kj::Promise<Result<void>> registerValidPaths(const ValidPathInfos & infos);
 
+    /**
+     * @return The in-memory path graph, if `path-graph-cache` is set. It
+     * outlives the store if the caller keeps it.
+     */
+    std::shared_ptr<ValidPathGraph> getPathGraph()
+    {
+        return pathGraph;
+    }
+
     kj::Promise<Result<unsigned int>> getProtocol() override;
 
     kj::Promise<Result<std::optional<TrustedFlag>>> isTrustedClient() override;
@@ -391,6 +408,30 @@ private:
     Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
     void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash, RepairFlag repair);
 
+    /**
+     * A file found by `collectOptimisable()` that may be replaced by a
+     * hard link into the links directory.
+     */
+    struct OptimisableFile
+    {
+        Path path;
+        struct stat st;
+    };
+
+    /**
+     * Find all files below `path` that `linkOptimisable()` should be
+     * called on, skipping those that are known to be linked already.
+     */
+    void collectOptimisable(const Path & path, const InodeHash & inodeHash, std::vector<OptimisableFile> & files);
+
+    /**
+     * Replace `file`, whose NAR serialisation hashes to `hash`, with a
+     * hard link to the file in the links directory with that hash, or
+     * add it to the links directory if there is none.
+     */
+    void linkOptimisable(Activity * act, OptimiseStats & stats, const OptimisableFile & file,
+        const Hash & hash, InodeHash & inodeHash, RepairFlag repair);
+
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(DBState & state, const StorePath & path);
     void queryReferrers(DBState & state, const StorePath & path, StorePathSet & referrers);
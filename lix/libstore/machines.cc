@@ -2,6 +2,7 @@
 #include "lix/libstore/globals.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libutil/async.hh"
+#include "lix/libutil/hash.hh"
 #include "lix/libutil/strings.hh"
 
 #include <algorithm>
@@ -65,6 +66,19 @@ bool Machine::mandatoryMet(const std::set<std::string> & features) const
         });
 }
 
+std::string Machine::controlPath() const
+{
+    /* The socket name is hashed to stay within the length limit of Unix
+       domain socket paths. Everything that selects or authenticates the
+       remote end goes into the hash, so that differently configured
+       machines never share a master connection. */
+    auto id = hashString(
+        HashType::SHA256,
+        concatStringsSep(std::string_view("\0", 1), Strings{storeUri, sshKey, sshPublicHostKey})
+    ).to_string(Base::Base32, false);
+    return settings.nixStateDir + "/builders/" + id.substr(0, 16) + ".sock";
+}
+
 kj::Promise<Result<ref<Store>>> Machine::openStore() const
 try {
     StoreConfig::Params storeParams;
@@ -78,6 +92,20 @@ try {
             storeParams["ssh-key"] = sshKey;
         if (sshPublicHostKey != "")
             storeParams["base64-ssh-public-host-key"] = sshPublicHostKey;
+
+        /* Share one master connection per machine between all builds
+           instead of setting up a new connection for every build. */
+        if (settings.buildersControlPersist > 0) {
+            auto path = controlPath();
+            try {
+                createDirs(dirOf(path));
+                storeParams["control-path"] = path;
+                storeParams["control-persist"] =
+                    std::to_string(settings.buildersControlPersist.get());
+            } catch (SysError & e) {
+                debug("not sharing connections to '%s': %s", storeUri, e.msg());
+            }
+        }
     }
 
     {
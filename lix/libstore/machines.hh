@@ -49,6 +49,12 @@ struct Machine {
         decltype(mandatoryFeatures) mandatoryFeatures,
         decltype(sshPublicHostKey) sshPublicHostKey);
 
+    /**
+     * @return The path of the socket of the SSH master connection that
+     * builds on this machine share (see `builders-control-persist`).
+     */
+    std::string controlPath() const;
+
     kj::Promise<Result<ref<Store>>> openStore() const;
 };
 
@@ -37,6 +37,7 @@ create table if not exists NARs (
     deriver          text,
     sigs             text,
     ca               text,
+    deltas           text,
     timestamp        integer not null,
     present          integer not null,
     primary key (cache, hashPart),
@@ -88,7 +89,7 @@ public:
 
     Sync<State> _state;
 
-    NarInfoDiskCacheImpl(Path dbPath = getCacheDir() + "/nix/binary-cache-v6.sqlite")
+    NarInfoDiskCacheImpl(Path dbPath = getCacheDir() + "/nix/binary-cache-v7.sqlite")
     {
         auto state(_state.lock());
 
@@ -108,13 +109,13 @@ public:
 
         state->insertNAR = state->db.create(
             "insert or replace into NARs(cache, hashPart, namePart, url, compression, fileHash, fileSize, narHash, "
-            "narSize, refs, deriver, sigs, ca, timestamp, present) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 1)");
+            "narSize, refs, deriver, sigs, ca, deltas, timestamp, present) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 1)");
 
         state->insertMissingNAR = state->db.create(
             "insert or replace into NARs(cache, hashPart, timestamp, present) values (?, ?, ?, 0)");
 
         state->queryNAR = state->db.create(
-            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca, deltas from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
 
         state->insertRealisation = state->db.create(
             R"(
@@ -277,6 +278,9 @@ public:
             for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
                 narInfo->sigs.insert(sig);
             narInfo->ca = ContentAddress::parseOpt(queryNAR.getStr(11));
+            if (!queryNAR.isNull(12))
+                for (auto & delta : tokenizeString<Strings>(queryNAR.getStr(12), "\n"))
+                    narInfo->deltas.push_back(NarInfo::Delta::parse(delta));
 
             return {oValid, narInfo};
         }, always_progresses);
@@ -342,6 +346,8 @@ public:
                     (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
                     (concatStringsSep(" ", info->sigs))
                     (renderContentAddress(info->ca))
+                    (narInfo ? concatMapStringsSep("\n", narInfo->deltas, [](auto & delta) { return delta.to_string(); }) : "",
+                        narInfo && !narInfo->deltas.empty())
                     (time(0)).exec();
 
             } else {
@@ -46,6 +46,15 @@ NarInfo::NarInfo(const Store & store, const std::string_view & s, const std::str
             url = value;
         else if (name == "Compression")
             compression = value;
+        else if (name == "Chunks")
+            chunks = value;
+        else if (name == "Delta") {
+            try {
+                deltas.push_back(Delta::parse(value));
+            } catch (Error &) {
+                throw corrupt("invalid Delta");
+            }
+        }
         else if (name == "FileHash")
             fileHash = parseHashField(value);
         else if (name == "FileSize") {
@@ -97,6 +106,29 @@ NarInfo::NarInfo(const Store & store, const std::string_view & s, const std::str
     }
 }
 
+NarInfo::Delta NarInfo::Delta::parse(std::string_view s)
+{
+    auto fields = tokenizeString<std::vector<std::string>>(s, " ");
+    if (fields.size() != 4)
+        throw Error("delta '%s' does not have 4 fields", s);
+    auto fileSize = string2Int<uint64_t>(fields[3]);
+    if (!fileSize)
+        throw Error("delta '%s' has an invalid file size", s);
+    return Delta{
+        .base = StorePath(fields[0]),
+        .baseNarHash = Hash::parseAnyPrefixed(fields[1]),
+        .url = fields[2],
+        .fileSize = *fileSize,
+    };
+}
+
+std::string NarInfo::Delta::to_string() const
+{
+    return fmt(
+        "%s %s %s %d", base.to_string(), baseNarHash.to_string(Base::Base32, true), url, fileSize
+    );
+}
+
 std::string NarInfo::to_string(const Store & store) const
 {
     std::string res;
@@ -107,6 +139,10 @@ std::string NarInfo::to_string(const Store & store) const
     assert(fileHash && fileHash->type == HashType::SHA256);
     res += "FileHash: " + fileHash->to_string(Base::Base32, true) + "\n";
     res += "FileSize: " + std::to_string(fileSize) + "\n";
+    if (!chunks.empty())
+        res += "Chunks: " + chunks + "\n";
+    for (auto & delta : deltas)
+        res += "Delta: " + delta.to_string() + "\n";
     assert(narHash.type == HashType::SHA256);
     res += "NarHash: " + narHash.to_string(Base::Base32, true) + "\n";
     res += "NarSize: " + std::to_string(narSize) + "\n";
@@ -16,6 +16,46 @@ struct NarInfo : ValidPathInfo
     std::optional<Hash> fileHash;
     uint64_t fileSize = 0;
 
+    /**
+     * The manifest of the chunks of the NAR, if the binary cache stores it
+     * in chunks (see `write-chunked-nars`). If it does not store the NAR as
+     * a single file, `url` points to the manifest as well and
+     * `compression` is `chunked`.
+     */
+    std::string chunks;
+
+    /**
+     * A binary delta from which the NAR can be reconstructed given the NAR
+     * of another store path, e.g. an older version of the same package.
+     */
+    struct Delta
+    {
+        StorePath base;
+
+        /**
+         * The NAR hash of `base`. The delta only applies to a base with
+         * exactly these contents.
+         */
+        Hash baseNarHash;
+
+        /**
+         * The URL of the delta, a `zstd` patch made with the NAR of `base`
+         * (see `CompressionOptions::patchFrom`).
+         */
+        std::string url;
+
+        uint64_t fileSize;
+
+        /**
+         * Parse the value of a `Delta` field.
+         */
+        static Delta parse(std::string_view s);
+
+        std::string to_string() const;
+    };
+
+    std::vector<Delta> deltas;
+
     NarInfo() = delete;
     NarInfo(const Store & store, std::string && name, ContentAddressWithReferences && ca, Hash narHash)
         : ValidPathInfo(store, std::move(name), std::move(ca), narHash)
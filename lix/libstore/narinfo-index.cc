@@ -0,0 +1,138 @@
+#include "lix/libstore/narinfo-index.hh"
+#include "lix/libutil/error.hh"
+#include "lix/libutil/hash.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace nix {
+
+static constexpr std::string_view narinfoIndexMagic{"LIXNII\x00\x01", 8};
+
+/**
+ * Keeps the number of fanout bits small enough that the header of even
+ * the largest caches can be fetched at once.
+ */
+static constexpr unsigned int maxFanoutBits = 16;
+
+/**
+ * The number of entries per bucket that `write()` aims for.
+ */
+static constexpr uint64_t targetBucketSize = 256;
+
+static void writeLE64(std::string & out, uint64_t n)
+{
+    for (int i = 0; i < 8; i++)
+        out.push_back(static_cast<char>((n >> (8 * i)) & 0xff));
+}
+
+static uint64_t readLE64(std::string_view data, size_t offset)
+{
+    uint64_t n = 0;
+    for (int i = 0; i < 8; i++)
+        n |= static_cast<uint64_t>(static_cast<unsigned char>(data[offset + i])) << (8 * i);
+    return n;
+}
+
+NarInfoIndex::Entry NarInfoIndex::entryFor(const StorePath & path)
+{
+    auto hash = Hash::parseNonSRIUnprefixed(path.hashPart(), HashType::SHA1);
+    Entry entry;
+    std::copy_n(hash.hash, entry.size(), entry.begin());
+    return entry;
+}
+
+std::string NarInfoIndex::write(std::vector<Entry> entries)
+{
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+    NarInfoIndex index;
+    index.count = entries.size();
+    while (index.fanoutBits < maxFanoutBits && (index.count >> index.fanoutBits) > targetBucketSize)
+        index.fanoutBits++;
+    index.bucketEnds.resize(size_t(1) << index.fanoutBits, 0);
+    for (auto & entry : entries)
+        index.bucketEnds[index.bucketOf(entry)]++;
+    for (size_t i = 1; i < index.bucketEnds.size(); i++)
+        index.bucketEnds[i] += index.bucketEnds[i - 1];
+
+    std::string out;
+    out.reserve(index.headerSize() + entries.size() * sizeof(Entry));
+    out += narinfoIndexMagic;
+    writeLE64(out, index.fanoutBits);
+    writeLE64(out, index.count);
+    for (auto end : index.bucketEnds)
+        writeLE64(out, end);
+    for (auto & entry : entries)
+        out.append(reinterpret_cast<const char *>(entry.data()), entry.size());
+    return out;
+}
+
+size_t NarInfoIndex::headerSize(std::string_view data)
+{
+    if (data.size() < fixedHeaderSize || !data.starts_with(narinfoIndexMagic))
+        throw Error("narinfo index has an invalid header");
+    auto fanoutBits = readLE64(data, 8);
+    if (fanoutBits > maxFanoutBits)
+        throw Error("narinfo index has too many fanout bits (%d)", fanoutBits);
+    return fixedHeaderSize + 8 * (size_t(1) << fanoutBits);
+}
+
+NarInfoIndex NarInfoIndex::parseHeader(std::string_view data)
+{
+    auto size = headerSize(data);
+    if (data.size() < size)
+        throw Error("narinfo index header is truncated");
+
+    NarInfoIndex index;
+    index.fanoutBits = readLE64(data, 8);
+    index.count = readLE64(data, 16);
+    index.bucketEnds.reserve(size_t(1) << index.fanoutBits);
+    for (size_t offset = fixedHeaderSize; offset < size; offset += 8) {
+        auto end = readLE64(data, offset);
+        if (end < (index.bucketEnds.empty() ? 0 : index.bucketEnds.back()) || end > index.count)
+            throw Error("narinfo index has an invalid fanout table");
+        index.bucketEnds.push_back(end);
+    }
+    if (index.bucketEnds.back() != index.count)
+        throw Error("narinfo index has an invalid fanout table");
+    return index;
+}
+
+std::vector<NarInfoIndex::Entry> NarInfoIndex::parseEntries(std::string_view data)
+{
+    auto index = parseHeader(data);
+    data.remove_prefix(index.headerSize());
+    if (data.size() != index.count * sizeof(Entry))
+        throw Error("narinfo index has %d bytes of entries, expected %d", data.size(), index.count * sizeof(Entry));
+
+    std::vector<Entry> entries(index.count);
+    for (size_t i = 0; i < entries.size(); i++)
+        std::memcpy(entries[i].data(), data.data() + i * sizeof(Entry), sizeof(Entry));
+    return entries;
+}
+
+bool NarInfoIndex::contains(std::string_view entries, const Entry & entry)
+{
+    size_t lo = 0, hi = entries.size() / sizeof(Entry);
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        auto cmp = std::memcmp(entries.data() + mid * sizeof(Entry), entry.data(), sizeof(Entry));
+        if (cmp == 0)
+            return true;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
+
+size_t NarInfoIndex::bucketOf(const Entry & entry) const
+{
+    uint32_t prefix = (uint32_t(entry[0]) << 16) | (uint32_t(entry[1]) << 8) | entry[2];
+    return prefix >> (24 - fanoutBits);
+}
+
+}
@@ -0,0 +1,97 @@
+#pragma once
+///@file
+
+#include "lix/libstore/path.hh"
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nix {
+
+/**
+ * An index of the hash parts of all `.narinfo` files in a binary cache,
+ * which lets clients answer bulk validity queries with one request
+ * instead of one request per path.
+ *
+ * The file (`narinfo-index` in the root of the cache) consists of
+ *
+ * - the magic `narinfoIndexMagic`,
+ * - the number `b` of fanout bits, as a 64-bit little endian integer,
+ * - the number of entries, as a 64-bit little endian integer,
+ * - `2^b` 64-bit little endian integers, the first of which is the number
+ *   of entries whose first `b` bits are 0, the second the number of
+ *   entries whose first `b` bits are 0 or 1, and so on,
+ * - the entries, which are the decoded 20-byte hash parts, in ascending
+ *   order.
+ *
+ * Entries are neither compressed nor of variable length so that the
+ * entries of any range of buckets can be fetched by themselves.
+ */
+struct NarInfoIndex
+{
+    using Entry = std::array<unsigned char, 20>;
+
+    static constexpr std::string_view fileName = "narinfo-index";
+
+    /**
+     * Size of the part of the header that does not depend on the number
+     * of fanout bits.
+     */
+    static constexpr size_t fixedHeaderSize = 24;
+
+    unsigned int fanoutBits = 0;
+    uint64_t count = 0;
+    std::vector<uint64_t> bucketEnds;
+
+    static Entry entryFor(const StorePath & path);
+
+    /**
+     * Serialise the index of `entries`, which need neither be sorted nor
+     * free of duplicates.
+     */
+    static std::string write(std::vector<Entry> entries);
+
+    /**
+     * @return The size of the whole header, given at least
+     * `fixedHeaderSize` bytes from the start of the file.
+     */
+    static size_t headerSize(std::string_view data);
+
+    /**
+     * Parse the header from at least `headerSize(data)` bytes from the
+     * start of the file.
+     */
+    static NarInfoIndex parseHeader(std::string_view data);
+
+    /**
+     * Parse the entries of a complete index file.
+     */
+    static std::vector<Entry> parseEntries(std::string_view data);
+
+    /**
+     * @return Whether `entries`, a sorted range of serialised entries,
+     * contains `entry`.
+     */
+    static bool contains(std::string_view entries, const Entry & entry);
+
+    size_t headerSize() const
+    {
+        return fixedHeaderSize + 8 * bucketEnds.size();
+    }
+
+    size_t bucketOf(const Entry & entry) const;
+
+    uint64_t bucketStart(size_t bucket) const
+    {
+        return bucket == 0 ? 0 : bucketEnds[bucket - 1];
+    }
+
+    uint64_t bucketEnd(size_t bucket) const
+    {
+        return bucketEnds[bucket];
+    }
+};
+
+}
@@ -1,6 +1,7 @@
 #include "lix/libstore/local-store.hh"
 #include "lix/libstore/globals.hh"
 #include "lix/libutil/async.hh"
+#include "lix/libutil/hash.hh"
 #include "lix/libutil/result.hh"
 #include "lix/libutil/signals.hh"
 #include "lix/libutil/strings.hh"
@@ -90,8 +91,9 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
 }
 
 
-void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash, RepairFlag repair)
+void LocalStore::collectOptimisable(
+    const Path & path, const InodeHash & inodeHash, std::vector<OptimisableFile> & files
+)
 {
     checkInterrupt();
 
@@ -113,7 +115,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectoryIgnoringInodes(path, inodeHash);
         for (auto & i : names)
-            optimisePath_(act, stats, path + "/" + i, inodeHash, repair);
+            collectOptimisable(path + "/" + i, inodeHash, files);
         return;
     }
 
@@ -139,7 +141,17 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         return;
     }
 
-    /* Hash the file.  Note that hashPath() returns the hash over the
+    files.push_back({path, st});
+}
+
+
+void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
+    const Path & path, InodeHash & inodeHash, RepairFlag repair)
+{
+    std::vector<OptimisableFile> files;
+    collectOptimisable(path, inodeHash, files);
+
+    /* Hash the files.  Note that hashPath() returns the hash over the
        NAR serialisation, which includes the execute bit on the file.
        Thus, executable and non-executable files with the same
        contents *won't* be linked (which is good because otherwise the
@@ -148,7 +160,24 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
        Also note that if `path' is a symlink, then we're hashing the
        contents of the symlink (i.e. the result of readlink()), not
        the contents of the target (which may not even exist). */
-    Hash hash = hashPath(HashType::SHA256, path).first;
+    std::vector<Path> toHash;
+    for (auto & file : files)
+        toHash.push_back(file.path);
+    auto hashes = hashPaths(HashType::SHA256, toHash);
+
+    for (size_t n = 0; n < files.size(); n++)
+        linkOptimisable(act, stats, files[n], hashes[n].value().first, inodeHash, repair);
+}
+
+
+void LocalStore::linkOptimisable(Activity * act, OptimiseStats & stats,
+    const OptimisableFile & file, const Hash & hash, InodeHash & inodeHash, RepairFlag repair)
+{
+    checkInterrupt();
+
+    auto & path = file.path;
+    auto & st = file.st;
+
     debug("'%1%' has hash '%2%'", path, hash.to_string(Base::Base32, true));
 
     /* Check if this is a known hash. */
@@ -258,6 +287,12 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 }
 
 
+/**
+ * Number of files `optimiseStore()` collects from consecutive store paths
+ * before hashing them in parallel. Paths are never split between batches.
+ */
+static constexpr size_t optimiseBatchSize = 1024;
+
 kj::Promise<Result<void>> LocalStore::optimiseStore(OptimiseStats & stats)
 try {
     Activity act(*logger, actOptimiseStore);
@@ -269,21 +304,42 @@ try {
 
     uint64_t done = 0;
 
-    for (auto & i : paths) {
-        TRY_AWAIT(addTempRoot(i));
-        if (!TRY_AWAIT(isValidPath(i))) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(
-                &act,
-                stats,
-                config().realStoreDir + "/" + std::string(i.to_string()),
-                inodeHash,
-                NoRepair
+    for (auto it = paths.begin(); it != paths.end();) {
+        /* Collect the files of as many paths as fit into a batch, hash
+           them in parallel, then link them path by path. */
+        std::vector<std::pair<StorePath, std::vector<OptimisableFile>>> batch;
+        size_t batchFiles = 0;
+
+        for (; it != paths.end() && batchFiles < optimiseBatchSize; ++it) {
+            TRY_AWAIT(addTempRoot(*it));
+            if (!TRY_AWAIT(isValidPath(*it))) { /* path was GC'ed, probably */
+                done++;
+                act.progress(done, paths.size());
+                continue;
+            }
+            auto & [_, files] = batch.emplace_back(*it, std::vector<OptimisableFile>{});
+            collectOptimisable(
+                config().realStoreDir + "/" + std::string(it->to_string()), inodeHash, files
             );
+            batchFiles += files.size();
+        }
+
+        std::vector<Path> toHash;
+        for (auto & [_, files] : batch)
+            for (auto & file : files)
+                toHash.push_back(file.path);
+        auto hashes = hashPaths(HashType::SHA256, toHash);
+
+        size_t n = 0;
+        for (auto & [path, files] : batch) {
+            {
+                Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(path)));
+                for (auto & file : files)
+                    linkOptimisable(&act, stats, file, hashes[n++].value().first, inodeHash, NoRepair);
+            }
+            done++;
+            act.progress(done, paths.size());
         }
-        done++;
-        act.progress(done, paths.size());
     }
     co_return result::success();
 } catch (...) {
@@ -1,3 +1,4 @@
+#include "lix/libstore/build/sandbox-pool.hh"
 #include "lix/libstore/build/worker.hh"
 #include "lix/libutil/cgroup.hh"
 #include "lix/libutil/finally.hh"
@@ -758,29 +759,32 @@ void LinuxLocalDerivationGoal::prepareSandbox()
     chrootRootDir = worker.store.Store::toRealPath(drvPath) + ".chroot";
     deletePath(chrootRootDir);
 
-    /* Clean up the chroot directory automatically. */
-    autoDelChroot = std::make_shared<AutoDelete>(chrootRootDir);
+    auto pool = SandboxPool::get(dirOf(chrootRootDir), worker.store.config().storeDir);
+
+    /* Clean up the chroot directory automatically, in the background
+       if we have a pool of sandboxes. */
+    autoDelChroot = std::shared_ptr<AutoDelete>(new AutoDelete(chrootRootDir), [pool](AutoDelete * autoDel) {
+        if (pool && pool->discard(*autoDel))
+            autoDel->cancel();
+        delete autoDel;
+    });
 
     printMsg(lvlChatty, "setting up chroot environment in '%1%'", chrootRootDir);
 
+    /* Take /tmp, /etc, /dev, /proc and the store directory from a
+       prepared sandbox skeleton if possible. */
+    if (!pool || !pool->take(chrootRootDir))
+        createSandboxSkeleton(chrootRootDir, worker.store.config().storeDir);
+
     // FIXME: make this 0700
-    if (mkdir(chrootRootDir.c_str(), buildUser && buildUser->getUIDCount() != 1 ? 0755 : 0750) == -1)
-        throw SysError("cannot create '%1%'", chrootRootDir);
+    chmodPath(chrootRootDir, buildUser && buildUser->getUIDCount() != 1 ? 0755 : 0750);
 
     if (buildUser && chown(chrootRootDir.c_str(), buildUser->getUIDCount() != 1 ? buildUser->getUID() : 0, buildUser->getGID()) == -1)
         throw SysError("cannot change ownership of '%1%'", chrootRootDir);
 
-    /* Create a writable /tmp in the chroot.  Many builders need
-       this.  (Of course they should really respect $TMPDIR
-       instead.) */
-    Path chrootTmpDir = chrootRootDir + "/tmp";
-    createDirs(chrootTmpDir);
-    chmodPath(chrootTmpDir, 01777);
-
     /* Create a /etc/passwd with entries for the build user and the
        nobody account.  The latter is kind of a hack to support
        Samba-in-QEMU. */
-    createDirs(chrootRootDir + "/etc");
     if (parsedDrv->useUidRange())
         chownToBuilder(chrootRootDir + "/etc");
 
@@ -1002,6 +1006,7 @@ void LinuxLocalDerivationGoal::killSandbox(bool getStats)
         if (getStats) {
             buildResult.cpuUser = stats.cpuUser;
             buildResult.cpuSystem = stats.cpuSystem;
+            buildResult.memoryPeak = stats.memoryPeak;
         }
     } else if (!useChroot) {
         /* Linux sandboxes use PID namespaces, which ensure that processes cannot escape from a build.
@@ -1,4 +1,5 @@
 #include "lix/libstore/remote-fs-accessor.hh"
+#include "lix/libstore/binary-cache-store.hh"
 #include "lix/libstore/nar-accessor.hh"
 #include "lix/libutil/json.hh"
 
@@ -100,6 +101,18 @@ try {
         } catch (SysError &) { }
     }
 
+    /* Without a local NAR cache to fill, binary caches may let us fetch
+       only the parts of the NAR that are actually needed. */
+    if (cacheDir == "") {
+        if (auto binaryCache = store.try_cast_shared<BinaryCacheStore>()) {
+            if (auto accessor = TRY_AWAIT(binaryCache->getSeekableNarAccessor(storePath))) {
+                auto narAccessor = ref<FSAccessor>(accessor);
+                nars.emplace(storePath.hashPart(), narAccessor);
+                co_return {narAccessor, restPath};
+            }
+        }
+    }
+
     StringSink sink;
     TRY_AWAIT(store->narFromPath(storePath))->drainInto(sink);
     co_return {TRY_AWAIT(addToCache(storePath.hashPart(), std::move(sink.s))), restPath};
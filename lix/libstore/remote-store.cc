@@ -948,6 +948,74 @@ try {
 }
 
 
+kj::Promise<Result<bool>> RemoteStore::daemonSupportsQueryClosure()
+try {
+    if (queryClosureProbed)
+        co_return queryClosureSupported.load();
+
+    /* The protocol version does not tell us whether the daemon knows this
+       operation. Daemons that don't reject it before reading any arguments
+       and then hang up, so ask once with an empty set, which is sure to fit
+       into the socket buffer, rather than with a request that may not.
+       Whatever goes wrong, the connection can't be trusted afterwards, and
+       the generic implementation still works. */
+    auto conn(TRY_AWAIT(getConnection()));
+    bool supported = true;
+    try {
+        conn->to << WorkerProto::Op::QueryClosure;
+        conn->to << WorkerProto::write(*this, *conn, StorePathSet{});
+        conn->to << false << false;
+        conn.processStderr();
+        WorkerProto::Serialise<std::vector<ValidPathInfo>>::read(*this, *conn);
+    } catch (Error & e) {
+        debug("daemon of '%s' does not support bulk closure queries: %s", getUri(), e.msg());
+        conn.handle.markBad();
+        supported = false;
+    }
+
+    queryClosureSupported = supported;
+    queryClosureProbed = true;
+    co_return supported;
+} catch (...) {
+    co_return result::current_exception();
+}
+
+
+kj::Promise<Result<void>> RemoteStore::computeFSClosure(const StorePathSet & paths,
+    StorePathSet & out, bool flipDirection, bool includeOutputs, bool includeDerivers)
+try {
+    if (flipDirection || paths.empty() || !TRY_AWAIT(daemonSupportsQueryClosure())) {
+        TRY_AWAIT(Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers));
+        co_return result::success();
+    }
+
+    std::vector<ValidPathInfo> infos;
+    {
+        auto conn(TRY_AWAIT(getConnection()));
+        conn->to << WorkerProto::Op::QueryClosure;
+        conn->to << WorkerProto::write(*this, *conn, paths);
+        conn->to << includeOutputs << includeDerivers;
+        conn.processStderr();
+        infos = WorkerProto::Serialise<std::vector<ValidPathInfo>>::read(*this, *conn);
+    }
+
+    /* Callers almost always go on to query the metadata of the paths in
+       the closure, so keep what we were sent. */
+    auto state_(co_await state.lock());
+    for (auto & info : infos) {
+        out.insert(info.path);
+        auto key = std::string(info.path.to_string());
+        state_->pathInfoCache.upsert(
+            std::move(key),
+            PathInfoCacheValue{.value = std::make_shared<const ValidPathInfo>(std::move(info))}
+        );
+    }
+    co_return result::success();
+} catch (...) {
+    co_return result::current_exception();
+}
+
+
 kj::Promise<Result<void>> RemoteStore::addBuildLog(const StorePath & drvPath, std::string_view log)
 try {
     auto conn(TRY_AWAIT(getConnection()));
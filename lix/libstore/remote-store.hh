@@ -168,6 +168,16 @@ public:
         StorePathSet & willBuild, StorePathSet & willSubstitute, StorePathSet & unknown,
         uint64_t & downloadSize, uint64_t & narSize) override;
 
+    /**
+     * Let the daemon walk the closure and send back the metadata of every
+     * path in it, which also fills the path info cache. Falls back to the
+     * generic implementation for `flipDirection` and for daemons that do
+     * not know `WorkerProto::Op::QueryClosure`.
+     */
+    kj::Promise<Result<void>> computeFSClosure(const StorePathSet & paths,
+        StorePathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     kj::Promise<Result<void>> addBuildLog(const StorePath & drvPath, std::string_view log) override;
 
     kj::Promise<Result<std::optional<std::string>>> getVersion() override;
@@ -208,6 +218,15 @@ private:
 
     std::atomic_bool failed{false};
 
+    /**
+     * Whether the daemon has been asked if it supports
+     * `WorkerProto::Op::QueryClosure`, and what it answered.
+     */
+    std::atomic_bool queryClosureProbed{false};
+    std::atomic_bool queryClosureSupported{false};
+
+    kj::Promise<Result<bool>> daemonSupportsQueryClosure();
+
     // NOTE we rely on the thread pool not starting threads eagerly. if it ever starts
     // doing that we're certainly going to fail due to the immense thread count, which
     // we need to satisfy temporary `incCapacity` calls by some RemoteStore functions.
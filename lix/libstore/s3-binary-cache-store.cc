@@ -20,10 +20,14 @@
 #include <aws/core/utils/logging/LogMacros.h>
 #include <aws/core/utils/threading/Executor.h>
 #include <aws/s3/S3Client.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/HeadObjectRequest.h>
 #include <aws/s3/model/ListObjectsRequest.h>
 #include <aws/s3/model/PutObjectRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
 #include <aws/transfer/TransferManager.h>
 
 using namespace Aws::Transfer;
@@ -240,7 +244,11 @@ struct S3BinaryCacheStoreConfig final : BinaryCacheStoreConfig
 
     const Setting<bool> multipartUpload{
         this, false, "multipart-upload",
-        "Whether to use multi-part uploads."};
+        R"(
+          Whether to use multi-part uploads. NARs are then uploaded while
+          they are being compressed instead of being written to a
+          temporary file first.
+        )"};
 
     const Setting<uint64_t> bufferSize{
         this, 5 * 1024 * 1024, "buffer-size",
@@ -464,6 +472,128 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             uploadFile(path, istream, mimeType, "");
     }
 
+    bool canRenameFiles() override
+    {
+        /* Only multipart uploads are streamed, see below. */
+        return !config().multipartUpload;
+    }
+
+    std::unique_ptr<Upload> beginUpload(const std::string & tempPath, const std::string & mimeType) override
+    {
+        if (!config().multipartUpload)
+            return BinaryCacheStore::beginUpload(tempPath, mimeType);
+
+        /* S3 cannot rename objects, so the upload keeps its name. Parts are
+           uploaded as soon as they are full. */
+        struct S3Upload : Upload
+        {
+            S3BinaryCacheStoreImpl & store;
+            std::string key;
+            std::string uploadId;
+            std::string part;
+            Aws::Vector<Aws::S3::Model::CompletedPart> parts;
+            uint64_t size = 0;
+            bool committed = false;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            S3Upload(S3BinaryCacheStoreImpl & store, const std::string & key, const std::string & mimeType)
+                : store(store)
+                , key(key)
+            {
+                auto request =
+                    Aws::S3::Model::CreateMultipartUploadRequest()
+                    .WithBucket(store.bucketName)
+                    .WithKey(key);
+                request.SetContentType(mimeType);
+                auto result = checkAws(fmt("AWS error starting upload of '%s'", key),
+                    store.s3Helper.client->CreateMultipartUpload(request));
+                uploadId = result.GetUploadId();
+            }
+
+            ~S3Upload()
+            {
+                if (committed)
+                    return;
+                try {
+                    store.s3Helper.client->AbortMultipartUpload(
+                        Aws::S3::Model::AbortMultipartUploadRequest()
+                        .WithBucket(store.bucketName)
+                        .WithKey(key)
+                        .WithUploadId(uploadId));
+                } catch (...) {
+                    ignoreExceptionInDestructor();
+                }
+            }
+
+            void operator()(std::string_view data) override
+            {
+                const uint64_t partSize = store.config().bufferSize;
+                while (!data.empty()) {
+                    auto n = std::min<uint64_t>(data.size(), partSize - part.size());
+                    part.append(data.substr(0, n));
+                    data.remove_prefix(n);
+                    if (part.size() == partSize)
+                        uploadPart();
+                }
+            }
+
+            void uploadPart()
+            {
+                checkInterrupt();
+
+                int partNumber = parts.size() + 1;
+                auto partLength = part.size();
+                auto request =
+                    Aws::S3::Model::UploadPartRequest()
+                    .WithBucket(store.bucketName)
+                    .WithKey(key)
+                    .WithUploadId(uploadId)
+                    .WithPartNumber(partNumber)
+                    .WithContentLength(partLength);
+                request.SetBody(std::make_shared<std::stringstream>(std::move(part)));
+                part.clear();
+
+                auto result = checkAws(fmt("AWS error uploading part %d of '%s'", partNumber, key),
+                    store.s3Helper.client->UploadPart(request));
+                parts.push_back(
+                    Aws::S3::Model::CompletedPart()
+                    .WithETag(result.GetETag())
+                    .WithPartNumber(partNumber));
+                size += partLength;
+            }
+
+            std::string commit(const std::string &) override
+            {
+                if (!part.empty() || parts.empty())
+                    uploadPart();
+
+                checkAws(fmt("AWS error finishing upload of '%s'", key),
+                    store.s3Helper.client->CompleteMultipartUpload(
+                        Aws::S3::Model::CompleteMultipartUploadRequest()
+                        .WithBucket(store.bucketName)
+                        .WithKey(key)
+                        .WithUploadId(uploadId)
+                        .WithMultipartUpload(
+                            Aws::S3::Model::CompletedMultipartUpload().WithParts(parts))));
+                committed = true;
+
+                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+
+                printInfo("uploaded 's3://%s/%s' (%d bytes) in %d ms",
+                    store.bucketName, key, size, duration);
+
+                store.stats.putTimeMs += duration;
+                store.stats.putBytes += size;
+                store.stats.put++;
+
+                return key;
+            }
+        };
+
+        return std::make_unique<S3Upload>(*this, tempPath, mimeType);
+    }
+
     box_ptr<Source> getFile(const std::string & path) override
     {
         stats.get++;
@@ -44,7 +44,10 @@ public:
             config_.sshPublicHostKey,
             // Use SSH master only if using more than 1 connection.
             connections->capacity() > 1,
-            config_.compress)
+            config_.compress,
+            -1,
+            config_.controlPath,
+            config_.controlPersist)
     {
     }
 
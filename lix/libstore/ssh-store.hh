@@ -22,6 +22,18 @@ struct CommonSSHStoreConfig : virtual StoreConfig
     const Setting<bool> compress{this, false, "compress",
         "Whether to enable SSH compression."};
 
+    const Setting<Path> controlPath{this, "", "control-path",
+        R"(
+          Path of an SSH control socket to share with other processes
+          connecting to the same machine. If the master connection behind
+          it is not running, it is started and left running for
+          `control-persist` seconds after the last connection using it
+          has closed.
+        )"};
+
+    const Setting<unsigned int> controlPersist{this, 60, "control-persist",
+        "Number of seconds an idle master connection started for `control-path` stays open."};
+
     const Setting<std::string> remoteStore{this, "", "remote-store",
         R"(
           [Store URL](@docroot@/command-ref/new-cli/nix3-help-stores.md#store-url-format)
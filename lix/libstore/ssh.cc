@@ -4,19 +4,34 @@
 #include "lix/libutil/finally.hh"
 #include "lix/libutil/logging.hh"
 #include "lix/libutil/strings.hh"
+#include "lix/libstore/pathlocks.hh"
 #include "lix/libstore/temporary-dir.hh"
 
+#include <fcntl.h>
+
 namespace nix {
 
-SSHMaster::SSHMaster(const std::string & host, const std::optional<uint16_t> port, const std::string & keyFile, const std::string & sshPublicHostKey, bool useMaster, bool compress, int logFD)
+SSHMaster::SSHMaster(
+    const std::string & host,
+    const std::optional<uint16_t> port,
+    const std::string & keyFile,
+    const std::string & sshPublicHostKey,
+    bool useMaster,
+    bool compress,
+    int logFD,
+    const Path & controlPath,
+    unsigned int controlPersist
+)
     : host(host)
     , port(port)
     , fakeSSH(host == "localhost")
     , keyFile(keyFile)
     , sshPublicHostKey(sshPublicHostKey)
-    , useMaster(useMaster && !fakeSSH)
+    , useMaster((useMaster || !controlPath.empty()) && !fakeSSH)
     , compress(compress)
     , logFD(logFD)
+    , controlPath(controlPath)
+    , controlPersist(controlPersist)
 {
     if (host == "" || host.starts_with("-"))
         throw Error("invalid SSH host name '%s'", host);
@@ -28,7 +43,11 @@ SSHMaster::SSHMaster(const std::string & host, const std::optional<uint16_t> por
 void SSHMaster::addCommonSSHOpts(Strings & args)
 {
     auto state(state_.lock());
+    addCommonSSHOpts(*state, args);
+}
 
+void SSHMaster::addCommonSSHOpts(State & state, Strings & args)
+{
     if (port.has_value())
         args.insert(args.end(), {"-p", std::to_string(*port)});
     for (auto & i : tokenizeString<Strings>(getEnv("NIX_SSHOPTS").value_or("")))
@@ -36,7 +55,7 @@ void SSHMaster::addCommonSSHOpts(Strings & args)
     if (!keyFile.empty())
         args.insert(args.end(), {"-i", keyFile});
     if (!sshPublicHostKey.empty()) {
-        Path fileName = (Path) *state->tmpDir + "/host-key";
+        Path fileName = (Path) *state.tmpDir + "/host-key";
         auto p = host.rfind("@");
         std::string thost = p != std::string::npos ? std::string(host, p + 1) : host;
         writeFile(fileName, thost + " " + base64Decode(sshPublicHostKey) + "\n");
@@ -57,6 +76,15 @@ bool SSHMaster::isMasterRunning() {
     return res.first == 0;
 }
 
+bool SSHMaster::isMasterRunning(State & state, const Path & socketPath)
+{
+    Strings args = {"-O", "check", "-S", socketPath, host};
+    addCommonSSHOpts(state, args);
+
+    auto res = runProgram(RunOptions {.program = "ssh", .args = args, .mergeStderrToStdout = true});
+    return res.first == 0;
+}
+
 std::unique_ptr<SSHMaster::Connection> SSHMaster::startCommand(const std::string & command)
 {
     Path socketPath = startMaster();
@@ -138,7 +166,18 @@ Path SSHMaster::startMaster()
 
     if (state->sshMaster) return state->socketPath;
 
-    state->socketPath = (Path) *state->tmpDir + "/ssh.sock";
+    bool persistent = !controlPath.empty();
+
+    /* Keep other processes from starting a master for the same shared
+       socket at the same time. */
+    AutoCloseFD persistentLock;
+    if (persistent) {
+        if (!state->socketPath.empty()) return state->socketPath;
+        persistentLock = openLockFile(controlPath + ".lock", true);
+        lockFile(persistentLock.get(), ltWrite);
+    }
+
+    auto socketPath = persistent ? controlPath : (Path) *state->tmpDir + "/ssh.sock";
 
     Pipe out;
     out.create();
@@ -149,8 +188,10 @@ Path SSHMaster::startMaster()
     logger->pause();
     Finally cleanup = [&]() { logger->resume(); };
 
-    if (isMasterRunning())
-        return state->socketPath;
+    if (isMasterRunning(*state, socketPath)) {
+        state->socketPath = socketPath;
+        return socketPath;
+    }
 
     state->sshMaster = startProcess([&]() {
         restoreProcessContext();
@@ -160,8 +201,20 @@ Path SSHMaster::startMaster()
         if (dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
             throw SysError("duping over stdout");
 
-        Strings args = { "ssh", host.c_str(), "-M", "-N", "-S", state->socketPath };
-        addCommonSSHOpts(args);
+        Strings args = { "ssh", host.c_str(), "-M", "-N", "-S", socketPath };
+
+        if (persistent) {
+            /* Detach the master from this process, whose stderr may be
+               a log that is read until EOF. */
+            if (setsid() == -1)
+                throw SysError("creating a new session");
+            AutoCloseFD devNull{open("/dev/null", O_RDWR)};
+            if (!devNull || dup2(devNull.get(), STDERR_FILENO) == -1)
+                throw SysError("duping over stderr");
+            args.push_back(fmt("-oControlPersist=%d", controlPersist));
+        }
+
+        addCommonSSHOpts(*state, args);
         execvp(args.begin()->c_str(), stringsToCharPtrs(args).data());
 
         throw SysError("unable to execute '%s'", args.front());
@@ -179,7 +232,13 @@ Path SSHMaster::startMaster()
         throw Error("failed to start SSH master connection to '%s'", host);
     }
 
-    return state->socketPath;
+    /* A shared master exits by itself once it has been idle for
+       `controlPersist` seconds. */
+    if (persistent)
+        state->sshMaster.release();
+
+    state->socketPath = socketPath;
+    return socketPath;
 }
 
 }
@@ -21,6 +21,14 @@ private:
     const bool compress;
     const int logFD;
 
+    /**
+     * If not empty, the control socket of a master connection that is
+     * shared with other processes and outlives this object by
+     * `controlPersist` seconds.
+     */
+    const Path controlPath;
+    const unsigned int controlPersist;
+
     struct State
     {
         Pid sshMaster;
@@ -31,11 +39,23 @@ private:
     Sync<State> state_;
 
     void addCommonSSHOpts(Strings & args);
+    void addCommonSSHOpts(State & state, Strings & args);
     bool isMasterRunning();
+    bool isMasterRunning(State & state, const Path & socketPath);
 
 public:
 
-    SSHMaster(const std::string & host, const std::optional<uint16_t> port, const std::string & keyFile, const std::string & sshPublicHostKey, bool useMaster, bool compress, int logFD = -1);
+    SSHMaster(
+        const std::string & host,
+        const std::optional<uint16_t> port,
+        const std::string & keyFile,
+        const std::string & sshPublicHostKey,
+        bool useMaster,
+        bool compress,
+        int logFD = -1,
+        const Path & controlPath = "",
+        unsigned int controlPersist = 0
+    );
 
     struct Connection
     {
@@ -1155,7 +1155,7 @@ try {
     CopyPathStream source{
         act,
         info->narSize,
-        make_box_ptr<AsyncSourceInputStream>(TRY_AWAIT(srcStore.narFromPath(storePath)))
+        make_box_ptr<AsyncSourceInputStream>(TRY_AWAIT(srcStore.narFromPathUsingDeltas(storePath, dstStore)))
     };
     TRY_AWAIT(dstStore.addToStore(*info, source, repair, checkSigs));
     co_return result::success();
@@ -1308,7 +1308,9 @@ try {
                     makeCopyPathMessage(srcUri, dstUri, storePathS),
                     Logger::Fields{storePathS, srcUri, dstUri},
                     info->narSize,
-                    make_box_ptr<AsyncSourceInputStream>(TRY_AWAIT(srcStore.narFromPath(missingPath)))
+                    make_box_ptr<AsyncSourceInputStream>(
+                        TRY_AWAIT(srcStore.narFromPathUsingDeltas(missingPath, dstStore))
+                    )
                 );
             } catch (...) {
                 co_return result::current_exception();
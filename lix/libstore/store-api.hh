@@ -373,6 +373,19 @@ public:
     virtual kj::Promise<Result<StorePathSet>> queryValidPaths(const StorePathSet & paths,
         SubstituteFlag maybeSubstitute = NoSubstitute);
 
+    /**
+     * Query which of the given paths can be substituted from this
+     * store. Unlike `queryValidPaths()`, the answer may come from
+     * information that is slightly out of date, since substituting a
+     * path that turns out to be missing merely falls back to the next
+     * substituter.
+     */
+    virtual kj::Promise<Result<StorePathSet>>
+    queryValidPathsForSubstitution(const StorePathSet & paths)
+    {
+        return queryValidPaths(paths);
+    }
+
     /**
      * Query the set of all valid paths. Note that for some store
      * backends, the name part of store paths may be replaced by 'x'
@@ -614,6 +627,17 @@ public:
      */
     virtual kj::Promise<Result<box_ptr<Source>>> narFromPath(const StorePath & path) = 0;
 
+    /**
+     * Like `narFromPath()`, but may reconstruct the NAR from a smaller
+     * delta against a path that is valid in `baseStore`, if this store
+     * has one.
+     */
+    virtual kj::Promise<Result<box_ptr<Source>>>
+    narFromPathUsingDeltas(const StorePath & path, Store & baseStore)
+    {
+        return narFromPath(path);
+    }
+
     /**
      * For each path, if it's a derivation, build it.  Building a
      * derivation means ensuring that the output paths are valid.  If
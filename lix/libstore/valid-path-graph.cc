@@ -0,0 +1,352 @@
+#include "lix/libstore/valid-path-graph.hh"
+#include "lix/libstore/store-api.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/strings.hh"
+#include "lix/libutil/sync.hh"
+
+#include <map>
+#include <unordered_set>
+#include <unistd.h>
+
+namespace nix {
+
+struct ValidPathGraph::Connection
+{
+    /**
+     * SQLite connections must not be used across fork(), so remember
+     * which process opened this one.
+     */
+    const pid_t pid = getpid();
+
+    SQLite db;
+
+    SQLiteStmt QueryDataVersion;
+    SQLiteStmt QueryNewPaths;
+    SQLiteStmt QueryNewRefs;
+    SQLiteStmt QueryCount;
+    SQLiteStmt QueryIds;
+
+    /**
+     * `data_version` as of the last completed refresh, if any.
+     */
+    std::optional<int64_t> lastDataVersion;
+
+    Connection(const Path & dbPath, SQLiteOpenMode mode)
+        : db(dbPath, mode)
+    {
+        QueryDataVersion = db.create("pragma data_version;");
+        QueryNewPaths = db.create(
+            "select id, path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca "
+            "from ValidPaths where id > ?;");
+        QueryNewRefs = db.create("select referrer, reference from Refs where referrer > ?;");
+        QueryCount = db.create("select count(*) from ValidPaths;");
+        QueryIds = db.create("select id from ValidPaths;");
+    }
+
+    int64_t dataVersion()
+    {
+        auto use(QueryDataVersion.use());
+        if (!use.next())
+            throw Error("cannot query the data version of the Lix database");
+        return use.getInt(0);
+    }
+};
+
+std::shared_ptr<ValidPathGraph>
+ValidPathGraph::open(const Path & storeDir, const Path & dbPath, SQLiteOpenMode mode)
+{
+    static Sync<std::map<Path, std::weak_ptr<ValidPathGraph>>> graphs;
+
+    auto graphs_(graphs.lock());
+    auto & entry = (*graphs_)[dbPath];
+    if (auto graph = entry.lock())
+        return graph;
+
+    auto graph = std::make_shared<ValidPathGraph>(storeDir, dbPath, mode);
+    graph->refresh();
+    entry = graph;
+    return graph;
+}
+
+ValidPathGraph::ValidPathGraph(const Path & storeDir, const Path & dbPath, SQLiteOpenMode mode)
+    : storeDir(storeDir)
+    , dbPath(dbPath)
+    , mode(mode)
+{
+}
+
+ValidPathGraph::~ValidPathGraph()
+{
+    /* See refresh(). */
+    if (conn && conn->pid != getpid())
+        (void) conn.release();
+}
+
+StorePath ValidPathGraph::parseStorePath(std::string_view path) const
+{
+    if (dirOf(path) != storeDir)
+        throw BadStorePath("path '%s' is not in the Nix store", path);
+    return StorePath(baseNameOf(path));
+}
+
+void ValidPathGraph::invalidate()
+{
+    generation.fetch_add(1, std::memory_order_release);
+}
+
+bool ValidPathGraph::isFresh() const
+{
+    return refreshedGeneration.load(std::memory_order_acquire)
+            == generation.load(std::memory_order_acquire)
+        && std::chrono::steady_clock::now() < nextRefresh.load(std::memory_order_acquire);
+}
+
+bool ValidPathGraph::refreshIfStale()
+{
+    if (isFresh())
+        return false;
+
+    std::lock_guard refreshing(refreshLock);
+    /* Another reader may have refreshed while we were waiting. */
+    if (isFresh())
+        return true;
+    refreshLocked();
+    return true;
+}
+
+void ValidPathGraph::refresh()
+{
+    std::lock_guard refreshing(refreshLock);
+    refreshLocked();
+}
+
+void ValidPathGraph::disconnect()
+{
+    std::lock_guard refreshing(refreshLock);
+    if (conn && conn->pid != getpid())
+        (void) conn.release();
+    conn.reset();
+}
+
+void ValidPathGraph::refreshLocked()
+{
+    /* Everything invalidated before this point has been committed, so
+       the data_version check below will see it. */
+    auto seenGeneration = generation.load(std::memory_order_acquire);
+    auto started = std::chrono::steady_clock::now();
+
+    retrySQLite([&]() {
+        if (conn && conn->pid != getpid()) {
+            /* We were forked from the process that loaded this graph.
+               Its connection is not ours to use, or even to close. */
+            (void) conn.release();
+        }
+        if (!conn)
+            conn = std::make_unique<Connection>(dbPath, mode);
+
+        /* `data_version` only changes when some other connection has
+           committed, so this is all a refresh costs when nothing
+           changed. */
+        auto dataVersion = conn->dataVersion();
+        if (conn->lastDataVersion == dataVersion)
+            return;
+
+        /* Read both tables from one snapshot so that every reference
+           we see points to a path we have seen. */
+        SQLiteTxn txn = conn->db.beginTransaction();
+        std::unique_lock writing(lock);
+        loadNewPaths();
+        dropDeletedPaths();
+        txn.commit();
+
+        conn->lastDataVersion = dataVersion;
+    });
+
+    nextRefresh.store(started + recheckInterval, std::memory_order_release);
+    refreshedGeneration.store(seenGeneration, std::memory_order_release);
+}
+
+template<typename F>
+bool ValidPathGraph::withNode(const StorePath & path, F && f)
+{
+    bool refreshed = refreshIfStale();
+    while (true) {
+        {
+            std::shared_lock reading(lock);
+            if (auto i = ids.find(path); i != ids.end()) {
+                f(nodes[i->second]);
+                return true;
+            }
+        }
+        /* The path may have been registered by another process since
+           the last check. Callers rely on that being visible at once,
+           e.g. after waiting for the lock on an output path. */
+        if (refreshed)
+            return false;
+        refresh();
+        refreshed = true;
+    }
+}
+
+void ValidPathGraph::loadNewPaths()
+{
+    /* `ValidPaths.id` is an autoincrement column, so everything
+       registered since the last refresh has a larger id. `maxDbId` is
+       only advanced once the references have been loaded as well, so
+       that a retry after SQLITE_BUSY starts over from the same point. */
+    auto newMaxDbId = maxDbId;
+    {
+        auto use(conn->QueryNewPaths.use()(maxDbId));
+        while (use.next()) {
+            uint64_t dbId = use.getInt(0);
+            auto path = parseStorePath(use.getStr(1));
+
+            /* The path may have been deleted and registered again since
+               we last looked. */
+            if (auto i = ids.find(path); i != ids.end())
+                erase(i->second);
+
+            Id id;
+            if (freeIds.empty()) {
+                id = nodes.size();
+                nodes.emplace_back();
+            } else {
+                id = freeIds.back();
+                freeIds.pop_back();
+            }
+
+            auto & node = nodes[id];
+            node.dbId = dbId;
+            node.name = path.to_string();
+            try {
+                node.narHash = Hash::parseAnyPrefixed(use.getStr(2));
+            } catch (BadHash & e) {
+                throw BadStorePath("bad hash in store path '%s': %s", use.getStr(1), e.what());
+            }
+            node.registrationTime = use.getInt(3);
+            node.deriver = use.getStrNullable(4).value_or("");
+            /* Note that narSize = NULL yields 0. */
+            node.narSize = use.getInt(5);
+            node.ultimate = use.getInt(6) == 1;
+            node.sigs = use.getStrNullable(7).value_or("");
+            node.ca = use.getStrNullable(8).value_or("");
+
+            ids.emplace(std::move(path), id);
+            dbIds.emplace(dbId, id);
+            newMaxDbId = std::max(newMaxDbId, dbId);
+        }
+    }
+
+    {
+        auto use(conn->QueryNewRefs.use()(maxDbId));
+        while (use.next()) {
+            auto referrer = dbIds.find(use.getInt(0));
+            auto reference = dbIds.find(use.getInt(1));
+            if (referrer == dbIds.end() || reference == dbIds.end())
+                continue;
+            nodes[referrer->second].references.push_back(reference->second);
+            nodes[reference->second].referrers.push_back(referrer->second);
+        }
+    }
+
+    maxDbId = newMaxDbId;
+}
+
+void ValidPathGraph::dropDeletedPaths()
+{
+    {
+        auto use(conn->QueryCount.use());
+        if (use.next() && static_cast<uint64_t>(use.getInt(0)) == ids.size())
+            return;
+    }
+
+    std::unordered_set<uint64_t> live;
+    {
+        auto use(conn->QueryIds.use());
+        while (use.next())
+            live.insert(use.getInt(0));
+    }
+
+    for (Id id = 0; id < nodes.size(); id++)
+        if (nodes[id].dbId != 0 && !live.contains(nodes[id].dbId))
+            erase(id);
+}
+
+void ValidPathGraph::erase(Id id)
+{
+    auto & node = nodes[id];
+    for (auto reference : node.references)
+        if (reference != id)
+            std::erase(nodes[reference].referrers, id);
+    for (auto referrer : node.referrers)
+        if (referrer != id)
+            std::erase(nodes[referrer].references, id);
+    ids.erase(StorePath(node.name));
+    dbIds.erase(node.dbId);
+    node = Node{};
+    freeIds.push_back(id);
+}
+
+std::shared_ptr<const ValidPathInfo> ValidPathGraph::queryPathInfo(const StorePath & path)
+{
+    std::shared_ptr<ValidPathInfo> info;
+
+    withNode(path, [&](const Node & node) {
+        info = std::make_shared<ValidPathInfo>(path, node.narHash);
+        info->id = node.dbId;
+        info->registrationTime = node.registrationTime;
+        if (!node.deriver.empty())
+            info->deriver = parseStorePath(node.deriver);
+        info->narSize = node.narSize;
+        info->ultimate = node.ultimate;
+        if (!node.sigs.empty())
+            info->sigs = tokenizeString<StringSet>(node.sigs, " ");
+        if (!node.ca.empty())
+            info->ca = ContentAddress::parseOpt(node.ca);
+        for (auto reference : node.references)
+            info->references.insert(StorePath(nodes[reference].name));
+    });
+
+    return info;
+}
+
+bool ValidPathGraph::isValidPath(const StorePath & path)
+{
+    return withNode(path, [](const Node &) {});
+}
+
+void ValidPathGraph::queryReferrers(const StorePath & path, StorePathSet & referrers)
+{
+    withNode(path, [&](const Node & node) {
+        for (auto referrer : node.referrers)
+            referrers.insert(StorePath(nodes[referrer].name));
+    });
+}
+
+StorePathSet ValidPathGraph::queryAllValidPaths()
+{
+    refresh();
+    std::shared_lock reading(lock);
+
+    StorePathSet res;
+    for (auto & [path, _] : ids)
+        res.insert(path);
+    return res;
+}
+
+void ValidPathGraph::update(const ValidPathInfo & info)
+{
+    std::unique_lock writing(lock);
+
+    auto i = ids.find(info.path);
+    if (i == ids.end())
+        return;
+    auto & node = nodes[i->second];
+    node.narHash = info.narHash;
+    node.narSize = info.narSize;
+    node.ultimate = info.ultimate;
+    node.sigs = concatStringsSep(" ", info.sigs);
+    node.ca = renderContentAddress(info.ca);
+}
+
+}
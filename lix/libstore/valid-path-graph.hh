@@ -0,0 +1,181 @@
+#pragma once
+///@file
+
+#include "lix/libstore/path-info.hh"
+#include "lix/libstore/sqlite.hh"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace nix {
+
+/**
+ * A compact in-memory mirror of the `ValidPaths` and `Refs` tables of a
+ * local store database. Store paths are interned into dense ids and the
+ * reference graph is kept as adjacency arrays in both directions, so
+ * metadata, referrer and validity queries can be answered without taking
+ * the store's database lock, and concurrent readers do not block each
+ * other.
+ *
+ * The database remains the source of truth; the mirror never writes to
+ * it. Instead it keeps its own connection and catches up with the
+ * `data_version` of the database: newly registered paths are loaded and
+ * deleted paths are dropped. Writers in this process report their commits
+ * through `invalidate()`, which makes the next read catch up. Commits by
+ * other processes are picked up by a `data_version` check that runs at
+ * most once per `recheckInterval`, and whenever a path is not found, so
+ * a path registered elsewhere is never reported as invalid. In-place
+ * metadata updates (signatures, repaired hashes) are not visible to that
+ * check and must be reported through `update()` by the writer.
+ */
+class ValidPathGraph
+{
+public:
+    /**
+     * Return the graph of the database at `dbPath`. A graph that has
+     * already been loaded by this process, or by the process it was
+     * forked from, is reused and brought up to date incrementally.
+     */
+    static std::shared_ptr<ValidPathGraph>
+    open(const Path & storeDir, const Path & dbPath, SQLiteOpenMode mode);
+
+    ValidPathGraph(const Path & storeDir, const Path & dbPath, SQLiteOpenMode mode);
+
+    ~ValidPathGraph();
+
+    /**
+     * @return The metadata of `path`, or null if it is not valid.
+     */
+    std::shared_ptr<const ValidPathInfo> queryPathInfo(const StorePath & path);
+
+    bool isValidPath(const StorePath & path);
+
+    void queryReferrers(const StorePath & path, StorePathSet & referrers);
+
+    StorePathSet queryAllValidPaths();
+
+    /**
+     * Record an in-place metadata update of a valid path after it has
+     * been committed to the database.
+     */
+    void update(const ValidPathInfo & info);
+
+    /**
+     * Note that this process has committed a change to the database. The
+     * next read catches up with it.
+     */
+    void invalidate();
+
+    /**
+     * Catch up with all changes committed to the database since the
+     * last call.
+     */
+    void refresh();
+
+    /**
+     * Close the connection to the database. The next refresh opens a new
+     * one. The daemon does this before forking off a connection handler,
+     * which must not inherit the connection.
+     */
+    void disconnect();
+
+private:
+    using Id = uint32_t;
+
+    struct Node
+    {
+        /**
+         * Row id in `ValidPaths`, or 0 if this slot is unused.
+         */
+        uint64_t dbId = 0;
+        /**
+         * Base name of the store path.
+         */
+        std::string name;
+        Hash narHash = Hash::dummy;
+        uint64_t narSize = 0;
+        time_t registrationTime = 0;
+        bool ultimate = false;
+        /**
+         * The `deriver`, `sigs` and `ca` columns as stored in the
+         * database, parsed only when the path is queried.
+         */
+        std::string deriver, sigs, ca;
+        std::vector<Id> references, referrers;
+    };
+
+    struct Connection;
+
+    /**
+     * How long a read may trust the graph without checking whether
+     * another process has changed the database.
+     */
+    static constexpr std::chrono::milliseconds recheckInterval{1000};
+
+    const Path storeDir;
+    const Path dbPath;
+    const SQLiteOpenMode mode;
+
+    /**
+     * Bumped by `invalidate()`.
+     */
+    std::atomic<uint64_t> generation = 0;
+
+    /**
+     * The `generation` as of the start of the last refresh, and the time
+     * after which the next read has to refresh. Reads compare these
+     * without taking any lock.
+     */
+    std::atomic<uint64_t> refreshedGeneration = 0;
+    std::atomic<std::chrono::steady_clock::time_point> nextRefresh;
+
+    /**
+     * Serialises `refresh()`. Only held while talking to the database.
+     */
+    std::mutex refreshLock;
+    std::unique_ptr<Connection> conn;
+
+    /**
+     * Protects everything below. Readers take it shared.
+     */
+    std::shared_mutex lock;
+    std::vector<Node> nodes;
+    std::vector<Id> freeIds;
+    std::unordered_map<StorePath, Id> ids;
+    std::unordered_map<uint64_t, Id> dbIds;
+    uint64_t maxDbId = 0;
+
+    StorePath parseStorePath(std::string_view path) const;
+
+    bool isFresh() const;
+
+    /**
+     * Refresh unless a refresh happened recently and nothing was
+     * invalidated since.
+     *
+     * @return Whether the graph is known to be up to date now.
+     */
+    bool refreshIfStale();
+
+    /**
+     * Call `f` on the node of `path` with the lock held shared. If the
+     * path is not found, refresh and look again before giving up.
+     *
+     * @return Whether `path` was found.
+     */
+    template<typename F>
+    bool withNode(const StorePath & path, F && f);
+
+    void refreshLocked();
+
+    void loadNewPaths();
+    void dropDeletedPaths();
+    void erase(Id id);
+};
+
+}
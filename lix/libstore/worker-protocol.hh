@@ -182,6 +182,13 @@ enum struct WorkerProto::Op : uint64_t
     AddMultipleToStore = 44,
     AddBuildLog = 45,
     BuildPathsWithResults = 46,
+    /**
+     * Not part of any upstream protocol version, and numbered far beyond
+     * the upstream operations so that it cannot collide with one of them.
+     * Clients must not send it to daemons that have not been seen to
+     * accept it; see `RemoteStore::daemonSupportsQueryClosure`.
+     */
+    QueryClosure = 1 << 16,
 };
 
 /**
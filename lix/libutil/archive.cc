@@ -1,8 +1,10 @@
 #include <cerrno>
+#include <climits>
 #include <algorithm>
 #include <string_view>
 #include <vector>
 #include <map>
+#include <memory>
 
 #include <strings.h> // for strcasecmp
 
@@ -12,6 +14,10 @@
 #include <dirent.h>
 #include <fcntl.h>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include "lix/libutil/archive.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/box_ptr.hh"
@@ -23,6 +29,8 @@
 #include "lix/libutil/result.hh"
 #include "lix/libutil/serialise.hh"
 #include "lix/libutil/signals.hh"
+#include "lix/libutil/sync.hh"
+#include "lix/libutil/thread-pool.hh"
 
 namespace nix {
 
@@ -38,22 +46,97 @@ static GlobalConfig::Register rArchiveSettings(&archiveSettings);
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
-static WireFormatGenerator dumpContents(Path path, off_t size)
+/**
+ * Largest buffer used to read file contents. Files smaller than this are
+ * read with a single `read()` into a buffer of exactly their size.
+ */
+static constexpr size_t maxReadBufferSize = 1024 * 1024;
+
+static WireFormatGenerator readContents(AutoCloseFD fd, uint64_t left)
 {
-    AutoCloseFD fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
-    if (!fd) throw SysError("opening file '%1%'", path);
+    if (left == 0) co_return;
 
-    std::vector<char> buf(65536);
-    size_t left = size;
+    std::vector<char> buf(std::min<uint64_t>(left, maxReadBufferSize));
 
     while (left > 0) {
-        auto n = std::min(left, buf.size());
+        auto n = std::min<uint64_t>(left, buf.size());
         readFull(fd.get(), buf.data(), n);
         left -= n;
         co_yield std::span{buf.data(), n};
     }
 }
 
+static AutoCloseFD openContents(const Path & path)
+{
+    AutoCloseFD fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (!fd) throw SysError("opening file '%1%'", path);
+    return fd;
+}
+
+/**
+ * Copy up to `size` bytes from the current offset of `from` to `to` without
+ * passing them through userspace. Stops early if the kernel can't do this
+ * for the given pair of file descriptors or if `from` ends prematurely.
+ *
+ * @return The number of bytes copied.
+ */
+static uint64_t copyInKernel(int from, int to, uint64_t size)
+{
+    uint64_t copied = 0;
+#ifdef __linux__
+    struct stat st;
+    bool tryCopyFileRange = fstat(to, &st) == 0 && S_ISREG(st.st_mode);
+
+    while (copied < size) {
+        checkInterrupt();
+        auto chunk = std::min<uint64_t>(size - copied, SSIZE_MAX);
+        ssize_t res;
+        if (tryCopyFileRange) {
+            res = copy_file_range(from, nullptr, to, nullptr, chunk, 0);
+            if (res == -1 && errno != EINTR) {
+                /* Not supported between these files (e.g. across file
+                   systems on older kernels), try sendfile instead. */
+                tryCopyFileRange = false;
+                continue;
+            }
+        } else {
+            res = sendfile(to, from, nullptr, chunk);
+            if (res == -1 && errno != EINTR) {
+                /* Leave anything else, including real errors, to the
+                   read/write fallback. It will report them properly. */
+                break;
+            }
+        }
+        if (res == 0) break;
+        if (res > 0) copied += res;
+    }
+#endif
+    return copied;
+}
+
+/**
+ * Like `readContents()`, but copies as much as possible of the file in the
+ * kernel straight to the file descriptor of `sink`. Everything dumped before
+ * is flushed first, so framing and contents arrive in order.
+ */
+static WireFormatGenerator copyContentsTo(Path path, uint64_t size, FdSink & sink)
+{
+    auto fd = openContents(path);
+    sink.flush();
+    auto copied = copyInKernel(fd.get(), sink.fd, size);
+    sink.written += copied;
+    co_yield readContents(std::move(fd), size - copied);
+}
+
+static WireFormatGenerator dumpContents(Path path, off_t size, FdSink * directSink)
+{
+    if (directSink) {
+        co_yield copyContentsTo(std::move(path), size, *directSink);
+    } else {
+        co_yield readContents(openContents(path), size);
+    }
+}
+
 static WireFormatGenerator dumpSingle(nar::File f)
 {
     co_yield "type";
@@ -116,7 +199,12 @@ WireFormatGenerator nar::dump(nar::Entry nar)
 // returnUnhacked is false directory entries will be returned as they have
 // been read from disk. to produce a correct NAR from the results the case
 // hack must be undone if configured unless returnUnhacked is set to true.
-static nar::Entry list(Path path, time_t & mtime, PathFilter & filter, bool returnUnhacked)
+//
+// if directSink is set, the contents of regular files are copied straight to
+// its file descriptor when they are dumped instead of being yielded.
+static nar::Entry list(
+    Path path, time_t & mtime, PathFilter & filter, bool returnUnhacked, FdSink * directSink = nullptr
+)
 {
     checkInterrupt();
 
@@ -127,10 +215,14 @@ static nar::Entry list(Path path, time_t & mtime, PathFilter & filter, bool retu
         return nar::File{
             (st.st_mode & S_IXUSR) != 0,
             uint64_t(st.st_size),
-            dumpContents(std::move(path), st.st_size)
+            dumpContents(std::move(path), st.st_size, directSink)
         };
     } else if (S_ISDIR(st.st_mode)) {
-        auto contents = [](Path path, time_t & mtime, PathFilter & filter, bool returnUnhacked
+        auto contents = [](Path path,
+                           time_t & mtime,
+                           PathFilter & filter,
+                           bool returnUnhacked,
+                           FdSink * directSink
                         ) -> Generator<std::pair<const std::string &, nar::Entry>> {
             /* If we're on a case-insensitive system like macOS, undo
                the case hack applied by restorePath(). */
@@ -157,7 +249,7 @@ static nar::Entry list(Path path, time_t & mtime, PathFilter & filter, bool retu
                     auto diskPath = path + "/" + i.second;
                     co_yield std::pair(
                         std::cref(returnUnhacked ? i.first : i.second),
-                        list(diskPath, tmp_mtime, filter, returnUnhacked)
+                        list(diskPath, tmp_mtime, filter, returnUnhacked, directSink)
                     );
                     if (tmp_mtime > mtime) {
                         mtime = tmp_mtime;
@@ -166,7 +258,9 @@ static nar::Entry list(Path path, time_t & mtime, PathFilter & filter, bool retu
             }
         };
 
-        return nar::Directory(contents(std::move(path), mtime, filter, returnUnhacked));
+        return nar::Directory(
+            contents(std::move(path), mtime, filter, returnUnhacked, directSink)
+        );
     } else if (S_ISLNK(st.st_mode)) {
         return nar::Symlink{readLink(path)};
     } else {
@@ -192,6 +286,13 @@ WireFormatGenerator dumpPath(Path path)
 }
 
 
+void dumpPath(Path path, FdSink & sink)
+{
+    time_t ignored;
+    sink << nar::dump(list(std::move(path), ignored, defaultPathFilter, true, &sink));
+}
+
+
 WireFormatGenerator dumpString(std::string_view s)
 {
     co_yield narVersionMagic1;
@@ -267,7 +368,7 @@ struct PrefilteredDump : PreparedDump
     {
         overloaded handlers{
             [&](const File & f) -> nar::Entry {
-                return nar::File{f.executable, f.size, dumpContents(std::move(path), f.size)};
+                return nar::File{f.executable, f.size, dumpContents(std::move(path), f.size, nullptr)};
             },
             [&](const Symlink & s) -> nar::Entry { return nar::Symlink{s.target}; },
             [&](const Directory & d) -> nar::Entry {
@@ -936,6 +1037,148 @@ try {
  * CppNix's CVE-2024-45593 (GHSA-h4vv-h3jq-v493)
  */
 
+static void makeExecutable(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError("fstat");
+    if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+        throw SysError("fchmod");
+}
+
+static void maybePreallocateContents(int fd, uint64_t len)
+{
+    if (!archiveSettings.preallocateContents)
+        return;
+
+#if HAVE_POSIX_FALLOCATE
+    if (len) {
+        errno = posix_fallocate(fd, 0, len);
+        /* Note that EINVAL may indicate that the underlying
+           filesystem doesn't support preallocation (e.g. on
+           OpenSolaris).  Since preallocation is just an
+           optimisation, ignore it. */
+        if (errno && errno != EINVAL && errno != EOPNOTSUPP && errno != ENOSYS)
+            throw SysError("preallocating file of %1% bytes", len);
+    }
+#endif
+}
+
+/**
+ * Writes the contents of small files for `NARRestoreVisitor` on a pool of
+ * threads (see the `restore-threads` setting), so that unpacking NARs with
+ * very many small files is not bound by the latency of their syscalls.
+ *
+ * Files are still created by the parsing thread in NAR order, so all checks
+ * of Note [NAR restoration security] happen exactly as without writers. The
+ * first error of any writer is rethrown in the parsing thread by the next
+ * `submit()`, or by `finish()`.
+ */
+struct RestoreWriters
+{
+    /** Larger files are written by the parsing thread as they arrive. */
+    static constexpr uint64_t maxBufferedFileSize = 1024 * 1024;
+
+    /** Upper bound on the contents waiting to be written at any time. */
+    static constexpr uint64_t maxBufferedBytes = 64 * 1024 * 1024;
+
+    /**
+     * Upper bound on the files waiting to be written at any time. Each of
+     * them holds an open file descriptor, so this must stay well below
+     * the usual `RLIMIT_NOFILE` soft limit of 1024.
+     */
+    static constexpr size_t maxPendingFiles = 256;
+
+    struct PendingFile
+    {
+        AutoCloseFD fd;
+        bool executable;
+        std::string contents;
+    };
+
+    struct State
+    {
+        uint64_t buffered = 0;
+        size_t pendingFiles = 0;
+        bool failed = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /* Declared last so that the workers are stopped before the state they
+     * reference is destroyed. */
+    ThreadPool pool;
+
+    explicit RestoreWriters(unsigned int threads) : pool("NAR restore", threads) {}
+
+    static bool wantsBuffered(uint64_t size)
+    {
+        /* Empty files have nothing to write. */
+        return size > 0 && size <= maxBufferedFileSize;
+    }
+
+    void submit(PendingFile file)
+    {
+        auto size = file.contents.size();
+
+        bool failed = [&] {
+            auto state(state_.lock());
+            while (((state->buffered > 0 && state->buffered + size > maxBufferedBytes)
+                    || state->pendingFiles >= maxPendingFiles)
+                   && !state->failed)
+            {
+                state.wait(wakeup);
+            }
+            state->buffered += size;
+            state->pendingFiles++;
+            return state->failed;
+        }();
+        if (failed) {
+            /* Rethrows the error of the writer that failed. */
+            pool.process();
+        }
+
+        auto pending = std::make_shared<PendingFile>(std::move(file));
+        try {
+            pool.enqueue([this, pending, size] {
+                Finally release([&] {
+                    {
+                        auto state(state_.lock());
+                        state->buffered -= size;
+                        state->pendingFiles--;
+                    }
+                    wakeup.notify_one();
+                });
+                try {
+                    write(*pending);
+                } catch (...) {
+                    state_.lock()->failed = true;
+                    throw;
+                }
+            });
+        } catch (ThreadPoolShutDown &) {
+            pool.process();
+            throw;
+        }
+    }
+
+    void finish()
+    {
+        pool.process();
+    }
+
+    static void write(PendingFile & file)
+    {
+        if (file.executable) {
+            makeExecutable(file.fd.get());
+        }
+        maybePreallocateContents(file.fd.get(), file.contents.size());
+        writeFull(file.fd.get(), file.contents);
+        file.fd.close();
+    }
+};
+
 /**
  * This code restores NARs from disk.
  *
@@ -949,58 +1192,57 @@ struct NARRestoreVisitor : NARParseVisitor
     bool useCaseHack;
     std::map<Path, int, CaseInsensitiveCompare> caseHackNames;
 
+    /** Shared by all visitors of one restore, may be null. */
+    RestoreWriters * writers;
+
 private:
     struct MyFileHandle : public FileHandle
     {
         AutoCloseFD fd;
 
-        MyFileHandle(AutoCloseFD && fd, uint64_t size, bool executable) : FileHandle(), fd(std::move(fd))
-        {
-            if (executable) {
-                makeExecutable();
-            }
-
-            maybePreallocateContents(size);
-        }
-
-        void makeExecutable()
-        {
-            struct stat st;
-            if (fstat(fd.get(), &st) == -1)
-                throw SysError("fstat");
-            if (fchmod(fd.get(), st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
-                throw SysError("fchmod");
-        }
+        /** Set if the contents are buffered for `writers`. */
+        RestoreWriters * writers = nullptr;
+        bool executable;
+        std::string contents;
 
-        void maybePreallocateContents(uint64_t len)
+        MyFileHandle(AutoCloseFD && fd, uint64_t size, bool executable, RestoreWriters * writers)
+            : FileHandle()
+            , fd(std::move(fd))
+            , executable(executable)
         {
-            if (!archiveSettings.preallocateContents)
+            if (writers && RestoreWriters::wantsBuffered(size)) {
+                this->writers = writers;
+                contents.reserve(size);
                 return;
+            }
 
-#if HAVE_POSIX_FALLOCATE
-            if (len) {
-                errno = posix_fallocate(fd.get(), 0, len);
-                /* Note that EINVAL may indicate that the underlying
-                   filesystem doesn't support preallocation (e.g. on
-                   OpenSolaris).  Since preallocation is just an
-                   optimisation, ignore it. */
-                if (errno && errno != EINVAL && errno != EOPNOTSUPP && errno != ENOSYS)
-                    throw SysError("preallocating file of %1% bytes", len);
+            if (executable) {
+                makeExecutable(this->fd.get());
             }
-#endif
+
+            maybePreallocateContents(this->fd.get(), size);
         }
 
         ~MyFileHandle() = default;
 
         virtual void close() override
         {
+            if (writers) {
+                writers->submit({std::move(fd), executable, std::move(contents)});
+                return;
+            }
+
             /* Call close explicitly to make sure the error is checked */
             fd.close();
         }
 
         void receiveContents(std::string_view data) override
         {
-            writeFull(fd.get(), data);
+            if (writers) {
+                contents += data;
+            } else {
+                writeFull(fd.get(), data);
+            }
         }
     };
 
@@ -1023,7 +1265,12 @@ private:
     }
 
 public:
-    NARRestoreVisitor(Path dstPath, bool useCaseHack): dstPath(std::move(dstPath)), useCaseHack(useCaseHack) {}
+    NARRestoreVisitor(Path dstPath, bool useCaseHack, RestoreWriters * writers)
+        : dstPath(std::move(dstPath))
+        , useCaseHack(useCaseHack)
+        , writers(writers)
+    {
+    }
 
     box_ptr<NARParseVisitor> createDirectory(const std::string & name_) override
     {
@@ -1031,7 +1278,7 @@ public:
         Path p = dstPath + name;
         if (mkdir(p.c_str(), 0777) == -1)
             throw SysError("creating directory '%1%'", p);
-        return make_box_ptr<NARRestoreVisitor>(p + "/", useCaseHack);
+        return make_box_ptr<NARRestoreVisitor>(p + "/", useCaseHack, writers);
     };
 
     box_ptr<FileHandle> createRegularFile(const std::string & name_, uint64_t size, bool executable) override
@@ -1041,7 +1288,7 @@ public:
         AutoCloseFD fd = AutoCloseFD{open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666)};
         if (!fd) throw SysError("creating file '%1%'", p);
 
-        return make_box_ptr<MyFileHandle>(std::move(fd), size, executable);
+        return make_box_ptr<MyFileHandle>(std::move(fd), size, executable, writers);
     }
 
     void createSymlink(const std::string & name_, const std::string & target) override
@@ -1053,16 +1300,32 @@ public:
 };
 
 
+static std::unique_ptr<RestoreWriters> makeRestoreWriters()
+{
+    if (archiveSettings.restoreThreads == 0) {
+        return nullptr;
+    }
+    return std::make_unique<RestoreWriters>(archiveSettings.restoreThreads);
+}
+
 void restorePath(const Path & path, Source & source)
 {
-    NARRestoreVisitor sink(path, archiveSettings.useCaseHack);
+    auto writers = makeRestoreWriters();
+    NARRestoreVisitor sink(path, archiveSettings.useCaseHack, writers.get());
     parseDump(sink, source);
+    if (writers) {
+        writers->finish();
+    }
 }
 
 kj::Promise<Result<void>> restorePath(const Path & path, AsyncInputStream & source)
 try {
-    NARRestoreVisitor sink(path, archiveSettings.useCaseHack);
+    auto writers = makeRestoreWriters();
+    NARRestoreVisitor sink(path, archiveSettings.useCaseHack, writers.get());
     TRY_AWAIT(parseDump(sink, source));
+    if (writers) {
+        TRY_AWAIT(writers->pool.processAsync());
+    }
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();
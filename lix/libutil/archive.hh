@@ -63,6 +63,14 @@ namespace nix {
 WireFormatGenerator dumpPath(Path path, PathFilter & filter);
 WireFormatGenerator dumpPath(Path path);
 
+/**
+ * Same as `sink << dumpPath(path)`, but copies the contents of regular files
+ * from their file descriptors to `sink.fd` within the kernel where possible
+ * (`copy_file_range` for regular files, `sendfile` for pipes and sockets).
+ * Only the NAR framing passes through the buffer of `sink`.
+ */
+void dumpPath(Path path, FdSink & sink);
+
 /**
  * Same as dumpPath(), but returns the last modified date of the path.
  */
@@ -3,6 +3,7 @@
 /// @brief A semaphore implementation usable from within a KJ event loop.
 
 #include <cassert>
+#include <cstdint>
 #include <kj/async.h>
 #include <kj/common.h>
 #include <kj/exception.h>
@@ -44,10 +45,16 @@ private:
         kj::PromiseFulfiller<Token> & fulfiller;
         kj::ListLink<Waiter> link;
         kj::List<Waiter, &Waiter::link> & list;
+        uint64_t priority;
 
-        Waiter(kj::PromiseFulfiller<Token> & fulfiller, kj::List<Waiter, &Waiter::link> & list)
+        Waiter(
+            kj::PromiseFulfiller<Token> & fulfiller,
+            kj::List<Waiter, &Waiter::link> & list,
+            uint64_t priority
+        )
             : fulfiller(fulfiller)
             , list(list)
+            , priority(priority)
         {
             list.add(*this);
         }
@@ -69,9 +76,16 @@ private:
         used_ -= 1;
         while (used_ < capacity_ && !waiters.empty()) {
             used_ += 1;
-            auto & w = waiters.front();
-            w.fulfiller.fulfill(Token{*this, {}});
-            waiters.remove(w);
+            /* Wake the longest-waiting of the waiters with the highest
+               priority. */
+            auto * next = &waiters.front();
+            for (auto & w : waiters) {
+                if (w.priority > next->priority) {
+                    next = &w;
+                }
+            }
+            next->fulfiller.fulfill(Token{*this, {}});
+            waiters.remove(*next);
         }
     }
 
@@ -95,12 +109,17 @@ public:
         }
     }
 
-    kj::Promise<Token> acquire()
+    /**
+     * Acquire the semaphore. If it is not available, waiters with a higher
+     * `priority` are woken first, and waiters with the same priority are
+     * woken in the order they started waiting.
+     */
+    kj::Promise<Token> acquire(uint64_t priority = 0)
     {
         if (auto t = tryAcquire()) {
             return std::move(*t);
         } else {
-            return kj::newAdaptedPromise<Token, Waiter>(waiters);
+            return kj::newAdaptedPromise<Token, Waiter>(waiters, priority);
         }
     }
 
@@ -0,0 +1,92 @@
+#pragma once
+/// @file
+/// @brief A queue of waiters in a KJ event loop that are woken one at a time.
+
+#include <cstdint>
+#include <kj/async.h>
+#include <kj/common.h>
+#include <kj/list.h>
+
+namespace nix {
+
+class AsyncWaitQueue
+{
+    struct Waiter
+    {
+        kj::PromiseFulfiller<void> & fulfiller;
+        kj::ListLink<Waiter> link;
+        kj::List<Waiter, &Waiter::link> & list;
+        uint64_t priority;
+
+        Waiter(
+            kj::PromiseFulfiller<void> & fulfiller,
+            kj::List<Waiter, &Waiter::link> & list,
+            uint64_t priority
+        )
+            : fulfiller(fulfiller)
+            , list(list)
+            , priority(priority)
+        {
+            list.add(*this);
+        }
+
+        ~Waiter()
+        {
+            if (link.isLinked()) {
+                list.remove(*this);
+            }
+        }
+    };
+
+    kj::List<Waiter, &Waiter::link> waiters;
+
+public:
+    AsyncWaitQueue() = default;
+
+    KJ_DISALLOW_COPY_AND_MOVE(AsyncWaitQueue);
+
+    ~AsyncWaitQueue()
+    {
+        /* Waiters that outlive the queue are simply never woken. */
+        while (!waiters.empty()) {
+            waiters.remove(waiters.front());
+        }
+    }
+
+    /**
+     * Wait until `notifyOne()` picks this waiter. Waiters with a higher
+     * `priority` are picked first, and waiters with the same priority in
+     * the order they started waiting. Cancelled waiters leave the queue.
+     */
+    kj::Promise<void> wait(uint64_t priority = 0)
+    {
+        return kj::newAdaptedPromise<void, Waiter>(waiters, priority);
+    }
+
+    /**
+     * Wake up the first waiter, if any.
+     *
+     * @return Whether a waiter was woken up.
+     */
+    bool notifyOne()
+    {
+        if (waiters.empty()) {
+            return false;
+        }
+        auto * next = &waiters.front();
+        for (auto & w : waiters) {
+            if (w.priority > next->priority) {
+                next = &w;
+            }
+        }
+        next->fulfiller.fulfill();
+        waiters.remove(*next);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return waiters.size();
+    }
+};
+}
@@ -9,6 +9,7 @@
 #include <chrono>
 #include <cmath>
 #include <regex>
+#include <stdexcept>
 #include <unordered_set>
 #include <thread>
 #include <signal.h>
@@ -133,6 +134,12 @@ static CgroupStats destroyCgroup(const Path & cgroup, bool returnStats)
             }
         }
 
+        /* Only available since Linux 5.19. */
+        auto memoryPeakPath = cgroup + "/memory.peak";
+
+        if (pathExists(memoryPeakPath))
+            stats.memoryPeak = string2Int<uint64_t>(trim(readFile(memoryPeakPath)));
+
     }
 
     if (rmdir(cgroup.c_str()) == -1)
@@ -146,6 +153,48 @@ CgroupStats destroyCgroup(const Path & cgroup)
     return destroyCgroup(cgroup, true);
 }
 
+std::optional<double> getPressure(const Path & pressureFile)
+{
+    std::string contents;
+    try {
+        contents = readFile(pressureFile);
+    } catch (SysError &) {
+        return std::nullopt;
+    }
+
+    /* The first line has the form "some avg10=1.23 avg60=... total=...". */
+    std::string_view avg10Prefix = "some avg10=";
+    if (!contents.starts_with(avg10Prefix))
+        return std::nullopt;
+    auto value = contents.substr(avg10Prefix.size(), contents.find(' ', avg10Prefix.size()) - avg10Prefix.size());
+    try {
+        return std::stod(value);
+    } catch (std::logic_error &) {
+        return std::nullopt;
+    }
+}
+
+std::optional<uint64_t> getAvailableMemory()
+{
+    std::string contents;
+    try {
+        contents = readFile("/proc/meminfo");
+    } catch (SysError &) {
+        return std::nullopt;
+    }
+
+    for (auto & line : tokenizeString<std::vector<std::string>>(contents, "\n")) {
+        std::string_view prefix = "MemAvailable:";
+        if (line.starts_with(prefix)) {
+            auto fields = tokenizeString<std::vector<std::string>>(line.substr(prefix.size()), " ");
+            if (fields.size() == 2 && fields[1] == "kB")
+                if (auto n = string2Int<uint64_t>(fields[0]))
+                    return *n * 1024;
+        }
+    }
+    return std::nullopt;
+}
+
 }
 
 #endif
@@ -17,6 +17,11 @@ std::map<std::string, std::string> getCgroups(const Path & cgroupFile);
 struct CgroupStats
 {
     std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+
+    /**
+     * The highest memory usage of the cgroup, in bytes.
+     */
+    std::optional<uint64_t> memoryPeak;
 };
 
 /**
@@ -27,6 +32,19 @@ struct CgroupStats
  */
 CgroupStats destroyCgroup(const Path & cgroup);
 
+/**
+ * @return The percentage of the last 10 seconds in which some tasks were
+ * stalled on a resource, read from a pressure stall information file like
+ * `/proc/pressure/memory`, or nothing if the kernel does not provide it.
+ */
+std::optional<double> getPressure(const Path & pressureFile);
+
+/**
+ * @return The amount of memory, in bytes, that is available for starting
+ * new applications without swapping according to `/proc/meminfo`.
+ */
+std::optional<uint64_t> getAvailableMemory();
+
 }
 
 #endif
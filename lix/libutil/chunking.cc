@@ -0,0 +1,83 @@
+#include "lix/libutil/chunking.hh"
+
+#include <array>
+#include <bit>
+#include <cassert>
+
+namespace nix {
+
+/**
+ * Random values for the gear hash. These must never change, as that would
+ * move the chunk boundaries of all data and thus defeat deduplication
+ * against everything chunked before.
+ */
+static constexpr auto gearTable = [] {
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0x4c69782043444321; // splitmix64
+    for (auto & entry : table) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}();
+
+ChunkingSink::ChunkingSink(ChunkCallback onChunk, Params params)
+    : onChunk(std::move(onChunk))
+    , params(params)
+{
+    assert(std::has_single_bit(params.avgSize) && params.avgSize > 1);
+    assert(params.minSize <= params.maxSize && params.maxSize > 0);
+    /* Use the high bits of the hash, which depend on the most recent
+       bytes: bit i of the gear hash only depends on the last i + 1
+       bytes. */
+    mask = (params.avgSize - 1) << (64 - std::countr_zero(params.avgSize));
+}
+
+void ChunkingSink::operator()(std::string_view data)
+{
+    while (!data.empty()) {
+        size_t i = 0;
+        bool cut = false;
+
+        /* Skip hashing the part of the chunk that cannot end it. */
+        if (chunk.size() < params.minSize) {
+            i = std::min(data.size(), params.minSize - chunk.size());
+            hash = 0;
+        }
+
+        for (; i < data.size(); ++i) {
+            if (chunk.size() + i + 1 >= params.maxSize) {
+                cut = true;
+                break;
+            }
+            hash = (hash << 1) + gearTable[static_cast<unsigned char>(data[i])];
+            if ((hash & mask) == 0) {
+                cut = true;
+                break;
+            }
+        }
+
+        auto n = cut ? i + 1 : i;
+        chunk.append(data.substr(0, n));
+        data.remove_prefix(n);
+        if (cut)
+            emit();
+    }
+}
+
+void ChunkingSink::finish()
+{
+    if (!chunk.empty())
+        emit();
+}
+
+void ChunkingSink::emit()
+{
+    onChunk(chunk);
+    chunk.clear();
+    hash = 0;
+}
+
+}
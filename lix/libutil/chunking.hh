@@ -0,0 +1,61 @@
+#pragma once
+///@file
+
+#include "lix/libutil/serialise.hh"
+
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace nix {
+
+/**
+ * Splits the data written to it into chunks whose boundaries depend only on
+ * the bytes around them (content-defined chunking with a gear hash), so that
+ * inserting or removing data only changes the chunks near the change. Equal
+ * regions of similar inputs thus mostly produce equal chunks.
+ */
+class ChunkingSink : public Sink
+{
+public:
+    struct Params
+    {
+        /**
+         * No chunk except the last is smaller than this.
+         */
+        size_t minSize = 64 * 1024;
+
+        /**
+         * The expected chunk size beyond `minSize`. Must be a power of two.
+         */
+        size_t avgSize = 256 * 1024;
+
+        /**
+         * No chunk is larger than this.
+         */
+        size_t maxSize = 1024 * 1024;
+    };
+
+    using ChunkCallback = std::function<void(std::string_view chunk)>;
+
+    ChunkingSink(ChunkCallback onChunk, Params params);
+    ChunkingSink(ChunkCallback onChunk) : ChunkingSink(std::move(onChunk), Params{}) {}
+
+    void operator()(std::string_view data) override;
+
+    /**
+     * Pass the last (possibly short) chunk to the callback.
+     */
+    void finish();
+
+private:
+    ChunkCallback onChunk;
+    Params params;
+    uint64_t mask;
+    uint64_t hash = 0;
+    std::string chunk;
+
+    void emit();
+};
+
+}
@@ -8,10 +8,15 @@
 #include <archive_entry.h>
 #include <cstdio>
 #include <cstring>
+#include <thread>
 
 #include <brotli/decode.h>
 #include <brotli/encode.h>
 
+#include <lzma.h>
+
+#include <zstd.h>
+
 
 namespace nix {
 
@@ -212,6 +217,305 @@ finish:
     }
 };
 
+static unsigned int compressionThreads(const CompressionOptions & options)
+{
+    if (options.threads) {
+        return options.threads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+struct XzDecompressionSource : Source
+{
+    static constexpr size_t BUF_SIZE = 64 * 1024;
+    std::unique_ptr<uint8_t[]> buf;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    bool inputEnded = false;
+    bool finished = false;
+
+    Source & inner;
+
+    XzDecompressionSource(Source & inner) : buf(std::make_unique<uint8_t[]>(BUF_SIZE)), inner(inner)
+    {
+        // concatenated streams are valid .xz files and produced e.g. by pixz
+        auto ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+        if (ret != LZMA_OK) {
+            throw CompressionError("unable to initialise xz decoder (error %d)", ret);
+        }
+    }
+
+    ~XzDecompressionSource() override
+    {
+        lzma_end(&strm);
+    }
+
+    size_t read(char * data, size_t len) override
+    {
+        if (finished) {
+            throw EndOfFile("xz stream exhausted");
+        }
+
+        strm.next_out = charptr_cast<uint8_t *>(data);
+        strm.avail_out = len;
+
+        while (strm.avail_out == len) {
+            checkInterrupt();
+
+            if (strm.avail_in == 0 && !inputEnded) {
+                try {
+                    strm.avail_in = inner.read(charptr_cast<char *>(buf.get()), BUF_SIZE);
+                    strm.next_in = buf.get();
+                } catch (EndOfFile &) {
+                    inputEnded = true;
+                }
+            }
+
+            auto ret = lzma_code(&strm, inputEnded ? LZMA_FINISH : LZMA_RUN);
+            if (ret == LZMA_STREAM_END) {
+                finished = true;
+                break;
+            } else if (ret != LZMA_OK) {
+                throw CompressionError("error while decompressing xz file (error %d)", ret);
+            }
+        }
+
+        if (strm.avail_out == len) {
+            throw EndOfFile("xz stream exhausted");
+        }
+        return len - strm.avail_out;
+    }
+};
+
+struct XzCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    uint8_t outbuf[64 * 1024];
+    lzma_stream strm = LZMA_STREAM_INIT;
+
+    XzCompressionSink(Sink & nextSink, const CompressionOptions & options) : nextSink(nextSink)
+    {
+        uint32_t preset = options.level == COMPRESSION_LEVEL_DEFAULT ? LZMA_PRESET_DEFAULT : options.level;
+        lzma_ret ret;
+        if (options.parallel) {
+            lzma_mt mt{};
+            mt.threads = compressionThreads(options);
+            mt.preset = preset;
+            mt.check = LZMA_CHECK_CRC64;
+            ret = lzma_stream_encoder_mt(&strm, &mt);
+        } else {
+            ret = lzma_easy_encoder(&strm, preset, LZMA_CHECK_CRC64);
+        }
+        if (ret != LZMA_OK) {
+            throw CompressionError("unable to initialise xz encoder (error %d)", ret);
+        }
+    }
+
+    ~XzCompressionSink() override
+    {
+        lzma_end(&strm);
+    }
+
+    void finish() override
+    {
+        flush();
+        process({}, LZMA_FINISH);
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        process(data, LZMA_RUN);
+    }
+
+private:
+    void process(std::string_view data, lzma_action action)
+    {
+        strm.next_in = charptr_cast<const uint8_t *>(data.data());
+        strm.avail_in = data.size();
+
+        while (true) {
+            checkInterrupt();
+
+            strm.next_out = outbuf;
+            strm.avail_out = sizeof(outbuf);
+            auto ret = lzma_code(&strm, action);
+            if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+                throw CompressionError("error while compressing xz file (error %d)", ret);
+            }
+            if (strm.avail_out < sizeof(outbuf)) {
+                nextSink({charptr_cast<const char *>(outbuf), sizeof(outbuf) - strm.avail_out});
+            }
+
+            if (action == LZMA_FINISH ? ret == LZMA_STREAM_END : strm.avail_in == 0) {
+                break;
+            }
+        }
+    }
+};
+
+static size_t checkZstd(size_t result, std::string_view what)
+{
+    if (ZSTD_isError(result)) {
+        throw CompressionError("error while %s zstd file: %s", what, ZSTD_getErrorName(result));
+    }
+    return result;
+}
+
+struct ZstdDecompressionSource : Source
+{
+    std::vector<char> buf;
+    ZSTD_inBuffer in{nullptr, 0, 0};
+    /** Whether the last call to the decoder ended on a frame boundary. */
+    bool frameComplete = true;
+    /** Whether the last call to the decoder may have more output buffered. */
+    bool outputPending = false;
+
+    Source & inner;
+    std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx;
+
+    ZstdDecompressionSource(Source & inner, std::string_view dictionary, bool isPrefix = false)
+        : buf(ZSTD_DStreamInSize())
+        , inner(inner)
+        , ctx{ZSTD_createDCtx(), ZSTD_freeDCtx}
+    {
+        if (!ctx) {
+            throw CompressionError("unable to initialise zstd decoder");
+        }
+        if (isPrefix) {
+            // patches reference all of their base, so their window may be
+            // larger than decoders accept by default
+            checkZstd(
+                ZSTD_DCtx_setParameter(
+                    ctx.get(), ZSTD_d_windowLogMax, ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound
+                ),
+                "setting up for decompressing"
+            );
+            checkZstd(
+                ZSTD_DCtx_refPrefix(ctx.get(), dictionary.data(), dictionary.size()),
+                "loading base for decompressing"
+            );
+        } else if (!dictionary.empty()) {
+            checkZstd(
+                ZSTD_DCtx_loadDictionary(ctx.get(), dictionary.data(), dictionary.size()),
+                "loading dictionary for decompressing"
+            );
+        }
+    }
+
+    size_t read(char * data, size_t len) override
+    {
+        ZSTD_outBuffer out{data, len, 0};
+
+        while (out.pos == 0) {
+            checkInterrupt();
+
+            if (in.pos == in.size && !outputPending) {
+                try {
+                    in = {buf.data(), inner.read(buf.data(), buf.size()), 0};
+                } catch (EndOfFile &) {
+                    if (!frameComplete) {
+                        throw CompressionError("zstd file is truncated");
+                    }
+                    throw;
+                }
+            }
+
+            frameComplete = checkZstd(ZSTD_decompressStream(ctx.get(), &out, &in), "decompressing") == 0;
+            outputPending = out.pos == out.size;
+        }
+
+        return out.pos;
+    }
+};
+
+struct ZstdCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    std::vector<char> outbuf;
+    std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> ctx;
+
+    ZstdCompressionSink(Sink & nextSink, const CompressionOptions & options)
+        : nextSink(nextSink)
+        , outbuf(ZSTD_CStreamOutSize())
+        , ctx{ZSTD_createCCtx(), ZSTD_freeCCtx}
+    {
+        if (!ctx) {
+            throw CompressionError("unable to initialise zstd encoder");
+        }
+        if (options.level != COMPRESSION_LEVEL_DEFAULT) {
+            setParameter(ZSTD_c_compressionLevel, options.level);
+        }
+        if (options.parallel) {
+            auto res = ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_nbWorkers, compressionThreads(options));
+            // libzstd may have been built without threading support
+            if (ZSTD_isError(res)) {
+                debug("compressing zstd on a single thread: %s", ZSTD_getErrorName(res));
+            }
+        }
+        if (options.longWindow) {
+            setParameter(ZSTD_c_enableLongDistanceMatching, 1);
+            // 128 MiB, the largest window decoders accept by default
+            setParameter(ZSTD_c_windowLog, 27);
+        }
+        if (!options.dictionary.empty()) {
+            checkZstd(
+                ZSTD_CCtx_loadDictionary(ctx.get(), options.dictionary.data(), options.dictionary.size()),
+                "loading dictionary for compressing"
+            );
+        }
+        if (!options.patchFrom.empty()) {
+            // like `zstd --patch-from`: the window must reach back over all
+            // of the base, and long distance matching finds matches in it
+            auto bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+            int windowLog = bounds.lowerBound;
+            while (windowLog < bounds.upperBound && (size_t(1) << windowLog) < 2 * options.patchFrom.size()) {
+                windowLog++;
+            }
+            setParameter(ZSTD_c_enableLongDistanceMatching, 1);
+            setParameter(ZSTD_c_windowLog, windowLog);
+            checkZstd(
+                ZSTD_CCtx_refPrefix(ctx.get(), options.patchFrom.data(), options.patchFrom.size()),
+                "loading base for compressing"
+            );
+        }
+    }
+
+    void finish() override
+    {
+        flush();
+        process({}, ZSTD_e_end);
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        process(data, ZSTD_e_continue);
+    }
+
+private:
+    void setParameter(ZSTD_cParameter param, int value)
+    {
+        checkZstd(ZSTD_CCtx_setParameter(ctx.get(), param, value), "setting up for compressing");
+    }
+
+    void process(std::string_view data, ZSTD_EndDirective mode)
+    {
+        ZSTD_inBuffer in{data.data(), data.size(), 0};
+
+        while (true) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out{outbuf.data(), outbuf.size(), 0};
+            auto remaining = checkZstd(ZSTD_compressStream2(ctx.get(), &out, &in, mode), "compressing");
+            if (out.pos > 0) {
+                nextSink({outbuf.data(), out.pos});
+            }
+
+            if (mode == ZSTD_e_end ? remaining == 0 : in.pos == in.size) {
+                break;
+            }
+        }
+    }
+};
+
 std::string decompress(const std::string & method, std::string_view in)
 {
     StringSource src{in};
@@ -221,12 +525,35 @@ std::string decompress(const std::string & method, std::string_view in)
 
 std::unique_ptr<Source> makeDecompressionSource(const std::string & method, Source & inner)
 {
+    return makeDecompressionSource(method, inner, {});
+}
+
+std::unique_ptr<Source>
+makePatchDecompressionSource(const std::string & method, Source & inner, std::string_view base)
+{
+    if (method != "zstd") {
+        throw UnknownCompressionMethod("compression method '%s' does not support patches", method);
+    }
+    return std::make_unique<ZstdDecompressionSource>(inner, base, true);
+}
+
+std::unique_ptr<Source>
+makeDecompressionSource(const std::string & method, Source & inner, std::string_view dictionary)
+{
+    if (!dictionary.empty() && method != "zstd") {
+        throw UnknownCompressionMethod("compression method '%s' does not support dictionaries", method);
+    }
+
     if (method == "none" || method == "") {
         return std::make_unique<LambdaSource>([&](char * data, size_t len) {
             return inner.read(data, len);
         });
     } else if (method == "br") {
         return std::make_unique<BrotliDecompressionSource>(inner);
+    } else if (method == "xz") {
+        return std::make_unique<XzDecompressionSource>(inner);
+    } else if (method == "zstd") {
+        return std::make_unique<ZstdDecompressionSource>(inner, dictionary);
     } else {
         return std::make_unique<ArchiveDecompressionSource>(inner);
     }
@@ -287,24 +614,46 @@ struct BrotliCompressionSink : ChunkedCompressionSink
 
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel, int level)
 {
+    return makeCompressionSink(method, nextSink, {.parallel = parallel, .level = level});
+}
+
+ref<CompressionSink>
+makeCompressionSink(const std::string & method, Sink & nextSink, const CompressionOptions & options)
+{
+    if (!options.dictionary.empty() && method != "zstd") {
+        throw UnknownCompressionMethod("compression method '%s' does not support dictionaries", method);
+    }
+    if (!options.patchFrom.empty() && method != "zstd") {
+        throw UnknownCompressionMethod("compression method '%s' does not support patches", method);
+    }
+
     std::vector<std::string> la_supports = {
-        "bzip2", "compress", "grzip", "gzip", "lrzip", "lz4", "lzip", "lzma", "lzop", "xz", "zstd"
+        "bzip2", "compress", "grzip", "gzip", "lrzip", "lz4", "lzip", "lzma", "lzop"
     };
     if (std::find(la_supports.begin(), la_supports.end(), method) != la_supports.end()) {
-        return make_ref<ArchiveCompressionSink>(nextSink, method, parallel, level);
+        return make_ref<ArchiveCompressionSink>(nextSink, method, options.parallel, options.level);
     }
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliCompressionSink>(nextSink);
+    else if (method == "xz")
+        return make_ref<XzCompressionSink>(nextSink, options);
+    else if (method == "zstd")
+        return make_ref<ZstdCompressionSink>(nextSink, options);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
 
 std::string compress(const std::string & method, std::string_view in, const bool parallel, int level)
+{
+    return compress(method, in, {.parallel = parallel, .level = level});
+}
+
+std::string compress(const std::string & method, std::string_view in, const CompressionOptions & options)
 {
     StringSink ssink;
-    auto sink = makeCompressionSink(method, ssink, parallel, level);
+    auto sink = makeCompressionSink(method, ssink, options);
     (*sink)(in);
     sink->finish();
     return std::move(ssink.s);
@@ -16,14 +16,73 @@ struct CompressionSink : BufferedSink, FinishSink
     using FinishSink::finish;
 };
 
+struct CompressionOptions
+{
+    /**
+     * Compress on several threads, if the method supports it (`xz`, `zstd`).
+     */
+    bool parallel = false;
+
+    /**
+     * Number of threads to use if `parallel` is set, `0` for one per core.
+     * Only honoured by `xz` and `zstd`.
+     */
+    unsigned int threads = 0;
+
+    /**
+     * Compression level, `-1` for the default of the method.
+     */
+    int level = -1;
+
+    /**
+     * `zstd` only: find matches in a 128 MiB window, like `zstd --long`.
+     * Decompressors need no special options to decode the result.
+     */
+    bool longWindow = false;
+
+    /**
+     * `zstd` only: a dictionary (e.g. from `zstd --train`) to compress with.
+     * The same dictionary must be given to `makeDecompressionSource()`.
+     */
+    std::string dictionary;
+
+    /**
+     * `zstd` only: compress against `patchFrom`, like `zstd --patch-from`,
+     * so that data similar to it compresses to a small delta. The same data
+     * must be given to `makePatchDecompressionSource()`. It must outlive the
+     * sink or the call to `compress()`.
+     */
+    std::string_view patchFrom;
+};
+
 std::string decompress(const std::string & method, std::string_view in);
 
 std::unique_ptr<Source> makeDecompressionSource(const std::string & method, Source & inner);
 
+/**
+ * Like `makeDecompressionSource(method, inner)`, but decompresses `zstd`
+ * data that was compressed with `dictionary`.
+ */
+std::unique_ptr<Source>
+makeDecompressionSource(const std::string & method, Source & inner, std::string_view dictionary);
+
+/**
+ * Like `makeDecompressionSource(method, inner)`, but decompresses `zstd`
+ * data that was compressed with `patchFrom = base`. `base` must outlive the
+ * returned source.
+ */
+std::unique_ptr<Source>
+makePatchDecompressionSource(const std::string & method, Source & inner, std::string_view base);
+
 std::string compress(const std::string & method, std::string_view in, const bool parallel = false, int level = -1);
 
+std::string compress(const std::string & method, std::string_view in, const CompressionOptions & options);
+
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false, int level = -1);
 
+ref<CompressionSink>
+makeCompressionSink(const std::string & method, Sink & nextSink, const CompressionOptions & options);
+
 MakeError(UnknownCompressionMethod, Error);
 
 MakeError(CompressionError, Error);
@@ -330,6 +330,11 @@ DirEntries readDirectory(const Path & path)
     return readDirectory(path, true);
 }
 
+DirEntries readDirectory(DIR * dir, const Path & path)
+{
+    return readDirectory(dir, path, true);
+}
+
 
 unsigned char getFileType(const Path & path)
 {
@@ -178,6 +178,12 @@ typedef std::vector<DirEntry> DirEntries;
 
 DirEntries readDirectory(const Path & path);
 
+/**
+ * Read the contents of the open directory `dir`. `path` is only used
+ * in error messages.
+ */
+DirEntries readDirectory(DIR * dir, const Path & path);
+
 unsigned char getFileType(const Path & path);
 
 /**
@@ -1,4 +1,5 @@
 #include <cstring>
+#include <thread>
 
 #include <openssl/evp.h>
 
@@ -9,6 +10,7 @@
 #include "lix/libutil/logging.hh"
 #include "lix/libutil/split.hh"
 #include "lix/libutil/strings.hh"
+#include "lix/libutil/thread-pool.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -373,6 +375,47 @@ HashResult hashPath(HashType ht, const PreparedDump & path)
 }
 
 
+std::vector<Result<HashResult>> hashPaths(const std::vector<std::pair<HashType, Path>> & paths)
+{
+    std::vector<Result<HashResult>> results(paths.size(), result::failure(std::exception_ptr{}));
+
+    auto hashOne = [&](size_t i) {
+        try {
+            results[i] = hashPath(paths[i].first, paths[i].second);
+        } catch (...) {
+            results[i] = result::current_exception();
+        }
+    };
+
+    /* Not worth starting threads for. */
+    if (paths.size() <= 1) {
+        for (size_t i = 0; i < paths.size(); i++) {
+            hashOne(i);
+        }
+        return results;
+    }
+
+    ThreadPool pool{"hashPaths", std::min<size_t>(paths.size(), std::thread::hardware_concurrency())};
+    for (size_t i = 0; i < paths.size(); i++) {
+        pool.enqueue([&, i] { hashOne(i); });
+    }
+    pool.process();
+
+    return results;
+}
+
+
+std::vector<Result<HashResult>> hashPaths(HashType ht, const std::vector<Path> & paths)
+{
+    std::vector<std::pair<HashType, Path>> typed;
+    typed.reserve(paths.size());
+    for (auto & path : paths) {
+        typed.emplace_back(ht, path);
+    }
+    return hashPaths(typed);
+}
+
+
 Hash compressHash(const Hash & hash, unsigned int newSize)
 {
     Hash h(hash.type);
@@ -4,6 +4,7 @@
 #include <openssl/evp.h>
 
 #include "lix/libutil/archive.hh"
+#include "lix/libutil/result.hh"
 #include "lix/libutil/types.hh"
 #include "lix/libutil/serialise.hh"
 #include "lix/libutil/file-system.hh"
@@ -171,6 +172,18 @@ inline HashResult hashPath(HashType ht, Path path)
     return hashPath(ht, *prepareDump(std::move(path)));
 }
 
+/**
+ * Compute `hashPath(type, path)` for each pair in `paths` concurrently, with
+ * one hash context per path on a pool of threads. Element `i` of the result
+ * holds the hash of `paths[i]` or the exception thrown while hashing it.
+ */
+std::vector<Result<HashResult>> hashPaths(const std::vector<std::pair<HashType, Path>> & paths);
+
+/**
+ * Like `hashPaths` above, with the same hash type for all paths.
+ */
+std::vector<Result<HashResult>> hashPaths(HashType ht, const std::vector<Path> & paths);
+
 /**
  * Compress a hash to the specified number of bytes by cyclically
  * XORing bytes together.
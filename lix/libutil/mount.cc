@@ -1,9 +1,28 @@
 #include "lix/libutil/mount.hh"
 #include "lix/libutil/error.hh"
+#include "lix/libutil/file-descriptor.hh"
 #include "lix/libutil/file-system.hh"
 #include "lix/libutil/logging.hh"
 #if __linux__
+#include <fcntl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Not every libc we build against declares these yet. */
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
 
 namespace nix {
 
@@ -38,6 +57,70 @@ void bindPath(const Path & source, const Path & target, bool optional) {
     }
 }
 
+void bindPathsInto(const Path & targetDir, const std::vector<Path> & sources)
+{
+    AutoCloseFD dirFd{open(targetDir.c_str(), O_DIRECTORY | O_PATH | O_CLOEXEC)};
+    if (!dirFd)
+        throw SysError("opening directory '%1%'", targetDir);
+
+    /* Only try the new mount API until the kernel tells us that it
+       does not have it. */
+#if defined(SYS_open_tree) && defined(SYS_move_mount)
+    bool useMountApi = true;
+#else
+    bool useMountApi = false;
+#endif
+
+    for (auto & source : sources) {
+        auto name = std::string(baseNameOf(source));
+        debug("bind mounting '%1%' to '%2%/%3%'", source, targetDir, name);
+
+        struct stat st;
+        if (lstat(source.c_str(), &st) == -1)
+            throw SysError("getting attributes of path '%1%'", source);
+
+        if (S_ISLNK(st.st_mode)) {
+            // Symlinks can (apparently) not be bind-mounted, so just copy it
+            if (symlinkat(readLink(source).c_str(), dirFd.get(), name.c_str()) == -1)
+                throw SysError("creating symlink '%1%/%2%'", targetDir, name);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (mkdirat(dirFd.get(), name.c_str(), 0755) == -1 && errno != EEXIST)
+                throw SysError("creating directory '%1%/%2%'", targetDir, name);
+        } else {
+            AutoCloseFD fd{openat(dirFd.get(), name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666)};
+            if (!fd)
+                throw SysError("creating file '%1%/%2%'", targetDir, name);
+        }
+
+#if defined(SYS_open_tree) && defined(SYS_move_mount)
+        if (useMountApi) {
+            AutoCloseFD tree{static_cast<int>(syscall(
+                SYS_open_tree, AT_FDCWD, source.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE
+            ))};
+            if (tree) {
+                if (syscall(
+                        SYS_move_mount, tree.get(), "", dirFd.get(), name.c_str(), MOVE_MOUNT_F_EMPTY_PATH
+                    ) == -1)
+                {
+                    throw SysError("bind mount from '%1%' to '%2%/%3%' failed", source, targetDir, name);
+                }
+                continue;
+            }
+            if (errno != ENOSYS)
+                throw SysError("cloning the mount tree of '%1%'", source);
+            useMountApi = false;
+        }
+#endif
+
+        auto target = targetDir + "/" + name;
+        if (mount(source.c_str(), target.c_str(), "", MS_BIND | MS_REC, 0) == -1)
+            throw SysError("bind mount from '%1%' to '%2%' failed", source, target);
+    }
+}
+
 }
 
 #endif
@@ -3,6 +3,8 @@
 
 #include "lix/libutil/types.hh"
 
+#include <vector>
+
 #if __linux__
 namespace nix {
 
@@ -12,5 +14,14 @@ namespace nix {
  */
 void bindPath(const Path & source, const Path & target, bool optional = false);
 
+/**
+ * Bind-mount each of `sources` into the directory `targetDir` under its
+ * base name, e.g. to populate the store of a sandbox with the closure of
+ * the inputs of a build. Unlike `bindPath` this opens `targetDir` only
+ * once and creates the mount points relative to it, and it uses
+ * `open_tree(2)` and `move_mount(2)` if the kernel supports them.
+ */
+void bindPathsInto(const Path & targetDir, const std::vector<Path> & sources);
+
 }
 #endif
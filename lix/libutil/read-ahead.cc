@@ -0,0 +1,104 @@
+#include "lix/libutil/read-ahead.hh"
+#include "lix/libutil/signals.hh"
+#include "lix/libutil/thread-name.hh"
+
+#include <cstring>
+
+namespace nix {
+
+/**
+ * How much to read from the inner source at once.
+ */
+static constexpr size_t chunkSize = 256 * 1024;
+
+ReadAheadSource::ReadAheadSource(box_ptr<Source> inner, size_t maxBuffered)
+    : inner(std::move(inner))
+    , maxBuffered(std::max(maxBuffered, chunkSize))
+{
+    thread = std::thread([this] { run(); });
+}
+
+ReadAheadSource::~ReadAheadSource()
+{
+    state_.lock()->quit = true;
+    consumed.notify_one();
+    // the thread may be blocked in `inner->read()`, e.g. waiting for a
+    // transfer that will never make progress. it only checks `quit` after
+    // the read returns, so make sure that happens before joining it.
+    try {
+        inner->cancel();
+    } catch (...) {
+        ignoreExceptionInDestructor();
+    }
+    thread.join();
+}
+
+void ReadAheadSource::cancel()
+{
+    inner->cancel();
+}
+
+void ReadAheadSource::run()
+{
+    setCurrentThreadName("read-ahead");
+    ReceiveInterrupts receiveInterrupts;
+
+    while (true) {
+        std::string chunk(chunkSize, 0);
+        std::exception_ptr exception;
+        bool done = false;
+
+        try {
+            chunk.resize(inner->read(chunk.data(), chunk.size()));
+        } catch (EndOfFile &) {
+            done = true;
+        } catch (...) {
+            exception = std::current_exception();
+        }
+
+        auto state(state_.lock());
+        while (state->buffered >= maxBuffered && !state->quit)
+            state.wait(consumed);
+        if (state->quit)
+            return;
+
+        if (done || exception) {
+            state->done = true;
+            state->exception = exception;
+            produced.notify_one();
+            return;
+        }
+
+        state->buffered += chunk.size();
+        state->chunks.push_back(std::move(chunk));
+        produced.notify_one();
+    }
+}
+
+size_t ReadAheadSource::read(char * data, size_t len)
+{
+    if (currentPos == current.size()) {
+        auto state(state_.lock());
+        while (state->chunks.empty() && !state->done)
+            state.wait(produced);
+
+        if (state->chunks.empty()) {
+            if (state->exception)
+                std::rethrow_exception(state->exception);
+            throw EndOfFile("end of read-ahead source");
+        }
+
+        current = std::move(state->chunks.front());
+        currentPos = 0;
+        state->chunks.pop_front();
+        state->buffered -= current.size();
+        consumed.notify_one();
+    }
+
+    auto n = std::min(len, current.size() - currentPos);
+    std::memcpy(data, current.data() + currentPos, n);
+    currentPos += n;
+    return n;
+}
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+///@file
+
+#include "lix/libutil/box_ptr.hh"
+#include "lix/libutil/serialise.hh"
+#include "lix/libutil/sync.hh"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <thread>
+
+namespace nix {
+
+/**
+ * A source that reads another source on a thread of its own, staying up to
+ * `maxBuffered` bytes ahead of its reader. This lets a slow reader and a
+ * slow inner source (e.g. a decompressor) work at the same time.
+ *
+ * Errors of the inner source are rethrown by `read()` once the data read
+ * before them has been consumed. Destroying the source cancels the inner
+ * source so a read it is blocked in does not keep the destructor waiting.
+ */
+class ReadAheadSource : public Source
+{
+    struct State
+    {
+        std::deque<std::string> chunks;
+        size_t buffered = 0;
+        bool done = false;
+        bool quit = false;
+        std::exception_ptr exception;
+    };
+
+    box_ptr<Source> inner;
+    const size_t maxBuffered;
+
+    Sync<State> state_;
+    std::condition_variable produced, consumed;
+
+    /**
+     * The chunk currently being read, only accessed by the reader.
+     */
+    std::string current;
+    size_t currentPos = 0;
+
+    std::thread thread;
+
+    void run();
+
+public:
+    ReadAheadSource(box_ptr<Source> inner, size_t maxBuffered);
+
+    ~ReadAheadSource();
+
+    size_t read(char * data, size_t len) override;
+
+    void cancel() override;
+};
+
+}
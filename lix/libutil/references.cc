@@ -2,46 +2,213 @@
 #include "lix/libutil/hash.hh"
 #include "lix/libutil/logging.hh"
 
-#include <cstdlib>
-#include <mutex>
 #include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 
 namespace nix {
 
 
-static size_t refLength = 32; /* characters */
+static constexpr size_t refLength = std::tuple_size_v<RefScanSink::Ref>; /* characters */
+
+
+namespace refscan_detail {
+
+uint64_t classifyScalar(const char * data, size_t len)
+{
+    /* base32Chars lives in another translation unit, so this must not be
+       initialised before main(). */
+    static const auto isBase32 = [] {
+        std::array<bool, 256> table{};
+        for (auto c : base32Chars)
+            table[(unsigned char) c] = true;
+        return table;
+    }();
+
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; ++i)
+        mask |= uint64_t(isBase32[(unsigned char) data[i]]) << i;
+    return mask;
+}
+
+/* The vector implementations check for [0-9a-z] and then remove the four
+   letters that are not in base32Chars (e, o, t, u). */
+
+#if defined(__x86_64__)
+
+static uint64_t classifySse2(const char * data)
+{
+    uint64_t mask = 0;
+    for (int block = 0; block < 4; ++block) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * block));
+        /* Signed comparisons are fine: bytes >= 0x80 are negative and thus
+           out of both ranges. */
+        auto digit = _mm_and_si128(
+            _mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))
+        );
+        auto lower = _mm_and_si128(
+            _mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1))
+        );
+        auto excluded = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('e')), _mm_cmpeq_epi8(v, _mm_set1_epi8('o'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('t')), _mm_cmpeq_epi8(v, _mm_set1_epi8('u')))
+        );
+        auto valid = _mm_or_si128(digit, _mm_andnot_si128(excluded, lower));
+        mask |= uint64_t(uint16_t(_mm_movemask_epi8(valid))) << (16 * block);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"))) static uint64_t classifyAvx2(const char * data)
+{
+    uint64_t mask = 0;
+    for (int block = 0; block < 2; ++block) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32 * block));
+        auto digit = _mm256_and_si256(
+            _mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v)
+        );
+        auto lower = _mm256_and_si256(
+            _mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v)
+        );
+        auto excluded = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('e')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('o'))
+            ),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('t')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('u'))
+            )
+        );
+        auto valid = _mm256_or_si256(digit, _mm256_andnot_si256(excluded, lower));
+        mask |= uint64_t(uint32_t(_mm256_movemask_epi8(valid))) << (32 * block);
+    }
+    return mask;
+}
+
+#elif defined(__aarch64__)
+
+static uint64_t classifyNeon(const char * data)
+{
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    auto bitWeights = vld1q_u8(weights);
+
+    uint64_t mask = 0;
+    for (int block = 0; block < 4; ++block) {
+        auto v = vld1q_u8(reinterpret_cast<const uint8_t *>(data + 16 * block));
+        auto digit = vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(9));
+        auto lower = vcleq_u8(vsubq_u8(v, vdupq_n_u8('a')), vdupq_n_u8(25));
+        auto excluded = vorrq_u8(
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8('e')), vceqq_u8(v, vdupq_n_u8('o'))),
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8('t')), vceqq_u8(v, vdupq_n_u8('u')))
+        );
+        auto valid = vorrq_u8(digit, vbicq_u8(lower, excluded));
+        /* There is no movemask on NEON; weigh each lane by its bit and add
+           up the lanes of each half instead. */
+        auto bits = vandq_u8(valid, bitWeights);
+        uint64_t blockMask = vaddv_u8(vget_low_u8(bits)) | (uint64_t(vaddv_u8(vget_high_u8(bits))) << 8);
+        mask |= blockMask << (16 * block);
+    }
+    return mask;
+}
+
+#endif
+
+using Classifier = uint64_t (*)(const char *);
+
+static Classifier pickClassifier()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return classifyAvx2;
+    return classifySse2;
+#elif defined(__aarch64__)
+    return classifyNeon;
+#else
+    return [](const char * data) { return classifyScalar(data, 64); };
+#endif
+}
+
+static const Classifier bestClassifier = pickClassifier();
+
+uint64_t classify(const char * data)
+{
+    return bestClassifier(data);
+}
+
+uint64_t refStarts(uint64_t current, uint64_t next)
+{
+    static_assert(refLength == 32);
+    /* `m &= m >> k` on the 128 bit number, done on two words since not
+       all 32 bit targets have a 128 bit integer type. */
+    auto lo = current, hi = next;
+    for (size_t k = 1; k < refLength; k *= 2) {
+        lo &= (lo >> k) | (hi << (64 - k));
+        hi &= hi >> k;
+    }
+    return lo;
+}
+
+}
 
 
 static void search(
     std::string_view s,
-    StringSet & hashes,
+    std::unordered_set<RefScanSink::Ref, RefScanSink::RefHash> & hashes,
     StringSet & seen)
 {
-    static std::once_flag initialised;
-    static bool isBase32[256];
-    std::call_once(initialised, [](){
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < base32Chars.size(); ++i)
-            isBase32[(unsigned char) base32Chars[i]] = true;
-    });
-
-    for (size_t i = 0; i + refLength <= s.size(); ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
-                break;
+    auto blockMask = [&](size_t offset) -> uint64_t {
+        if (offset >= s.size()) return 0;
+        if (s.size() - offset >= 64) return refscan_detail::classify(s.data() + offset);
+        /* Bits past the end stay clear, so no reference can overhang. */
+        return refscan_detail::classifyScalar(s.data() + offset, s.size() - offset);
+    };
+
+    uint64_t current = blockMask(0);
+    for (size_t offset = 0; offset < s.size() && !hashes.empty(); offset += 64) {
+        uint64_t next = blockMask(offset + 64);
+
+        for (auto starts = refscan_detail::refStarts(current, next); starts; starts &= starts - 1) {
+            auto i = offset + std::countr_zero(starts);
+            RefScanSink::Ref ref;
+            std::copy_n(s.data() + i, refLength, ref.begin());
+            if (hashes.erase(ref)) {
+                std::string found(ref.begin(), ref.end());
+                debug("found reference to '%1%' at offset '%2%'", found, i);
+                seen.insert(std::move(found));
             }
-        if (!match) continue;
-        std::string ref(s.substr(i, refLength));
-        if (hashes.erase(ref)) {
-            debug("found reference to '%1%' at offset '%2%'", ref, i);
-            seen.insert(ref);
         }
-        ++i;
+
+        current = next;
+    }
+}
+
+
+size_t RefScanSink::RefHash::operator()(const Ref & ref) const noexcept
+{
+    /* Hash parts are (supposed to be) random, so a few bytes suffice. */
+    uint64_t h;
+    std::memcpy(&h, ref.data(), sizeof(h));
+    return (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL;
+}
+
+
+RefScanSink::RefScanSink(StringSet && hashes)
+{
+    for (auto & hash : hashes) {
+        if (hash.size() != refLength) continue;
+        Ref ref;
+        std::copy_n(hash.begin(), refLength, ref.begin());
+        this->hashes.insert(ref);
     }
 }
 
@@ -153,14 +320,42 @@ size_t RewritingSource::read(char * data, size_t len)
     return len;
 }
 
-HashResult computeHashModulo(HashType ht, const std::string & modulus, Source & source)
+HashModuloSink::HashModuloSink(HashType ht, std::string modulus)
+    : hashSink(ht)
+    , modulus(std::move(modulus))
 {
-    HashSink hashSink(ht);
-    LengthSink lengthSink;
-    RewritingSource rewritingSource(modulus, std::string(modulus.size(), 0), source);
+    assert(!this->modulus.empty());
+}
 
-    TeeSink tee{hashSink, lengthSink};
-    rewritingSource.drainInto(tee);
+void HashModuloSink::forward(size_t len)
+{
+    hashSink({pending.data(), len});
+    length += len;
+    pending.erase(0, len);
+}
+
+void HashModuloSink::operator()(std::string_view data)
+{
+    pending.append(data);
+
+    /* Replace matches left to right without overlaps, like
+       RewritingSource does. */
+    size_t matchEnd = 0;
+    for (size_t pos = 0; (pos = pending.find(modulus, pos)) != std::string::npos; ) {
+        std::fill_n(pending.begin() + pos, modulus.size(), 0);
+        pos += modulus.size();
+        matchEnd = pos;
+    }
+
+    /* Keep back what may be the start of a match spanning into the next
+       write. */
+    auto keep = std::min(pending.size() - matchEnd, modulus.size() - 1);
+    forward(pending.size() - keep);
+}
+
+HashResult HashModuloSink::finish()
+{
+    forward(pending.size());
 
     /* Hash the positions of the self-references. This ensures that a
        NAR with self-references and a NAR with some of the
@@ -170,8 +365,14 @@ HashResult computeHashModulo(HashType ht, const std::string & modulus, Source &
     //for (auto & pos : rewritingSource.matches)
     //    hashSink(fmt("|%d", pos));
 
-    auto h = hashSink.finish();
-    return {h.first, lengthSink.length};
+    return {hashSink.finish().first, length};
+}
+
+HashResult computeHashModulo(HashType ht, const std::string & modulus, Source & source)
+{
+    HashModuloSink sink(ht, modulus);
+    source.drainInto(sink);
+    return sink.finish();
 }
 
 }
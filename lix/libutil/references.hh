@@ -3,19 +3,61 @@
 
 #include "lix/libutil/hash.hh"
 
+#include <array>
+#include <cstdint>
+#include <unordered_set>
+
 namespace nix {
 
+namespace refscan_detail {
+
+/**
+ * @return A mask with bit `i` set iff `data[i]` is a base-32 character, for
+ * all `i < len <= 64`. Portable reference implementation.
+ */
+uint64_t classifyScalar(const char * data, size_t len);
+
+/**
+ * Same as `classifyScalar(data, 64)`, using the fastest implementation the
+ * CPU supports (AVX2 or SSE2 on x86_64, NEON on aarch64).
+ */
+uint64_t classify(const char * data);
+
+/**
+ * @return A mask with bit `i` set iff bits `i` to `i + 31` of the 128 bit
+ * number `next:current` are all set, i.e. iff a run of base-32 characters
+ * long enough for a reference starts at `i`.
+ */
+uint64_t refStarts(uint64_t current, uint64_t next);
+
+}
+
 class RefScanSink : public Sink
 {
-    StringSet hashes;
+public:
+    /**
+     * A hash part of a store path, which is what is scanned for.
+     */
+    using Ref = std::array<char, 32>;
+
+    struct RefHash
+    {
+        size_t operator()(const Ref & ref) const noexcept;
+    };
+
+private:
+    std::unordered_set<Ref, RefHash> hashes;
     StringSet seen;
 
     std::string tail;
 
 public:
 
-    RefScanSink(StringSet && hashes) : hashes(hashes)
-    { }
+    /**
+     * @param hashes The hash parts to look for. Strings of any length but
+     * that of a hash part can never be found.
+     */
+    RefScanSink(StringSet && hashes);
 
     StringSet & getResult()
     { return seen; }
@@ -43,6 +85,30 @@ struct RewritingSource : Source
     size_t read(char * data, size_t len) override;
 };
 
+/**
+ * Hashes the data written to it with all occurrences of `modulus` replaced by
+ * zeroes, like `computeHashModulo` does for sources.
+ */
+class HashModuloSink : public Sink
+{
+    HashSink hashSink;
+    std::string modulus;
+    std::string pending;
+    uint64_t length = 0;
+
+    void forward(size_t len);
+
+public:
+    HashModuloSink(HashType ht, std::string modulus);
+
+    void operator()(std::string_view data) override;
+
+    /**
+     * @return The hash and the length of the data written.
+     */
+    HashResult finish();
+};
+
 HashResult computeHashModulo(HashType ht, const std::string & modulus, Source & source);
 
 }
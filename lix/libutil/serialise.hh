@@ -87,6 +87,13 @@ struct Source
 
     virtual bool good() { return true; }
 
+    /**
+     * Make a `read()` that is blocked on another thread give up, usually by
+     * throwing. Sources that wrap other sources should forward this. Sources
+     * whose reads cannot block indefinitely need not implement it.
+     */
+    virtual void cancel() {}
+
     void drainInto(Sink & sink);
 
     std::string drain();
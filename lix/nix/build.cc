@@ -1,10 +1,13 @@
 #include "lix/libcmd/command.hh"
 #include "lix/libmain/common-args.hh"
 #include "lix/libmain/shared.hh"
+#include "lix/libstore/build-events.hh"
+#include "lix/libstore/globals.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libstore/local-fs-store.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/json.hh"
+#include "lix/libutil/strings.hh"
 #include "build.hh"
 
 namespace nix {
@@ -37,6 +40,10 @@ static JSON builtPathsWithResultToJSON(
                     j["cpuUser"] = ((double) b.result->cpuUser->count()) / 1000000;
                 if (b.result->cpuSystem)
                     j["cpuSystem"] = ((double) b.result->cpuSystem->count()) / 1000000;
+                if (b.result->memoryPeak)
+                    j["memoryPeak"] = *b.result->memoryPeak;
+                if (b.result->sandboxSetup)
+                    j["sandboxSetup"] = ((double) b.result->sandboxSetup->count()) / 1000000;
             }
             res.push_back(j);
         }, b.path.raw());
@@ -72,10 +79,65 @@ static void createOutLinks(
     }
 }
 
+static std::string showDuration(std::chrono::microseconds duration)
+{
+    return fmt("%.1fs", ((double) duration.count()) / 1000000);
+}
+
+static void printBuildReport(
+    const Store & store,
+    const std::vector<BuiltPathWithResult> & buildables,
+    const Path & eventLog,
+    std::chrono::system_clock::time_point since
+)
+{
+    std::set<std::string> roots;
+    for (auto & b : buildables) {
+        std::visit(overloaded {
+            [&](const BuiltPath::Opaque & bo) {
+                roots.insert(store.printStorePath(bo.path));
+            },
+            [&](const BuiltPath::Built & bfd) {
+                roots.insert(store.printStorePath(bfd.drvPath->outPath()));
+                for (auto & output : bfd.outputs)
+                    roots.insert(store.printStorePath(output.second));
+            },
+        }, b.path.raw());
+    }
+
+    auto report = BuildReport::compute(readBuildEvents(eventLog, since), roots);
+
+    if (report.criticalPath.empty()) {
+        notice("nothing was built or substituted");
+        return;
+    }
+
+    std::string out = "time spent in each phase:\n";
+    for (auto & [phase, time] : report.phaseTotals)
+        out += fmt("  %-20s %s\n", showBuildPhase(phase), showDuration(time));
+
+    auto & first = report.criticalPath.front();
+    auto & last = report.criticalPath.back();
+    out += fmt("critical path (%s):\n",
+        showDuration(std::chrono::duration_cast<std::chrono::microseconds>(last.end - first.start)));
+    for (auto & step : report.criticalPath) {
+        std::vector<std::string> phases;
+        for (auto & [phase, time] : step.phases)
+            phases.push_back(fmt("%s %s", showBuildPhase(phase), showDuration(time)));
+        out += fmt("  %8s  %s (%s)\n",
+            showDuration(std::chrono::duration_cast<std::chrono::microseconds>(step.end - step.start)),
+            step.path,
+            concatStringsSep(", ", phases));
+    }
+
+    notice("%s", chomp(out));
+}
+
 struct CmdBuild : InstallablesCommand, MixDryRun, MixJSON, MixProfile
 {
     Path outLink = "result";
     bool printOutputPaths = false;
+    bool report = false;
     BuildMode buildMode = bmNormal;
 
     CmdBuild()
@@ -101,6 +163,13 @@ struct CmdBuild : InstallablesCommand, MixDryRun, MixJSON, MixProfile
             .handler = {&printOutputPaths, true},
         });
 
+        addFlag({
+            .longName = "report",
+            .description = "After building, print how much time was spent in each phase of the builds and substitutions, "
+                "and which of them held up the build the most. Requires the `build-event-log` setting.",
+            .handler = {&report, true},
+        });
+
         addFlag({
             .longName = "rebuild",
             .description = "Rebuild an already built package and compare the result to the existing store paths.",
@@ -139,6 +208,11 @@ struct CmdBuild : InstallablesCommand, MixDryRun, MixJSON, MixProfile
             return;
         }
 
+        auto & eventLog = settings.buildEventLog.get();
+        if (report && !eventLog)
+            throw UsageError("'--report' requires the 'build-event-log' setting");
+        auto buildStart = std::chrono::system_clock::now();
+
         auto buildables = Installable::build(
             *state, getEvalStore(), store,
             Realise::Outputs,
@@ -147,6 +221,9 @@ struct CmdBuild : InstallablesCommand, MixDryRun, MixJSON, MixProfile
 
         if (json) logger->cout("%s", builtPathsWithResultToJSON(aio(), buildables, *store).dump());
 
+        if (report)
+            printBuildReport(*store, buildables, *eventLog, buildStart);
+
         if (outLink != "")
             if (auto store2 = store.try_cast_shared<LocalFSStore>())
                 createOutLinks(aio(), outLink, buildables, *store2);
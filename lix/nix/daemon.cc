@@ -3,6 +3,7 @@
 #include "lix/libcmd/command.hh"
 #include "lix/libmain/shared.hh"
 #include "lix/libstore/local-store.hh"
+#include "lix/libstore/valid-path-graph.hh"
 #include "lix/libstore/remote-store.hh"
 #include "lix/libstore/remote-store-connection.hh"
 #include "lix/libutil/serialise.hh"
@@ -28,6 +29,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
@@ -277,7 +279,9 @@ static std::pair<TrustedFlag, std::string> authPeer(const PeerInfo & peer)
  * and user credentials (from the unix domain socket).
  */
 static void daemonLoop(AsyncIoRoot & aio, std::optional<TrustedFlag> forceTrustClientOpt);
-static void daemonLoopImpl(std::optional<TrustedFlag> forceTrustClientOpt)
+static void daemonLoopImpl(
+    std::optional<TrustedFlag> forceTrustClientOpt, std::shared_ptr<ValidPathGraph> pathGraph
+)
 {
     if (chdir("/") == -1)
         throw SysError("cannot change current directory");
@@ -306,6 +310,21 @@ static void daemonLoopImpl(std::optional<TrustedFlag> forceTrustClientOpt)
     while (1) {
 
         try {
+            //  Keep the path graph current while there is nothing to do,
+            //  so that connection handlers inherit a recent copy without
+            //  having to wait for the database themselves.
+            if (pathGraph) {
+                pollfd pfd = {.fd = fdSocket.get(), .events = POLLIN};
+                auto ready = poll(&pfd, 1, 1000);
+                checkInterrupt();
+                if (ready == -1 && errno != EINTR)
+                    throw SysError("waiting for connections");
+                if (ready <= 0) {
+                    pathGraph->refresh();
+                    continue;
+                }
+            }
+
             //  Accept a connection.
             struct sockaddr_un remoteAddr;
             socklen_t remoteAddrLen = sizeof(remoteAddr);
@@ -337,6 +356,10 @@ static void daemonLoopImpl(std::optional<TrustedFlag> forceTrustClientOpt)
                 peer.pidKnown ? std::to_string(peer.pid) : "<unknown>",
                 peer.uidKnown ? user : "<unknown>");
 
+            //  The child inherits the path graph, but not its connection.
+            if (pathGraph)
+                pathGraph->disconnect();
+
             //  Fork a child to handle the connection.
             ProcessOptions options;
             options.errorPrefix = "unexpected Nix daemon error: ";
@@ -393,9 +416,22 @@ static void daemonLoop(AsyncIoRoot & aio, std::optional<TrustedFlag> forceTrustC
     // asserts after the kqueue close returns EBADF we'll die. the least awful
     // way around this is to run the daemon loop in its own thread, without an
     // async io root, and thus not have any shared state after we have forked.
+
+    // with `path-graph-cache`, load the path graph of a local store once up
+    // front. connection handlers open their own store, but find the graph in
+    // the memory they inherited from us instead of loading it again. the
+    // store itself is closed again, since its database connection must not
+    // be shared with the children.
+    std::shared_ptr<ValidPathGraph> pathGraph;
+    if (settings.pathGraphCache) {
+        auto store = aio.blockOn(openUncachedStore()).try_cast_shared<LocalStore>();
+        if (store)
+            pathGraph = store->getPathGraph();
+    }
+
     std::async(std::launch::async, [&] {
         ReceiveInterrupts ri;
-        return daemonLoopImpl(forceTrustClientOpt);
+        return daemonLoopImpl(forceTrustClientOpt, pathGraph);
     }).get();
 }
 
@@ -1,4 +1,5 @@
 #include "lix/libcmd/command.hh"
+#include "lix/libstore/local-fs-store.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libutil/archive.hh"
 #include "dump-path.hh"
@@ -23,7 +24,13 @@ struct CmdDumpPath : StorePathCommand
     {
         logger->pause();
         FdSink sink(STDOUT_FILENO);
-        aio().blockOn(store->narFromPath(storePath))->drainInto(sink);
+        if (auto localFS = store.try_cast_shared<LocalFSStore>()) {
+            if (!aio().blockOn(store->isValidPath(storePath)))
+                throw Error("path '%s' does not exist in store", store->printStorePath(storePath));
+            dumpPath(localFS->toRealPath(store->printStorePath(storePath)), sink);
+        } else {
+            aio().blockOn(store->narFromPath(storePath))->drainInto(sink);
+        }
         sink.flush();
     }
 };
@@ -57,7 +64,7 @@ struct CmdDumpPath2 : Command
     {
         logger->pause();
         FdSink sink(STDOUT_FILENO);
-        sink << dumpPath(path);
+        dumpPath(path, sink);
         sink.flush();
     }
 };
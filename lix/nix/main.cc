@@ -57,6 +57,7 @@
 #include "run.hh"
 #include "search.hh"
 #include "sigs.hh"
+#include "store-add-delta.hh"
 #include "store-copy-log.hh"
 #include "store-delete.hh"
 #include "store-gc.hh"
@@ -125,6 +126,7 @@ void registerCommands()
     registerNixSigs();
     registerNixStore();
     registerNixStoreAdd();
+    registerNixStoreAddDelta();
     registerNixStoreCopyLog();
     registerNixStoreDelete();
     registerNixStoreDiffClosures();
@@ -0,0 +1,58 @@
+#include "lix/libcmd/command.hh"
+#include "lix/libmain/shared.hh"
+#include "lix/libstore/binary-cache-store.hh"
+#include "lix/libstore/store-api.hh"
+#include "lix/libstore/store-cast.hh"
+#include "store-add-delta.hh"
+
+namespace nix {
+
+struct CmdStoreAddDelta : StorePathsCommand
+{
+    std::string base;
+
+    CmdStoreAddDelta()
+    {
+        addFlag({
+            .longName = "base",
+            .description = "The store path to compute the deltas against.",
+            .labels = {"store-path"},
+            .handler = {&base},
+            .completer = completePath,
+        });
+    }
+
+    std::string description() override
+    {
+        return "publish binary deltas of store paths in a binary cache";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-add-delta.md"
+          ;
+    }
+
+    void run(ref<Store> store, StorePaths && storePaths) override
+    {
+        if (base.empty())
+            throw UsageError("you must specify a base path using '--base'");
+
+        auto & binaryCache = require<BinaryCacheStore>(*store);
+        auto basePath = store->followLinksToStorePath(base);
+
+        for (auto & storePath : storePaths) {
+            if (storePath == basePath)
+                continue;
+            aio().blockOn(binaryCache.addDelta(storePath, basePath));
+        }
+    }
+};
+
+void registerNixStoreAddDelta()
+{
+    registerCommand2<CmdStoreAddDelta>({"store", "add-delta"});
+}
+
+}
@@ -0,0 +1,7 @@
+#pragma once
+/// @file
+namespace nix {
+
+void registerNixStoreAddDelta();
+
+}
@@ -61,6 +61,7 @@
   utillinuxMinimal ? null,
   xz,
   yq,
+  zstd,
 
   busybox-sandbox-shell,
 
@@ -318,6 +319,7 @@ stdenv.mkDerivation (finalAttrs: {
       curl
       bzip2
       xz
+      zstd
       brotli
       editline-lix
       openssl
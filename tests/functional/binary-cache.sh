@@ -237,6 +237,121 @@ diff -u \
     <(echo '{"version":1,"root":{"type":"directory","entries":{"bar":{"type":"regular","size":4,"narOffset":232},"link":{"type":"symlink","target":"xyzzy"}}}}' | jq -S)
 
 
+# Test reading single files from seekable NARs.
+clearCache
+
+outPath=$(nix-build --no-out-link -E '
+  with import ./config.nix;
+  mkDerivation {
+    name = "seekable-nar";
+    buildCommand = "mkdir $out; echo foo > $out/head; seq 1 500000 > $out/big; echo bar > $out/tail";
+  }
+')
+
+nix copy --to "file://$cacheDir?compression=zstd&write-seekable-nar=1" $outPath
+[[ $(jq '.frames | length' < $cacheDir/$(basename $outPath | cut -c1-32).ls) -gt 1 ]]
+
+# Seekable NARs are still ordinary zstd files.
+cmp <(nix store dump-path --store file://$cacheDir $outPath) <(nix-store --dump $outPath)
+
+# Reading a file only fetches the frames containing it, so it still works
+# if the other frames are corrupt.
+nar=$(ls $cacheDir/nar/*.nar.zst)
+printf XXXX | dd of=$nar bs=1 count=4 conv=notrunc
+[[ $(nix store cat --store file://$cacheDir $outPath/tail) = bar ]]
+(! nix store cat --store file://$cacheDir $outPath/head)
+
+# Uncompressed NARs with a listing are seekable as well.
+clearCache
+nix copy --to "file://$cacheDir?compression=none&write-seekable-nar=1" $outPath
+diff <(nix store cat --store file://$cacheDir $outPath/big) $outPath/big
+
+clearCache
+expect 1 nix copy --to "file://$cacheDir?compression=xz&write-seekable-nar=1" $outPath 2>&1 | grepQuiet "not supported with compression method 'xz'"
+
+
+# Test chunked NARs.
+clearCache
+
+chunkedPath() {
+  nix-build --no-out-link -E '
+    with import ./config.nix;
+    mkDerivation {
+      name = "chunked-nar-'$1'";
+      buildCommand = "mkdir $out; seq 1 1000000 > $out/big; echo '$1' > $out/small";
+    }
+  '
+}
+outPath=$(chunkedPath 1)
+outPath2=$(chunkedPath 2)
+
+nix copy --to "file://$cacheDir?compression=zstd&write-chunked-nars=1&write-plain-nars=0" $outPath
+narinfo=$cacheDir/$(basename $outPath | cut -c1-32).narinfo
+grepQuiet "Compression: chunked" $narinfo
+(( $(ls $cacheDir/chunks | wc -l) > 1 ))
+[[ -z $(ls $cacheDir/nar | grep -v '\.chunks$') ]]
+
+# A similar path shares most of its chunks.
+chunksBefore=$(ls $cacheDir/chunks | wc -l)
+nix copy --to "file://$cacheDir?compression=zstd&write-chunked-nars=1&write-plain-nars=0" $outPath2
+(( $(ls $cacheDir/chunks | wc -l) <= chunksBefore + 2 ))
+
+cmp <(nix store dump-path --store file://$cacheDir $outPath2) <(nix-store --dump $outPath2)
+
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+[[ $(cat $outPath/small) = 1 ]]
+
+# Plain NARs are kept for older clients by default.
+clearCache
+outPath=$(chunkedPath 1)
+nix copy --to "file://$cacheDir?compression=zstd&write-chunked-nars=1" $outPath
+narinfo=$cacheDir/$(basename $outPath | cut -c1-32).narinfo
+grepQuiet "Compression: zstd" $narinfo
+[[ -e $cacheDir/$(grep "^Chunks: " $narinfo | cut -d' ' -f2) ]]
+
+
+# Test binary deltas.
+clearCache
+outPath=$(chunkedPath 1)
+outPath2=$(chunkedPath 2)
+
+nix copy --to "file://$cacheDir?compression=zstd" $outPath $outPath2
+nix store add-delta --store "file://$cacheDir" --base $outPath $outPath2
+narinfo2=$cacheDir/$(basename $outPath2 | cut -c1-32).narinfo
+grepQuiet "^Delta: $(basename $outPath) " $narinfo2
+(( $(stat -c %s $cacheDir/$(grep "^Delta: " $narinfo2 | cut -d' ' -f4)) < 1000 ))
+
+# Without the base, the full NAR is substituted...
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath2
+[[ $(cat $outPath2/small) = 2 ]]
+
+# ...and with it, only the delta.
+clearStore
+clearCacheCache
+rm $cacheDir/$(grep "^URL: " $narinfo2 | cut -d' ' -f2)
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath2
+[[ $(cat $outPath2/small) = 2 ]]
+
+expect 1 nix store add-delta --base $outPath $outPath2 2>&1 | grepQuiet "not supported by store"
+
+
+# NARs are written into the cache while they are compressed and renamed into
+# place, so no temporary files are left behind.
+clearCache
+outPath=$(chunkedPath 1)
+nix copy --to "file://$cacheDir" $outPath
+[[ -z $(ls $cacheDir/nar | grep '\.tmp\.') ]]
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+[[ $(cat $outPath/small) = 1 ]]
+
+
 # Test debug info index generation.
 clearCache
 
@@ -254,6 +369,26 @@ diff -u \
     <(cat $cacheDir/debuginfo/02623eda209c26a59b1a8638ff7752f6b945c26b.debug | jq -S) \
     <(echo '{"archive":"../nar/100vxs724qr46phz8m24iswmg9p3785hsyagz0kchf6q6gf06sw6.nar","member":"lib/debug/.build-id/02/623eda209c26a59b1a8638ff7752f6b945c26b.debug"}' | jq -S)
 
+
+# Test narinfo index generation.
+clearCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to "file://$cacheDir?write-narinfo-index=1" $outPath
+[[ -s $cacheDir/narinfo-index ]]
+
+# Copying doesn't trust the index, so a path whose narinfo has
+# disappeared behind its back is copied again.
+input2Narinfo=$(grep -l "StorePath:.*dependencies-input-2" $cacheDir/*.narinfo)
+rm $input2Narinfo
+nix copy --to "file://$cacheDir" $outPath
+[[ -e $input2Narinfo ]]
+
+# Substituting from a cache with an index still works.
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+
 # Test against issue https://github.com/NixOS/nix/issues/3964
 #
 expr='
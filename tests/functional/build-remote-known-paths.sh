@@ -0,0 +1,54 @@
+source common.sh
+
+requireSandboxSupport
+[[ $busybox =~ busybox ]] || skipTest "no busybox"
+
+# Avoid store dir being inside sandbox build-dir
+unset NIX_STORE_DIR
+unset NIX_STATE_DIR
+
+chmod -R +w $TEST_ROOT/machine* || true
+rm -rf $TEST_ROOT/machine* || true
+
+builders="ssh://localhost?remote-store=$TEST_ROOT/machine1?system-features=foo - - 1 1 foo"
+
+build() {
+    nix build -L -f build-hook.nix passthru.input1 --no-link --print-out-paths --max-jobs 0 \
+      --arg busybox $busybox \
+      --store $TEST_ROOT/machine0 \
+      --builders "$builders" \
+      --debug \
+      "$@" 2>&1
+}
+
+knownInputs() {
+    local re='([0-9]+) of ([0-9]+) inputs are known'
+    [[ $1 =~ $re ]] || fail "no known inputs message in: $1"
+    echo "${BASH_REMATCH[1]} ${BASH_REMATCH[2]}"
+}
+
+outPath() {
+    nix path-info --store $TEST_ROOT/machine0 -f build-hook.nix passthru.input1 --arg busybox $busybox
+}
+
+# By default every build checks all of its inputs and nothing is recorded.
+read known total < <(knownInputs "$(build)")
+[[ $known == 0 && $total -gt 0 ]]
+currentLoad=$TEST_ROOT/machine0/nix/var/nix/current-load
+[[ -z $(find "$currentLoad" -name '*.known-paths') ]]
+
+# With a TTL the uploaded inputs are recorded ...
+nix store delete --store $TEST_ROOT/machine0 "$(outPath)"
+read known total < <(knownInputs "$(build --builders-known-paths-ttl 3600)")
+[[ $known == 0 ]]
+[[ -n $(find "$currentLoad" -name '*.known-paths') ]]
+
+# ... and the next build skips them.
+nix store delete --store $TEST_ROOT/machine0 "$(outPath)"
+read known total < <(knownInputs "$(build --builders-known-paths-ttl 3600)")
+[[ $known == $total ]]
+
+# Without the TTL they are checked again.
+nix store delete --store $TEST_ROOT/machine0 "$(outPath)"
+read known total < <(knownInputs "$(build)")
+[[ $known == 0 ]]
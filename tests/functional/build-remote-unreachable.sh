@@ -0,0 +1,35 @@
+source common.sh
+
+requireSandboxSupport
+[[ $busybox =~ busybox ]] || skipTest "no busybox"
+
+# Avoid store dir being inside sandbox build-dir
+unset NIX_STORE_DIR
+unset NIX_STATE_DIR
+
+chmod -R +w $TEST_ROOT/machine* || true
+rm -rf $TEST_ROOT/machine* || true
+
+# The unreachable machine is faster, so the build hook tries it first.
+unreachable="ssh-ng://localhost?remote-program=false"
+builders="$unreachable - - 1 2 foo; ssh://localhost?remote-store=$TEST_ROOT/machine1?system-features=foo - - 1 1 foo"
+
+build() {
+    nix build -L -f build-hook.nix passthru.input1 --no-link --print-out-paths --max-jobs 0 \
+      --arg busybox $busybox \
+      --store $TEST_ROOT/machine0 \
+      --builders "$builders" \
+      "$@"
+}
+
+outPath=$(build)
+
+# The failed connection is recorded for the build hooks of later builds.
+currentLoad=$TEST_ROOT/machine0/nix/var/nix/current-load
+[[ -n $(find "$currentLoad" -name '*.down') ]]
+
+# They skip the machine without trying to connect to it again.
+nix store delete --store $TEST_ROOT/machine0 "$outPath"
+out=$(build --debug 2>&1)
+grepQuiet "skipping remote machine '$unreachable' that was recently unreachable" <<< "$out"
+grepQuietInverse "cannot build on '$unreachable'" <<< "$out"
@@ -20,3 +20,19 @@ nix copy --to $cacheURI $outPath
 FILESIZES2=$(cat ${cacheDir}/*.narinfo | awk '/FileSize: /{sum+=$2}END{print sum}')
 
 [[ $FILESIZES -gt $FILESIZES2 ]]
+
+# Multi-threaded xz compression round-trips.
+clearCache
+
+cacheURI="file://$cacheDir?compression=xz&parallel-compression=1&compression-threads=2"
+
+nix copy --to $cacheURI $outPath
+
+HASH=$(nix hash path $outPath)
+
+clearStore
+clearCacheCache
+
+nix copy --from $cacheURI $outPath --no-check-sigs
+
+[[ $HASH = $(nix hash path $outPath) ]]
@@ -0,0 +1,52 @@
+source common.sh
+
+# A substituter that knows nothing and takes its time to say so.
+cat > $TEST_ROOT/slow-cache.py <<PY
+import http.server, sys, time
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def do_GET(self):
+        if self.path == "/nix-cache-info":
+            body = b"StoreDir: $NIX_STORE_DIR\nWantMassQuery: 1\nPriority: 60\n"
+            self.send_response(200)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+        else:
+            time.sleep(10)
+            self.send_error(404)
+
+server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+print("port", server.server_address[1], flush=True)
+server.serve_forever()
+PY
+
+set -m
+python3 -u $TEST_ROOT/slow-cache.py > $TEST_ROOT/slow-cache.out &
+trap 'kill %python3' EXIT
+
+while ! grep -q '^port ' $TEST_ROOT/slow-cache.out; do
+  echo 'waiting for the slow cache' >&2
+  sleep 0.2
+done
+port=$(awk '/^port / { print $2 }' $TEST_ROOT/slow-cache.out)
+
+clearStore
+clearCache
+clearCacheCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to "file://$cacheDir" $outPath
+
+clearStore
+
+# The slow substituter is asked for every path at the same time as the
+# fast one, which has them all, but must not hold up substitution.
+start=$(date +%s)
+nix-store -r $outPath \
+    --substituters "file://$cacheDir?priority=10 http://127.0.0.1:$port" \
+    --option parallel-substituter-queries true \
+    --no-require-sigs
+end=$(date +%s)
+
+(( end - start < 8 )) || fail "substitution waited for the slow substituter"
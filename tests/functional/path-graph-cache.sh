@@ -0,0 +1,22 @@
+source common.sh
+
+needLocalStore "the path graph cache only exists in local stores"
+
+clearStore
+
+path=$(nix-build dependencies.nix --no-out-link)
+
+graph="--option path-graph-cache true"
+
+# Queries answered from the graph agree with the database.
+[ "$(nix-store -qR $path)" = "$(nix-store $graph -qR $path)" ]
+[ "$(nix-store -q --referrers-closure $path)" = "$(nix-store $graph -q --referrers-closure $path)" ]
+[ "$(nix-store --dump-db)" = "$(nix-store $graph --dump-db)" ]
+
+# Paths registered and deleted through the graph-backed store are seen by it.
+reference=$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-graph
+touch $reference
+(echo $reference && echo && echo 0) | nix-store $graph --register-validity
+nix-store $graph --check-validity $reference
+nix-store $graph --delete $reference
+expect 1 nix-store $graph --check-validity $reference
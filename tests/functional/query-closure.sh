@@ -0,0 +1,35 @@
+source common.sh
+
+clearStore
+
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+# The closures as computed by the local store.
+NIX_REMOTE= nix-store -qR "$outPath" > $TEST_ROOT/closure-local
+NIX_REMOTE= nix-store -qR --include-outputs "$drvPath" > $TEST_ROOT/closure-drv-local
+[[ $(wc -l < $TEST_ROOT/closure-local) -gt 1 ]]
+
+queryClosures() {
+    nix-store -qR "$outPath" --debug > $TEST_ROOT/closure-daemon 2> $TEST_ROOT/log
+    nix-store -qR --include-outputs "$drvPath" > $TEST_ROOT/closure-drv-daemon
+    diff <(sort $TEST_ROOT/closure-local) <(sort $TEST_ROOT/closure-daemon)
+    diff <(sort $TEST_ROOT/closure-drv-local) <(sort $TEST_ROOT/closure-drv-daemon)
+}
+
+# The daemon walks the closure itself.
+startDaemon
+queryClosures
+if isDaemonNewer "$version"; then
+    grepQuietInverse "does not support bulk closure queries" $TEST_ROOT/log
+fi
+killDaemon
+
+# Clients fall back to walking the closure themselves if the daemon does
+# not know the operation.
+export _NIX_TEST_NO_QUERY_CLOSURE=1
+startDaemon
+queryClosures
+grepQuiet "does not support bulk closure queries" $TEST_ROOT/log
+killDaemon
+unset _NIX_TEST_NO_QUERY_CLOSURE
@@ -26,3 +26,16 @@ fi
 HASH2=$(nix hash path $outPath)
 
 [[ $HASH = $HASH2 ]]
+
+# Multi-threaded and long window compression produce ordinary zstd files.
+for options in "parallel-compression=1&compression-threads=2" "compression-long-window=1&compression-level=19"; do
+    clearCache
+    nix copy --to "$cacheURI&$options" $outPath
+
+    clearStore
+    clearCacheCache
+
+    nix copy --from $cacheURI $outPath --no-check-sigs
+
+    [[ $HASH = $(nix hash path $outPath) ]]
+done
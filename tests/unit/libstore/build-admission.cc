@@ -0,0 +1,104 @@
+#include "lix/libstore/build/build-admission.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+namespace {
+
+struct FakeSystem
+{
+    std::optional<double> cpu = 1, memory = 1;
+    std::optional<uint64_t> available = 10'000;
+    BuildAdmission::Clock::time_point now;
+
+    BuildAdmission::Readings readings()
+    {
+        return {
+            .pressure = [this](const std::string & resource) {
+                return resource == "cpu" ? cpu : memory;
+            },
+            .availableMemory = [this] { return available; },
+            .now = [this] { return now; },
+        };
+    }
+};
+
+}
+
+TEST(BuildAdmission, pressureAboveLimit)
+{
+    FakeSystem fake;
+    BuildAdmission admission(fake.readings());
+
+    fake.memory = 60;
+    ASSERT_FALSE(admission.admit(std::nullopt, 50, false));
+    // the only build always starts
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, true));
+
+    fake.memory = 1;
+    fake.cpu = 60;
+    fake.now += BuildAdmission::window;
+    ASSERT_FALSE(admission.admit(std::nullopt, 50, false));
+
+    fake.cpu = 1;
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, false));
+}
+
+TEST(BuildAdmission, countsRecentBuildsAgainstMemory)
+{
+    FakeSystem fake;
+    BuildAdmission admission(fake.readings());
+
+    ASSERT_TRUE(admission.admit(6'000, 50, true));
+    // the first build has not allocated its memory yet
+    ASSERT_FALSE(admission.admit(6'000, 50, false));
+    ASSERT_TRUE(admission.admit(3'000, 50, false));
+    ASSERT_FALSE(admission.admit(2'000, 50, false));
+    // builds whose memory use is unknown are not held back by it
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, false));
+
+    // by now the memory of the earlier builds shows up in the readings
+    fake.now += BuildAdmission::window;
+    ASSERT_TRUE(admission.admit(6'000, 50, false));
+    fake.available = 5'000;
+    fake.now += BuildAdmission::window;
+    ASSERT_FALSE(admission.admit(6'000, 50, false));
+}
+
+TEST(BuildAdmission, oneBuildPerWindowWhilePressureUnknown)
+{
+    FakeSystem fake;
+    fake.cpu = fake.memory = std::nullopt;
+    BuildAdmission admission(fake.readings());
+
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, false));
+    ASSERT_FALSE(admission.admit(std::nullopt, 50, false));
+    fake.now += BuildAdmission::window / 2;
+    ASSERT_FALSE(admission.admit(std::nullopt, 50, false));
+    fake.now += BuildAdmission::window / 2;
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, false));
+    ASSERT_FALSE(admission.admit(std::nullopt, 50, false));
+}
+
+TEST(BuildAdmission, oneBuildPerWindowWhilePressureRises)
+{
+    FakeSystem fake;
+    BuildAdmission admission(fake.readings());
+
+    fake.cpu = 10;
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, false));
+    // the pressure of the build just started is not fully visible yet
+    fake.cpu = 20;
+    ASSERT_FALSE(admission.admit(std::nullopt, 50, false));
+    fake.cpu = 10;
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, false));
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, false));
+
+    // rising pressure does not hold back a build if none started recently
+    fake.now += BuildAdmission::window;
+    fake.cpu = 30;
+    ASSERT_TRUE(admission.admit(std::nullopt, 50, false));
+}
+
+}
@@ -0,0 +1,48 @@
+#include "lix/libstore/build-durations.hh"
+#include "lix/libstore/temporary-dir.hh"
+#include "lix/libutil/file-system.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+TEST(BuildDurations, recordAndLookup)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path dbPath(tmpDir + "/test-build-durations.sqlite");
+
+    {
+        auto durations = getTestBuildDurations(dbPath);
+
+        ASSERT_EQ(durations->lookup("hello-2.12"), std::nullopt);
+
+        durations->record("hello-2.12", std::chrono::seconds(100), std::nullopt);
+        auto entry = durations->lookup("hello-2.12");
+        ASSERT_TRUE(entry);
+        ASSERT_EQ(entry->duration, std::chrono::seconds(100));
+        ASSERT_EQ(entry->memoryPeak, std::nullopt);
+
+        // Versions are ignored, and new durations are averaged with old ones.
+        durations->record("hello-2.13", std::chrono::seconds(300), 1 << 20);
+        entry = durations->lookup("hello-2.14");
+        ASSERT_TRUE(entry);
+        ASSERT_EQ(entry->duration, std::chrono::seconds(200));
+        ASSERT_EQ(entry->memoryPeak, 1 << 20);
+
+        // Builds without a measurement keep the last one.
+        durations->record("hello-2.14", std::chrono::seconds(200), std::nullopt);
+        entry = durations->lookup("hello-2.14");
+        ASSERT_TRUE(entry);
+        ASSERT_EQ(entry->memoryPeak, 1 << 20);
+
+        ASSERT_EQ(durations->lookup("hello-world-1.0"), std::nullopt);
+    }
+
+    // The durations persist across instances.
+    auto entry = getTestBuildDurations(dbPath)->lookup("hello");
+    ASSERT_TRUE(entry);
+    ASSERT_EQ(entry->duration, std::chrono::seconds(200));
+}
+
+}
@@ -0,0 +1,101 @@
+#include "lix/libstore/build-events.hh"
+#include "lix/libstore/temporary-dir.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/json.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+using namespace std::chrono;
+
+static BuildEvent event(int seconds, std::string path, BuildPhase phase, std::vector<std::string> inputs = {})
+{
+    return BuildEvent{
+        .time = system_clock::time_point(std::chrono::seconds(seconds)),
+        .path = std::move(path),
+        .phase = phase,
+        .inputs = std::move(inputs),
+    };
+}
+
+TEST(BuildEvent, json)
+{
+    auto e = event(42, "/nix/store/a.drv", BuildPhase::WaitingForInputs, {"/nix/store/b.drv"});
+    auto e2 = BuildEvent::fromJSON(e.toJSON());
+    ASSERT_EQ(e2.time, e.time);
+    ASSERT_EQ(e2.path, e.path);
+    ASSERT_EQ(e2.phase, e.phase);
+    ASSERT_EQ(e2.inputs, e.inputs);
+
+    for (auto phase : {BuildPhase::Substituting, BuildPhase::Building, BuildPhase::Done})
+        ASSERT_EQ(parseBuildPhase(showBuildPhase(phase)), phase);
+    ASSERT_EQ(parseBuildPhase("nonsense"), std::nullopt);
+}
+
+TEST(BuildEvent, readsLogBackwards)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path file = tmpDir + "/events";
+
+    // Only reached if the whole file were read.
+    std::string log = event(4500, "/nix/store/stray.drv", BuildPhase::Done).toJSON().dump() + "\n";
+    // Enough events to span several blocks.
+    for (int i = 0; i < 5000; i++)
+        log += event(i, fmt("/nix/store/%d.drv", i), BuildPhase::Building).toJSON().dump() + "\n";
+    log += "not json\n";
+    // Appended out of order by a concurrent writer.
+    log += event(3999, "/nix/store/late.drv", BuildPhase::Building).toJSON().dump() + "\n";
+    log += event(4000, "/nix/store/last.drv", BuildPhase::Done).toJSON().dump() + "\n";
+    writeFile(file, log);
+
+    auto events = readBuildEvents(file, system_clock::time_point(seconds(4000)));
+    ASSERT_EQ(events.size(), 1001);
+    for (int i = 0; i < 1000; i++) {
+        ASSERT_EQ(events[i].time, system_clock::time_point(seconds(4000 + i)));
+        ASSERT_EQ(events[i].path, fmt("/nix/store/%d.drv", 4000 + i));
+    }
+    ASSERT_EQ(events[1000].path, "/nix/store/last.drv");
+
+    ASSERT_EQ(readBuildEvents(file, system_clock::time_point(seconds(5000))).size(), 0);
+    ASSERT_EQ(readBuildEvents(file, system_clock::time_point(seconds(0))).size(), 5003);
+}
+
+TEST(BuildReport, criticalPathAndTotals)
+{
+    std::vector<BuildEvent> events{
+        event(0, "/nix/store/top.drv", BuildPhase::WaitingForInputs, {"/nix/store/fast.drv", "/nix/store/slow.drv"}),
+        event(0, "/nix/store/fast.drv", BuildPhase::Building),
+        event(0, "/nix/store/slow.drv", BuildPhase::WaitingForSlot),
+        event(1, "/nix/store/fast.drv", BuildPhase::Done),
+        event(2, "/nix/store/slow.drv", BuildPhase::Building),
+        event(10, "/nix/store/slow.drv", BuildPhase::Done),
+        event(10, "/nix/store/top.drv", BuildPhase::Building),
+        event(13, "/nix/store/top.drv", BuildPhase::Done),
+        // Not waited for by the root, so not part of the report.
+        event(0, "/nix/store/unrelated.drv", BuildPhase::Building),
+        event(100, "/nix/store/unrelated.drv", BuildPhase::Done),
+    };
+
+    auto report = BuildReport::compute(events, {"/nix/store/top.drv"});
+
+    ASSERT_EQ(report.phaseTotals[BuildPhase::Building], seconds(1 + 8 + 3));
+    ASSERT_EQ(report.phaseTotals[BuildPhase::WaitingForSlot], seconds(2));
+    ASSERT_EQ(report.phaseTotals[BuildPhase::WaitingForInputs], seconds(10));
+    ASSERT_EQ(report.phaseTotals.count(BuildPhase::Done), 0);
+
+    ASSERT_EQ(report.criticalPath.size(), 2);
+    ASSERT_EQ(report.criticalPath[0].path, "/nix/store/slow.drv");
+    ASSERT_EQ(report.criticalPath[0].phases[BuildPhase::Building], seconds(8));
+    ASSERT_EQ(report.criticalPath[1].path, "/nix/store/top.drv");
+}
+
+TEST(BuildReport, empty)
+{
+    auto report = BuildReport::compute({}, {"/nix/store/top.drv"});
+    ASSERT_TRUE(report.phaseTotals.empty());
+    ASSERT_TRUE(report.criticalPath.empty());
+}
+
+}
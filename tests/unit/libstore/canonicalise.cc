@@ -0,0 +1,84 @@
+#include "lix/libstore/local-store.hh"
+#include "lix/libstore/temporary-dir.hh"
+#include "lix/libutil/file-system.hh"
+
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+namespace {
+
+constexpr std::pair<uid_t, uid_t> buildUids{30000, 30009};
+
+/**
+ * Create a build output with enough directories to keep several threads
+ * busy, with hard links between them, owned by a build user.
+ */
+void makeOutput(const Path & out)
+{
+    for (int d = 0; d < 64; d++) {
+        auto dir = fmt("%s/d%d", out, d);
+        createDirs(dir);
+        for (int f = 0; f < 8; f++)
+            writeFile(fmt("%s/f%d", dir, f), fmt("%d %d", d, f));
+        if (d > 0 && link(fmt("%s/d0/f0", out).c_str(), fmt("%s/link", dir).c_str()) == -1)
+            throw SysError("creating hard link in '%s'", dir);
+    }
+
+    for (auto & entry : std::filesystem::recursive_directory_iterator(out))
+        if (lchown(entry.path().c_str(), buildUids.first + 1, buildUids.first + 1) == -1)
+            throw SysError("changing owner of '%s'", entry.path().string());
+    if (lchown(out.c_str(), buildUids.first + 1, buildUids.first + 1) == -1)
+        throw SysError("changing owner of '%s'", out);
+}
+
+}
+
+TEST(CanonicalisePathMetaData, hardLinksWithinOutput)
+{
+    if (geteuid() != 0)
+        GTEST_SKIP() << "changing the owner of files requires root";
+
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path out = tmpDir + "/out";
+    makeOutput(out);
+
+    canonicalisePathMetaData(out, buildUids);
+
+    for (auto & entry : std::filesystem::recursive_directory_iterator(out)) {
+        auto st = lstat(entry.path().string());
+        ASSERT_EQ(st.st_uid, geteuid());
+        ASSERT_EQ(st.st_mtime, 1);
+        ASSERT_TRUE((st.st_mode & 07777) == 0444 || (st.st_mode & 07777) == 0555);
+    }
+    ASSERT_EQ(lstat(out + "/d0/f0").st_nlink, 64);
+}
+
+TEST(CanonicalisePathMetaData, hardLinkToForeignFile)
+{
+    if (geteuid() != 0)
+        GTEST_SKIP() << "changing the owner of files requires root";
+
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path out = tmpDir + "/out";
+    makeOutput(out);
+
+    /* Like `ln /etc/shadow $out/d63/shadow` in a builder. */
+    Path foreign = tmpDir + "/shadow";
+    writeFile(foreign, "secret", 0600);
+    ASSERT_EQ(chown(foreign.c_str(), buildUids.second + 1, buildUids.second + 1), 0);
+    ASSERT_EQ(link(foreign.c_str(), (out + "/d63/shadow").c_str()), 0);
+
+    ASSERT_THROW(canonicalisePathMetaData(out, buildUids), BuildError);
+
+    auto st = lstat(foreign);
+    ASSERT_EQ(st.st_uid, buildUids.second + 1);
+    ASSERT_EQ(st.st_mode & 07777, 0600);
+}
+
+}
@@ -1,9 +1,11 @@
 #include "lix/libstore/filetransfer.hh"
 #include "lix/libutil/compression.hh"
 #include "lix/libutil/error.hh"
+#include "lix/libutil/read-ahead.hh"
 #include "lix/libutil/signals.hh"
 #include "lix/libutil/thread-name.hh"
 
+#include <atomic>
 #include <cstdint>
 #include <exception>
 #include <future>
@@ -201,6 +203,98 @@ serveHTTP(std::string status, std::string headers, std::function<std::string()>
     return serveHTTP({{{status, headers, content}}});
 }
 
+/**
+ * Accept a single request with a chunked body and reply once all of it has
+ * arrived.
+ *
+ * @return The port to connect to and the body of the request.
+ */
+static std::tuple<uint16_t, std::future<std::string>> serveUpload()
+{
+    AutoCloseFD listener(::socket(AF_INET6, SOCK_STREAM, 0));
+    if (!listener) {
+        throw SysError(errno, "socket() failed");
+    }
+
+    sockaddr_in6 addr = {
+        .sin6_family = AF_INET6,
+        .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+    };
+    socklen_t len = sizeof(addr);
+    if (::bind(listener.get(), reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0) {
+        throw SysError(errno, "bind() failed");
+    }
+    if (::getsockname(listener.get(), reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+        throw SysError(errno, "getsockname() failed");
+    }
+    if (::listen(listener.get(), 1) < 0) {
+        throw SysError(errno, "listen() failed");
+    }
+
+    std::promise<std::string> body;
+    auto result = body.get_future();
+
+    std::thread(
+        [](AutoCloseFD listener, std::promise<std::string> body) {
+            setCurrentThreadName("test httpd upload");
+            try {
+                AutoCloseFD conn(::accept(listener.get(), nullptr, nullptr));
+                if (!conn) {
+                    throw SysError(errno, "accept() failed");
+                }
+
+                std::string received;
+                auto fill = [&] {
+                    char buf[4096];
+                    auto n = ::recv(conn.get(), buf, sizeof(buf), 0);
+                    if (n <= 0) {
+                        throw EndOfFile("connection closed before the upload was complete");
+                    }
+                    received.append(buf, n);
+                };
+
+                size_t end;
+                while ((end = received.find("\r\n\r\n")) == std::string::npos) {
+                    fill();
+                }
+                auto headers = received.substr(0, end + 2);
+                received.erase(0, end + 4);
+                debug("got request:\n%s", headers);
+                if (headers.contains("Expect: 100-continue\r\n")) {
+                    writeFull(conn.get(), "HTTP/1.1 100 Continue\r\n\r\n");
+                }
+
+                std::string data;
+                while (true) {
+                    size_t eol;
+                    while ((eol = received.find("\r\n")) == std::string::npos) {
+                        fill();
+                    }
+                    auto size = std::stoul(received.substr(0, eol), nullptr, 16);
+                    while (received.size() < eol + 2 + size + 2) {
+                        fill();
+                    }
+                    data += received.substr(eol + 2, size);
+                    received.erase(0, eol + 2 + size + 2);
+                    if (size == 0) {
+                        break;
+                    }
+                }
+
+                writeFull(conn.get(), "HTTP/1.1 200 ok\r\ncontent-length: 0\r\n\r\n");
+                body.set_value(std::move(data));
+            } catch (...) {
+                body.set_exception(std::current_exception());
+            }
+        },
+        std::move(listener),
+        std::move(body)
+    )
+        .detach();
+
+    return {ntohs(addr.sin6_port), std::move(result)};
+}
+
 TEST(FileTransfer, exceptionAbortsDownload)
 {
     struct Done : BaseException
@@ -325,6 +419,34 @@ TEST(FileTransfer, stalledReaderDoesntBlockOthers)
     ASSERT_THROW(drop(*data2, 1), EndOfFile);
 }
 
+TEST(FileTransfer, NOT_ON_DARWIN(cancelsStalledReadAhead))
+{
+    auto stalled = std::make_shared<std::promise<void>>();
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    auto [port, srv] = serveHTTP({
+        {"200 ok",
+         "content-length: 2\r\n",
+         [stalled, released](int round) -> std::optional<std::string> {
+             if (round == 0) {
+                 return "a";
+             }
+             // never send the second byte while the client is still around
+             stalled->set_value();
+             released.wait();
+             return std::nullopt;
+         }},
+    });
+    auto ft = makeFileTransfer(0);
+    auto [_result, data] = ft->download(fmt("http://[::1]:%d", port));
+    auto source = std::make_unique<ReadAheadSource>(std::move(data), 4096);
+    stalled->get_future().wait();
+    // the read-ahead thread is waiting for the second byte now. destroying the
+    // source must cancel the transfer instead of waiting for it forever.
+    source.reset();
+    release.set_value();
+}
+
 TEST(FileTransfer, retries)
 {
     auto [port, srv] = serveHTTP({
@@ -398,6 +520,115 @@ TEST(FileTransfer, doesntRetryUploads)
     }
 }
 
+TEST(FileTransfer, streamedUploadsReportErrors)
+{
+    auto [port, srv] = serveHTTP({
+        {"403 forbidden", "content-length: 0\r\n", [] { return ""; }},
+    });
+    auto ft = makeFileTransfer(0);
+    ASSERT_THROW(
+        {
+            auto sink = ft->uploadStream(fmt("http://[::1]:%d", port));
+            (*sink)("foo");
+            sink->finish();
+        },
+        FileTransferError
+    );
+}
+
+TEST(FileTransfer, NOT_ON_DARWIN(streamedUploadsDeliverData))
+{
+    auto [port, body] = serveUpload();
+    auto ft = makeFileTransfer(0);
+
+    std::string data;
+    auto sink = ft->uploadStream(fmt("http://[::1]:%d/nar", port));
+    for (int i = 0; i < 100; i++) {
+        auto part = std::string(10'000, 'a' + i % 26);
+        (*sink)(part);
+        data += part;
+    }
+    sink->finish();
+
+    ASSERT_EQ(body.wait_for(10s), std::future_status::ready);
+    ASSERT_EQ(body.get(), data);
+}
+
+TEST(FileTransfer, NOT_ON_DARWIN(enqueueDownload))
+{
+    auto [port, srv] = serveHTTP({
+        {"200 ok", "content-length: 3\r\n", [] { return "foo"; }},
+        {"404 not found", "content-length: 0\r\n", [] { return ""; }},
+    });
+    auto ft = makeFileTransfer(0);
+
+    std::promise<void> done;
+    auto body = ft->enqueueDownload(fmt("http://[::1]:%d/first", port), [&] { done.set_value(); });
+    ASSERT_EQ(done.get_future().wait_for(10s), std::future_status::ready);
+    ASSERT_EQ(body.wait_for(0s), std::future_status::ready);
+    ASSERT_EQ(body.get(), "foo");
+
+    auto missing = ft->enqueueDownload(fmt("http://[::1]:%d/second", port));
+    ASSERT_THROW(missing.get(), FileTransferError);
+}
+
+TEST(DownloadPrefetcher, NOT_ON_DARWIN(deduplicates))
+{
+    auto requests = std::make_shared<std::atomic<int>>(0);
+    auto [port, srv] = serveHTTP("200 ok", "content-length: 3\r\n", [requests] {
+        (*requests)++;
+        return "foo";
+    });
+
+    std::promise<std::pair<std::string, std::string>> arrived;
+    DownloadPrefetcher prefetcher(makeFileTransfer(0), 10, [&](auto & key, auto & body) {
+        arrived.set_value({key, body});
+    });
+
+    auto uri = fmt("http://[::1]:%d/a", port);
+    ASSERT_TRUE(prefetcher.prefetch("a", uri));
+    ASSERT_TRUE(prefetcher.prefetch("a", uri));
+
+    // Arrivals are reported once, and not on the transfer thread.
+    auto result = arrived.get_future();
+    ASSERT_EQ(result.wait_for(10s), std::future_status::ready);
+    ASSERT_EQ(result.get(), std::pair<std::string, std::string>("a", "foo"));
+    ASSERT_EQ(*requests, 1);
+
+    bool called = false;
+    auto body = prefetcher.take("a", [&] { called = true; });
+    ASSERT_TRUE(body);
+    ASSERT_TRUE(called);
+    ASSERT_EQ(body->get(), "foo");
+
+    // Taken downloads are forgotten.
+    ASSERT_FALSE(prefetcher.take("a"));
+    ASSERT_FALSE(prefetcher.take("b"));
+}
+
+TEST(DownloadPrefetcher, NOT_ON_DARWIN(respectsLimit))
+{
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    auto [port, srv] = serveHTTP("200 ok", "content-length: 3\r\n", [released] {
+        released.wait();
+        return "foo";
+    });
+
+    DownloadPrefetcher prefetcher(makeFileTransfer(0), 1, [](auto &, auto &) {});
+
+    ASSERT_TRUE(prefetcher.prefetch("a", fmt("http://[::1]:%d/a", port)));
+    // Downloads that are still in flight are never given up on.
+    ASSERT_FALSE(prefetcher.prefetch("b", fmt("http://[::1]:%d/b", port)));
+
+    std::promise<void> done;
+    auto body = prefetcher.take("a", [&] { done.set_value(); });
+    ASSERT_TRUE(body);
+    release.set_value();
+    ASSERT_EQ(done.get_future().wait_for(10s), std::future_status::ready);
+    ASSERT_EQ(body->get(), "foo");
+}
+
 // this test does not work unless run alone. we can't fork because that breaks
 // the file transfer thread, restoring state is insufficient and very fragile.
 TEST(FileTransfer, DISABLED_interrupt)
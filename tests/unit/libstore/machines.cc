@@ -170,3 +170,21 @@ TEST(machines, getMachinesWithCorrectFileReferenceToIncorrectFile) {
     settings.builders.override(std::string("@") + nix::getUnitTestDataPath("machines.bad_format"));
     EXPECT_THROW(getMachines(), FormatError);
 }
+
+TEST(machines, controlPathIdentifiesConnection) {
+    settings.builders.override("nix@a - /key1\n"
+                               "nix@a - /key1\n"
+                               "nix@a - /key2\n"
+                               "nix@a - /key1 - - - - SSH+HOST+KEY+1\n"
+                               "nix@a - /key1 - - - - SSH+HOST+KEY+2\n"
+                               "nix@a - b/key\n"
+                               "nix@ab/key");
+    Machines actual = getMachines();
+    ASSERT_THAT(actual, SizeIs(7));
+    EXPECT_EQ(actual[0].controlPath(), actual[1].controlPath());
+    EXPECT_NE(actual[0].controlPath(), actual[2].controlPath());
+    EXPECT_NE(actual[0].controlPath(), actual[3].controlPath());
+    EXPECT_NE(actual[3].controlPath(), actual[4].controlPath());
+    // the URI and the key must not run into each other
+    EXPECT_NE(actual[5].controlPath(), actual[6].controlPath());
+}
@@ -0,0 +1,80 @@
+#include "lix/libstore/narinfo-index.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+static std::vector<NarInfoIndex::Entry> makeEntries(size_t n)
+{
+    std::vector<NarInfoIndex::Entry> entries(n);
+    uint64_t x = 0x9e3779b97f4a7c15;
+    for (auto & entry : entries)
+        for (auto & byte : entry) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            byte = x & 0xff;
+        }
+    return entries;
+}
+
+TEST(NarInfoIndex, entryFor)
+{
+    StorePath a{"g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-foo"};
+    StorePath b{"g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-bar"};
+    StorePath c{"h1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-foo"};
+    ASSERT_EQ(NarInfoIndex::entryFor(a), NarInfoIndex::entryFor(b));
+    ASSERT_NE(NarInfoIndex::entryFor(a), NarInfoIndex::entryFor(c));
+}
+
+TEST(NarInfoIndex, roundTrip)
+{
+    for (size_t n : {0, 1, 100, 10000}) {
+        auto entries = makeEntries(n);
+        auto data = NarInfoIndex::write(entries);
+
+        auto parsed = NarInfoIndex::parseEntries(data);
+        std::sort(entries.begin(), entries.end());
+        ASSERT_EQ(parsed, entries);
+    }
+}
+
+TEST(NarInfoIndex, duplicates)
+{
+    auto entries = makeEntries(10);
+    entries.push_back(entries[3]);
+    auto data = NarInfoIndex::write(entries);
+    ASSERT_EQ(NarInfoIndex::parseEntries(data).size(), 10);
+}
+
+TEST(NarInfoIndex, lookupByBucket)
+{
+    auto entries = makeEntries(10000);
+    auto data = NarInfoIndex::write({entries.begin(), entries.begin() + 5000});
+
+    auto index = NarInfoIndex::parseHeader(data);
+    ASSERT_EQ(index.headerSize(), NarInfoIndex::headerSize(data));
+    ASSERT_EQ(index.count, 5000);
+    ASSERT_GT(index.fanoutBits, 0);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        auto bucket = index.bucketOf(entries[i]);
+        auto slice = std::string_view(data).substr(
+            index.headerSize() + index.bucketStart(bucket) * sizeof(NarInfoIndex::Entry),
+            (index.bucketEnd(bucket) - index.bucketStart(bucket)) * sizeof(NarInfoIndex::Entry)
+        );
+        ASSERT_EQ(NarInfoIndex::contains(slice, entries[i]), i < 5000);
+    }
+}
+
+TEST(NarInfoIndex, rejectsGarbage)
+{
+    ASSERT_THROW(NarInfoIndex::parseHeader(""), Error);
+    ASSERT_THROW(NarInfoIndex::parseHeader(std::string(100, 'x')), Error);
+
+    auto data = NarInfoIndex::write(makeEntries(100));
+    ASSERT_THROW(NarInfoIndex::parseHeader(data.substr(0, NarInfoIndex::fixedHeaderSize)), Error);
+    ASSERT_THROW(NarInfoIndex::parseEntries(data.substr(0, data.size() - 1)), Error);
+}
+
+}
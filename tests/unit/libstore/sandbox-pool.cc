@@ -0,0 +1,49 @@
+#include "lix/libstore/build/sandbox-pool.hh"
+#include "lix/libutil/file-system.hh"
+
+#include <chrono>
+#include <gtest/gtest.h>
+#include <thread>
+
+namespace nix {
+
+TEST(SandboxPool, takeAndDiscard)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path poolDir = tmpDir + "/" + std::string(SandboxPool::dirName);
+
+    {
+        SandboxPool pool(tmpDir, "/nix/store", 1);
+
+        // Skeletons are prepared in the background, so wait for one.
+        Path sandbox = tmpDir + "/sandbox";
+        bool taken = false;
+        for (int i = 0; i < 1000 && !taken; i++) {
+            taken = pool.take(sandbox);
+            if (!taken)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT_TRUE(taken);
+        ASSERT_TRUE(pathExists(sandbox + "/tmp"));
+        ASSERT_TRUE(pathExists(sandbox + "/nix/store"));
+        ASSERT_EQ(readLink(sandbox + "/dev/fd"), "/proc/self/fd");
+
+        // Skeletons that can't be moved into place are not leaked.
+        for (int i = 0; i < 10; i++) {
+            ASSERT_FALSE(pool.take(sandbox));
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        ASSERT_TRUE(pool.discard(sandbox));
+        ASSERT_FALSE(pathExists(sandbox));
+
+        // Sandboxes that are already gone are left to the caller.
+        ASSERT_FALSE(pool.discard(sandbox));
+    }
+
+    // Whatever the pool still holds is deleted along with it.
+    ASSERT_TRUE(readDirectory(poolDir).empty());
+}
+
+}
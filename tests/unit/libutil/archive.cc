@@ -1,11 +1,15 @@
 #include "lix/libutil/archive.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/box_ptr.hh"
+#include "lix/libutil/config.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/finally.hh"
 #include "lix/libutil/serialise.hh"
 #include <algorithm>
 #include <gtest/gtest.h>
 #include <kj/async.h>
 #include <limits>
+#include <sys/resource.h>
 
 using namespace std::literals;
 
@@ -448,6 +452,78 @@ TEST_P(NarTest, indexAsync)
     }
 }
 
+class NarRestoreTest : public NarTest
+{
+public:
+    void checkRoundTrip(const std::string & restoreThreads)
+    {
+        ASSERT_TRUE(globalConfig.set("restore-threads", restoreThreads));
+        Finally resetThreads([] { globalConfig.set("restore-threads", "0"); });
+
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir);
+
+        GeneratorSource source(rawStream());
+        restorePath(tmpDir + "/out", source);
+        ASSERT_EQ(raw(), GeneratorSource(dumpPath(tmpDir + "/out")).drain());
+    }
+};
+
+TEST_P(NarRestoreTest, restore)
+{
+    checkRoundTrip("0");
+}
+
+TEST_P(NarRestoreTest, restoreParallel)
+{
+    checkRoundTrip("4");
+}
+
+TEST(NarRestore, manyFilesParallel)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+
+    createDirs(tmpDir + "/in");
+    for (int i = 0; i < 4000; i++) {
+        writeFile(fmt("%s/in/%d", tmpDir, i), i % 2 ? "" : "x");
+    }
+    auto nar = GeneratorSource(dumpPath(tmpDir + "/in")).drain();
+
+    /* Every file waiting for a writer holds a descriptor, so unbounded
+       queueing would run out of them. */
+    struct rlimit limit;
+    ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);
+    auto oldLimit = limit;
+    limit.rlim_cur = std::min<rlim_t>(limit.rlim_cur, 512);
+    ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &limit), 0);
+    Finally resetLimit([&] { setrlimit(RLIMIT_NOFILE, &oldLimit); });
+
+    ASSERT_TRUE(globalConfig.set("restore-threads", "4"));
+    Finally resetThreads([] { globalConfig.set("restore-threads", "0"); });
+
+    StringSource source(nar);
+    restorePath(tmpDir + "/out", source);
+    ASSERT_EQ(nar, GeneratorSource(dumpPath(tmpDir + "/out")).drain());
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    ,
+    NarRestoreTest,
+    testing::Combine(
+        testing::Values(7, std::numeric_limits<size_t>::max()),
+        testing::Values(
+            concat({header, make_file(false, "short")}),
+            concat({header, make_file(true, "block0001")}),
+            concat({header, make_symlink("short")}),
+            concat({header, make_directory({
+                {"a", make_file(true, "short")},
+                {"b", make_directory({{"c", make_file(false, "block0001")}, {"d", make_symlink("a")}})},
+                {"e", make_file(false, "")},
+            })})
+        ))
+);
+
 INSTANTIATE_TEST_SUITE_P(
     ,
     NarTest,
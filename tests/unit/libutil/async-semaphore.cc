@@ -71,4 +71,32 @@ TEST(AsyncSemaphore, cancelledWaiter)
     ASSERT_TRUE(c.poll(waitScope));
 }
 
+TEST(AsyncSemaphore, priorities)
+{
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+
+    AsyncSemaphore sem(1);
+
+    auto a = kj::evalNow([&] { return sem.acquire(); });
+    auto b = kj::evalNow([&] { return sem.acquire(1); });
+    auto c = kj::evalNow([&] { return sem.acquire(5); });
+    auto d = kj::evalNow([&] { return sem.acquire(5); });
+
+    ASSERT_TRUE(a.poll(waitScope));
+    ASSERT_FALSE(b.poll(waitScope));
+
+    a = nullptr;
+    ASSERT_TRUE(c.poll(waitScope));
+    ASSERT_FALSE(b.poll(waitScope));
+    ASSERT_FALSE(d.poll(waitScope));
+
+    c = nullptr;
+    ASSERT_TRUE(d.poll(waitScope));
+    ASSERT_FALSE(b.poll(waitScope));
+
+    d = nullptr;
+    ASSERT_TRUE(b.poll(waitScope));
+}
+
 }
@@ -0,0 +1,74 @@
+#include "lix/libutil/async-wait-queue.hh"
+
+#include <gtest/gtest.h>
+#include <kj/async.h>
+#include <memory>
+
+namespace nix {
+
+TEST(AsyncWaitQueue, priorities)
+{
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+
+    AsyncWaitQueue queue;
+
+    ASSERT_FALSE(queue.notifyOne());
+
+    auto a = queue.wait(1);
+    auto b = queue.wait(5);
+    auto c = queue.wait(5);
+    auto d = queue.wait();
+    ASSERT_EQ(queue.size(), 4);
+
+    ASSERT_FALSE(a.poll(waitScope));
+    ASSERT_FALSE(b.poll(waitScope));
+
+    ASSERT_TRUE(queue.notifyOne());
+    ASSERT_TRUE(b.poll(waitScope));
+    ASSERT_FALSE(c.poll(waitScope));
+
+    ASSERT_TRUE(queue.notifyOne());
+    ASSERT_TRUE(c.poll(waitScope));
+    ASSERT_FALSE(a.poll(waitScope));
+
+    ASSERT_TRUE(queue.notifyOne());
+    ASSERT_TRUE(a.poll(waitScope));
+    ASSERT_FALSE(d.poll(waitScope));
+
+    ASSERT_TRUE(queue.notifyOne());
+    ASSERT_TRUE(d.poll(waitScope));
+    ASSERT_EQ(queue.size(), 0);
+}
+
+TEST(AsyncWaitQueue, cancelledWaiter)
+{
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+
+    AsyncWaitQueue queue;
+
+    auto a = queue.wait(5);
+    auto b = queue.wait(1);
+    ASSERT_EQ(queue.size(), 2);
+
+    a = nullptr;
+    ASSERT_EQ(queue.size(), 1);
+
+    ASSERT_TRUE(queue.notifyOne());
+    ASSERT_TRUE(b.poll(waitScope));
+    ASSERT_FALSE(queue.notifyOne());
+}
+
+TEST(AsyncWaitQueue, outlivedByWaiter)
+{
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+
+    auto queue = std::make_unique<AsyncWaitQueue>();
+    auto a = queue->wait();
+    queue.reset();
+    ASSERT_FALSE(a.poll(waitScope));
+}
+
+}
@@ -0,0 +1,84 @@
+#include "lix/libutil/chunking.hh"
+
+#include <gtest/gtest.h>
+#include <random>
+#include <set>
+
+namespace nix {
+
+static std::string randomData(size_t size, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::string data(size, 0);
+    for (auto & c : data)
+        c = char(rng());
+    return data;
+}
+
+static std::vector<std::string> chunk(std::string_view data, size_t fragmentSize)
+{
+    std::vector<std::string> chunks;
+    ChunkingSink sink([&](std::string_view chunk) { chunks.emplace_back(chunk); });
+    for (size_t pos = 0; pos < data.size(); pos += fragmentSize)
+        sink(data.substr(pos, fragmentSize));
+    sink.finish();
+    return chunks;
+}
+
+TEST(ChunkingSink, chunksConcatenateToInput)
+{
+    auto data = randomData(8 << 20, 1);
+    auto chunks = chunk(data, 1 << 20);
+
+    std::string joined;
+    for (auto & c : chunks)
+        joined += c;
+    ASSERT_EQ(joined, data);
+}
+
+TEST(ChunkingSink, boundariesDoNotDependOnWrites)
+{
+    auto data = randomData(8 << 20, 2);
+    ASSERT_EQ(chunk(data, 1 << 20), chunk(data, 4097));
+    ASSERT_EQ(chunk(data, 1 << 20), chunk(data, data.size()));
+}
+
+TEST(ChunkingSink, respectsSizeLimits)
+{
+    ChunkingSink::Params params;
+    auto chunks = chunk(randomData(16 << 20, 3), 65536);
+    ASSERT_GT(chunks.size(), 1);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        ASSERT_LE(chunks[i].size(), params.maxSize);
+        if (i + 1 < chunks.size())
+            ASSERT_GE(chunks[i].size(), params.minSize);
+    }
+
+    /* Data without any boundaries is cut at the maximum size. */
+    auto zeroes = chunk(std::string(3 * params.maxSize + 1, 0), 65536);
+    ASSERT_EQ(zeroes.size(), 4);
+    ASSERT_EQ(zeroes.back().size(), 1);
+}
+
+TEST(ChunkingSink, insertionOnlyChangesNearbyChunks)
+{
+    auto data = randomData(16 << 20, 4);
+    auto changed = data;
+    changed.insert(5 << 20, "a small change");
+
+    auto before = chunk(data, 65536);
+    auto after = chunk(changed, 65536);
+    std::set<std::string> known(before.begin(), before.end());
+
+    size_t shared = 0;
+    for (auto & c : after)
+        shared += known.count(c);
+    ASSERT_GE(shared + 2, after.size());
+}
+
+TEST(ChunkingSink, emptyInputHasNoChunks)
+{
+    ASSERT_TRUE(chunk("", 1).empty());
+}
+
+}
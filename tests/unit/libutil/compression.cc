@@ -161,4 +161,87 @@ TEST_P(PerTypeNonNullCompressionTest, truncatedValidInput)
     }
 }
 
+/* ---------------------------------------
+ * Native xz and zstd options
+ * --------------------------------------- */
+
+class OptionsCompressionTest : public testing::TestWithParam<const char *>
+{};
+
+INSTANTIATE_TEST_SUITE_P(compressionOptions, OptionsCompressionTest, testing::Values("xz", "zstd"));
+
+TEST_P(OptionsCompressionTest, parallelRoundTrips)
+{
+    auto method = GetParam();
+    std::string str;
+    for (int i = 0; i < 200000; i++) {
+        str += std::to_string(i * 7919 % 104729);
+    }
+
+    auto o = decompress(method, compress(method, str, {.parallel = true, .threads = 3}));
+
+    ASSERT_EQ(o.length(), str.length());
+    ASSERT_EQ(o, str);
+}
+
+TEST_P(OptionsCompressionTest, concatenatedStreams)
+{
+    auto method = GetParam();
+
+    auto o = decompress(method, compress(method, "first") + compress(method, "second"));
+
+    ASSERT_EQ(o, "firstsecond");
+}
+
+TEST(compress, zstdLongWindowRoundTrips)
+{
+    auto str = std::string(1024 * 1024, 'x') + "end";
+
+    auto o = decompress("zstd", compress("zstd", str, {.longWindow = true}));
+
+    ASSERT_EQ(o, str);
+}
+
+TEST(compress, zstdDictionaryRoundTrips)
+{
+    // zstd accepts any content as a raw dictionary
+    std::string dictionary = "StorePath: /nix/store/\nURL: nar/\nCompression: zstd\nReferences: ";
+    auto str = "StorePath: /nix/store/aaaa-foo\nURL: nar/aaaa.nar.zst\nCompression: zstd\n";
+
+    auto compressed = compress("zstd", str, {.dictionary = dictionary});
+    StringSource source{compressed};
+    auto o = makeDecompressionSource("zstd", source, dictionary)->drain();
+
+    ASSERT_EQ(o, str);
+    ASSERT_LT(compressed.size(), compress("zstd", str).size());
+}
+
+TEST(compress, zstdPatchRoundTrips)
+{
+    std::string base;
+    for (int i = 0; i < 100000; i++) {
+        base += "line " + std::to_string(i * 7919 % 100003) + " of the base\n";
+    }
+    auto str = base;
+    str.replace(1000, 4, "LINE");
+    str += "appended";
+
+    auto patch = compress("zstd", str, {.patchFrom = base});
+    StringSource source{patch};
+    auto o = makePatchDecompressionSource("zstd", source, base)->drain();
+
+    ASSERT_EQ(o, str);
+    ASSERT_LT(patch.size(), 1024);
+}
+
+TEST(compress, patchWithUnsupportedMethod)
+{
+    ASSERT_THROW(compress("xz", "something", {.patchFrom = "base"}), UnknownCompressionMethod);
+}
+
+TEST(compress, dictionaryWithUnsupportedMethod)
+{
+    ASSERT_THROW(compress("xz", "something", {.dictionary = "dictionary"}), UnknownCompressionMethod);
+}
+
 }
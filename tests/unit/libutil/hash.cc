@@ -74,4 +74,40 @@ namespace nix {
                 "7299aeadb6889018501d289e4900f7e4331b99dec4b5433a"
                 "c7d329eeb6dd26545e96e55b874be909");
     }
+
+    /* ----------------------------------------------------------------------------
+     * hashPaths
+     * --------------------------------------------------------------------------*/
+
+    TEST(hashPaths, matchesHashPath) {
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir);
+
+        std::vector<std::pair<HashType, Path>> paths;
+        for (int i = 0; i < 20; i++) {
+            auto path = tmpDir + "/" + std::to_string(i);
+            writeFile(path, std::string(i * 1000, 'a' + i));
+            paths.emplace_back(i % 2 ? HashType::SHA256 : HashType::SHA512, path);
+        }
+
+        auto hashes = hashPaths(paths);
+
+        ASSERT_EQ(hashes.size(), paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            ASSERT_EQ(hashes[i].value(), hashPath(paths[i].first, paths[i].second));
+        }
+    }
+
+    TEST(hashPaths, reportsErrorsPerPath) {
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir);
+
+        writeFile(tmpDir + "/present", "present");
+
+        auto hashes = hashPaths(HashType::SHA256, {tmpDir + "/present", tmpDir + "/missing"});
+
+        ASSERT_EQ(hashes.size(), 2);
+        ASSERT_EQ(hashes[0].value(), hashPath(HashType::SHA256, tmpDir + "/present"));
+        ASSERT_THROW(hashes[1].value(), SysError);
+    }
 }
@@ -0,0 +1,93 @@
+#include "lix/libutil/read-ahead.hh"
+#include "lix/libutil/error.hh"
+
+#include <condition_variable>
+#include <future>
+#include <gtest/gtest.h>
+#include <mutex>
+
+namespace nix {
+
+TEST(ReadAheadSource, readsEverything)
+{
+    std::string data;
+    for (int i = 0; i < 1000000; i++)
+        data.push_back(char(i * 7));
+
+    ReadAheadSource source(make_box_ptr<StringSource>(data), 4096);
+    ASSERT_EQ(source.drain(), data);
+}
+
+TEST(ReadAheadSource, empty)
+{
+    ReadAheadSource source(make_box_ptr<StringSource>(""), 4096);
+    ASSERT_EQ(source.drain(), "");
+}
+
+TEST(ReadAheadSource, rethrowsAfterData)
+{
+    struct FailingSource : Source
+    {
+        bool first = true;
+
+        size_t read(char * data, size_t len) override
+        {
+            if (!first)
+                throw Error("oops");
+            first = false;
+            data[0] = 'x';
+            return 1;
+        }
+    };
+
+    ReadAheadSource source(make_box_ptr<FailingSource>(), 4096);
+    char c;
+    ASSERT_EQ(source.read(&c, 1), 1);
+    ASSERT_EQ(c, 'x');
+    ASSERT_THROW(source.read(&c, 1), Error);
+}
+
+TEST(ReadAheadSource, abandoned)
+{
+    std::string data(10 * 1024 * 1024, 'a');
+    ReadAheadSource source(make_box_ptr<StringSource>(data), 4096);
+    char c;
+    ASSERT_EQ(source.read(&c, 1), 1);
+    // the destructor must stop the thread even though it is blocked on a full buffer
+}
+
+TEST(ReadAheadSource, cancelsBlockedInner)
+{
+    struct BlockingSource : Source
+    {
+        std::promise<void> & entered;
+        std::mutex lock;
+        std::condition_variable wakeup;
+        bool cancelled = false;
+
+        BlockingSource(std::promise<void> & entered) : entered(entered) {}
+
+        size_t read(char * data, size_t len) override
+        {
+            entered.set_value();
+            std::unique_lock guard(lock);
+            wakeup.wait(guard, [&] { return cancelled; });
+            throw Error("cancelled");
+        }
+
+        void cancel() override
+        {
+            std::lock_guard guard(lock);
+            cancelled = true;
+            wakeup.notify_all();
+        }
+    };
+
+    std::promise<void> entered;
+    auto source = std::make_unique<ReadAheadSource>(make_box_ptr<BlockingSource>(entered), 4096);
+    entered.get_future().wait();
+    // the inner read never returns on its own, so this would hang without cancelling it
+    source.reset();
+}
+
+}
@@ -1,6 +1,8 @@
 #include "lix/libutil/references.hh"
 #include "lix/libutil/strings.hh"
+#include <chrono>
 #include <gtest/gtest.h>
+#include <random>
 
 namespace nix {
 
@@ -41,4 +43,161 @@ INSTANTIATE_TEST_SUITE_P(
     )
 );
 
+static std::string randomHashPart(std::mt19937_64 & rng)
+{
+    std::string s(32, '0');
+    for (auto & c : s)
+        c = base32Chars[rng() % base32Chars.size()];
+    return s;
+}
+
+TEST(RefScanSink, classifierMatchesScalar)
+{
+    std::mt19937_64 rng(42);
+    std::string data(64 * 1024, 0);
+    for (auto & c : data)
+        c = char(rng());
+    /* Random bytes are rarely base-32, so have some runs too. */
+    for (size_t i = 0; i < data.size() / 2; ++i)
+        if (rng() % 2)
+            data[i] = base32Chars[rng() % base32Chars.size()];
+
+    for (size_t i = 0; i + 64 <= data.size(); ++i)
+        ASSERT_EQ(refscan_detail::classify(data.data() + i), refscan_detail::classifyScalar(data.data() + i, 64))
+            << "at offset " << i;
+}
+
+TEST(RefScanSink, refStartsCrossesWordBoundary)
+{
+    auto expected = [](uint64_t current, uint64_t next) {
+        uint64_t res = 0;
+        for (int i = 0; i < 64; ++i) {
+            bool all = true;
+            for (int j = i; j < i + 32; ++j)
+                all = all && ((j < 64 ? current >> j : next >> (j - 64)) & 1);
+            res |= uint64_t(all) << i;
+        }
+        return res;
+    };
+
+    /* Runs of 32 bits ending at every position of either word. */
+    for (int start = 0; start < 96; ++start) {
+        uint64_t current = 0, next = 0;
+        for (int j = start; j < start + 32; ++j)
+            (j < 64 ? current : next) |= uint64_t(1) << (j % 64);
+        ASSERT_EQ(refscan_detail::refStarts(current, next), expected(current, next)) << "run at " << start;
+        ASSERT_EQ(refscan_detail::refStarts(current, next), start < 64 ? uint64_t(1) << start : 0);
+        /* One bit short of a run. */
+        auto shortCurrent = current, shortNext = next;
+        auto last = start + 31;
+        (last < 64 ? shortCurrent : shortNext) &= ~(uint64_t(1) << (last % 64));
+        ASSERT_EQ(refscan_detail::refStarts(shortCurrent, shortNext), 0) << "short run at " << start;
+    }
+
+    std::mt19937_64 rng(4);
+    for (int round = 0; round < 10000; ++round) {
+        /* Mostly set bits, so that long runs are common. */
+        uint64_t current = rng() | rng() | rng(), next = rng() | rng() | rng();
+        ASSERT_EQ(refscan_detail::refStarts(current, next), expected(current, next));
+    }
+}
+
+TEST(RefScanSink, findsReferencesAtEveryOffset)
+{
+    std::mt19937_64 rng(1);
+    auto hash = randomHashPart(rng);
+
+    for (size_t offset = 0; offset < 200; ++offset) {
+        std::string data(offset, '\xff');
+        data += hash;
+        data += "\n";
+        RefScanSink sink(StringSet{hash, randomHashPart(rng)});
+        sink(data);
+        ASSERT_EQ(sink.getResult(), StringSet{hash}) << "at offset " << offset;
+    }
+}
+
+TEST(RefScanSink, findsReferencesSpanningFragments)
+{
+    std::mt19937_64 rng(2);
+    auto hash = randomHashPart(rng);
+    auto data = "/nix/store/" + hash + "-foo";
+
+    for (size_t split = 0; split <= data.size(); ++split) {
+        RefScanSink sink(StringSet{hash});
+        sink(std::string_view(data).substr(0, split));
+        sink(std::string_view(data).substr(split));
+        ASSERT_EQ(sink.getResult(), StringSet{hash}) << "split at " << split;
+    }
+
+    RefScanSink sink(StringSet{hash});
+    for (auto c : data)
+        sink(std::string_view(&c, 1));
+    ASSERT_EQ(sink.getResult(), StringSet{hash});
+}
+
+TEST(RefScanSink, findsReferencesInsideLongRuns)
+{
+    std::mt19937_64 rng(3);
+    auto a = randomHashPart(rng), b = randomHashPart(rng), c = randomHashPart(rng);
+
+    RefScanSink sink(StringSet{a, b, c, "tooshort"});
+    sink(randomHashPart(rng).substr(7) + a + b + randomHashPart(rng) + "tooshort");
+    ASSERT_EQ(sink.getResult(), (StringSet{a, b}));
+}
+
+TEST(HashModuloSink, matchesHashOfZeroedData)
+{
+    std::mt19937_64 rng(5);
+    auto modulus = randomHashPart(rng);
+    auto data = "head" + modulus + modulus + "mid" + modulus.substr(0, 20) + "/" + modulus + "tail";
+    auto zeroed = data;
+    for (size_t pos = 0; (pos = zeroed.find(modulus, pos)) != std::string::npos; )
+        std::fill_n(zeroed.begin() + pos, modulus.size(), 0);
+    auto expected = hashString(HashType::SHA256, zeroed);
+
+    for (size_t fragment = 1; fragment <= data.size(); ++fragment) {
+        HashModuloSink sink(HashType::SHA256, modulus);
+        for (size_t pos = 0; pos < data.size(); pos += fragment)
+            sink(std::string_view(data).substr(pos, fragment));
+        auto [hash, length] = sink.finish();
+        ASSERT_EQ(hash, expected) << "fragment size " << fragment;
+        ASSERT_EQ(length, data.size());
+    }
+
+    StringSource source{data};
+    ASSERT_EQ(computeHashModulo(HashType::SHA256, modulus, source).first, expected);
+}
+
+/**
+ * Not a test but a microbenchmark, run it with
+ * `liblixutil-tests --gtest_also_run_disabled_tests --gtest_filter='*benchmark*'`.
+ */
+TEST(RefScanSink, DISABLED_benchmarkScan1GiB)
+{
+    constexpr size_t total = size_t(1) << 30, chunkSize = 64 * 1024;
+
+    std::mt19937_64 rng(4);
+    std::string chunk(chunkSize, 0);
+    for (auto & c : chunk)
+        c = char(rng());
+    /* Binaries mostly consist of other bytes, but have some text in them. */
+    for (size_t i = 0; i < chunkSize / 8; ++i)
+        chunk[i] = base32Chars[rng() % base32Chars.size()];
+
+    StringSet hashes;
+    for (int i = 0; i < 100; ++i)
+        hashes.insert(randomHashPart(rng));
+    RefScanSink sink(std::move(hashes));
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t done = 0; done < total; done += chunkSize)
+        sink(chunk);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cerr << "scanned 1 GiB in " << elapsed.count() << "s ("
+              << 1024 / elapsed.count() << " MiB/s)\n";
+    ASSERT_TRUE(sink.getResult().empty());
+}
+
 }